@@ -0,0 +1,310 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* The admin listener. Clients of a listener handed to dpm.admin() never see
+ * lua: DPM sends the handshake, checks the login itself, and answers
+ * SHOW DPM STATUS with a resultset of the same counters dpm.stats() returns.
+ * COM_PING and COM_INIT_DB get an OK, anything else an error. Any mysql
+ * client can read the proxy's counters this way.
+ */
+
+#include <ctype.h>
+
+#include "proxy.h"
+#include "luaobj.h"
+#include "admin.h"
+
+#define ADMIN_PASS_LENGTH 40 /* Hex SHA1, as dpm.check_pass() takes. */
+
+/* One login per worker. Every worker runs the same startfile. */
+static __thread char admin_user[USERNAME_LENGTH];
+static __thread char admin_pass[ADMIN_PASS_LENGTH + 1];
+
+/* A resultset under construction. */
+typedef struct {
+    unsigned char *data;
+    int len;
+    int size;
+} admin_buf;
+
+/* LUA command: dpm.admin(listener, user, pass_hash). Clients of the
+ * listener are answered by DPM itself. pass_hash is in the same form as for
+ * dpm.check_pass(). */
+int admin_listener(lua_State *L)
+{
+    conn *l = check_conn(L, 1);
+    const char *user = luaL_checkstring(L, 2);
+    const char *pass = luaL_checkstring(L, 3);
+
+    if (l == NULL || !l->listener)
+        return luaL_error(L, "dpm.admin() needs a listener");
+    if (strlen(pass) != ADMIN_PASS_LENGTH)
+        return luaL_error(L, "Password hash must be %d hex digits", ADMIN_PASS_LENGTH);
+
+    strncpy(admin_user, user, USERNAME_LENGTH - 1);
+    strcpy(admin_pass, pass);
+    l->admin = 1;
+
+    return 0;
+}
+
+/* A new client on an admin listener. Say hello. */
+int admin_accept(conn *c)
+{
+    my_handshake_packet *hs = (my_handshake_packet *)my_new_handshake_packet();
+    int ret;
+
+    if (hs == NULL)
+        return -1;
+
+    /* Needed to check the login. */
+    memcpy(c->pool_seed, hs->scramble_buff, sizeof(c->pool_seed));
+    c->admin = ADMIN_LOGIN;
+
+    ret = conn_wire_packet(c, hs);
+    hs->h.free_me(hs);
+
+    return ret;
+}
+
+static int _admin_ok(conn *c)
+{
+    my_ok_packet *ok = (my_ok_packet *)my_new_ok_packet();
+    int ret;
+
+    if (ok == NULL)
+        return -1;
+    ret = conn_wire_packet(c, ok);
+    ok->h.free_me(ok);
+
+    return ret;
+}
+
+static int _admin_error(conn *c, int errnum, const char *sqlstate, const char *message)
+{
+    my_err_packet *err = (my_err_packet *)my_new_err_packet();
+    int ret;
+
+    if (err == NULL)
+        return -1;
+    err->errnum = errnum;
+    strcpy(err->sqlstate, sqlstate);
+    snprintf(err->message, sizeof(err->message), "%s", message);
+    ret = conn_wire_packet(c, err);
+    err->h.free_me(err);
+
+    return ret;
+}
+
+static int _admin_auth(conn *c, my_auth_packet *auth)
+{
+    char msg[MYSQL_ERRMSG_SIZE];
+
+    if (auth == NULL)
+        return -1;
+
+    if (admin_user[0] && strcmp(auth->user, admin_user) == 0 &&
+        my_check_scramble(auth->scramble_buff, c->pool_seed, admin_pass) == 0) {
+        c->admin = ADMIN_READY;
+        return _admin_ok(c);
+    }
+
+    if (verbose)
+        fprintf(stderr, "Admin login failed for user '%s'\n", auth->user);
+    snprintf(msg, sizeof(msg), "Access denied for user '%s'", auth->user);
+    return _admin_error(c, 1045, "28000", msg);
+}
+
+/* Does the query say the given words, whatever the case and spacing? A
+ * trailing ; is allowed. */
+static int _admin_query_is(const char *q, const char *words)
+{
+    while (isspace((unsigned char)*q))
+        q++;
+
+    while (*words) {
+        if (*words == ' ') {
+            if (!isspace((unsigned char)*q))
+                return 0;
+            while (isspace((unsigned char)*q))
+                q++;
+            words++;
+            continue;
+        }
+        if (tolower((unsigned char)*q) != *words)
+            return 0;
+        q++;
+        words++;
+    }
+
+    while (isspace((unsigned char)*q) || *q == ';')
+        q++;
+    return *q == '\0';
+}
+
+static int _abuf_room(admin_buf *b, int len)
+{
+    unsigned char *data;
+    int size = b->size ? b->size : 4096;
+
+    while (size < b->len + len)
+        size *= 2;
+    if (size == b->size)
+        return 0;
+
+    data = (unsigned char *)realloc(b->data, size);
+    if (data == NULL) {
+        perror("Could not realloc()");
+        return -1;
+    }
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+/* Appends a packet. conn_wire_bytes() fills in the sequence ids. */
+static int _abuf_packet(admin_buf *b, unsigned char *payload, int len)
+{
+    if (_abuf_room(b, len + 4) == -1)
+        return -1;
+    int3store(&b->data[b->len], len);
+    b->data[b->len + 3] = 0;
+    memcpy(&b->data[b->len + 4], payload, len);
+    b->len += len + 4;
+    return 0;
+}
+
+/* Length coded string. Everything we send is short. */
+static unsigned char *_admin_lstr(unsigned char *pos, const char *s)
+{
+    int len = strlen(s);
+
+    *pos++ = len;
+    memcpy(pos, s, len);
+    return pos + len;
+}
+
+static int _admin_field(admin_buf *b, const char *name, int length)
+{
+    unsigned char pkt[128];
+    unsigned char *pos = pkt;
+
+    pos = _admin_lstr(pos, "def");
+    pos = _admin_lstr(pos, ""); /* db */
+    pos = _admin_lstr(pos, ""); /* table */
+    pos = _admin_lstr(pos, ""); /* org_table */
+    pos = _admin_lstr(pos, name);
+    pos = _admin_lstr(pos, name);
+    *pos++ = 0x0c;
+    int2store(pos, 33); /* utf8_general_ci */
+    pos += 2;
+    int4store(pos, length);
+    pos += 4;
+    *pos++ = MYSQL_TYPE_VAR_STRING;
+    int2store(pos, 0); /* flags */
+    pos += 2;
+    *pos++ = 0; /* decimals */
+    int2store(pos, 0);
+    pos += 2;
+
+    return _abuf_packet(b, pkt, pos - pkt);
+}
+
+static int _admin_eof(admin_buf *b)
+{
+    unsigned char pkt[5];
+
+    pkt[0] = 254;
+    int2store(&pkt[1], 0); /* warnings */
+    int2store(&pkt[3], SERVER_STATUS_AUTOCOMMIT);
+
+    return _abuf_packet(b, pkt, sizeof(pkt));
+}
+
+/* dpm_stats_each() callback; one row per counter. */
+static void _admin_row(void *arg, const char *name, uint64_t value)
+{
+    admin_buf *b = (admin_buf *)arg;
+    unsigned char pkt[128];
+    unsigned char *pos = pkt;
+    char num[24];
+
+    /* An earlier row couldn't be added. */
+    if (b->len == -1)
+        return;
+
+    snprintf(num, sizeof(num), "%llu", (unsigned long long) value);
+    pos = _admin_lstr(pos, name);
+    pos = _admin_lstr(pos, num);
+
+    if (_abuf_packet(b, pkt, pos - pkt) == -1)
+        b->len = -1;
+}
+
+static int _admin_status(conn *c)
+{
+    admin_buf b;
+    unsigned char count = 2;
+    int ret = -1;
+
+    memset(&b, 0, sizeof(b));
+
+    if (_abuf_packet(&b, &count, 1) == -1 ||
+        _admin_field(&b, "Variable_name", 64) == -1 ||
+        _admin_field(&b, "Value", 20) == -1 ||
+        _admin_eof(&b) == -1)
+        goto done;
+
+    dpm_stats_each(_admin_row, &b);
+    if (b.len == -1 || _admin_eof(&b) == -1)
+        goto done;
+
+    /* Nothing was parsed, so the state machine needs telling. */
+    ret = conn_wire_bytes(c, b.data, b.len);
+    c->dpmstate = MYC_WAITING;
+
+done:
+    free(b.data);
+    return ret;
+}
+
+static int _admin_command(conn *c, my_cmd_packet *cmd)
+{
+    if (cmd == NULL)
+        return -1;
+
+    /* Nothing before the login. */
+    if (c->admin != ADMIN_READY)
+        return -1;
+
+    switch (cmd->command) {
+    case COM_QUIT:
+        return -1;
+    case COM_PING:
+    case COM_INIT_DB:
+        return _admin_ok(c);
+    case COM_QUERY:
+        if (cmd->argument && _admin_query_is(cmd->argument, "show dpm status"))
+            return _admin_status(c);
+        return _admin_error(c, 1064, "42000", "Only SHOW DPM STATUS is supported here");
+    }
+
+    return _admin_error(c, 1047, "08S01", "Unknown command");
+}
+
+/* A packet from an admin client. Returns -1 if it should be closed. */
+int admin_packet(conn *c, void *p, int ptype)
+{
+    switch (ptype) {
+    case dpm_auth:
+        return _admin_auth(c, (my_auth_packet *)p);
+    case dpm_cmd:
+        return _admin_command(c, (my_cmd_packet *)p);
+    }
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* The admin listener. See admin.c */
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+enum admin_states {
+    ADMIN_NONE, /* Not an admin conn. */
+    ADMIN_LOGIN, /* Handshake sent, waiting for the login. */
+    ADMIN_READY, /* Logged in. */
+};
+
+int admin_listener(lua_State *L);
+int admin_accept(conn *c);
+int admin_packet(conn *c, void *p, int ptype);
+
+#endif /* ADMIN_H */
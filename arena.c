@@ -0,0 +1,98 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Packets consumed off the wire only live for one command/response cycle,
+ * unless lua pins them. Rather than a malloc() and free() (or three) for
+ * every one of them, they're carved out of a per-conn arena which is thrown
+ * away in one go when the cycle is over. Arena memory comes out of the
+ * worker's buffer pool, so an idle conn holds none of it.
+ */
+
+#include "proxy.h"
+
+/* Small enough to come from the smallest pool class. */
+#define ARENA_CHUNK_SIZE 2048
+#define ARENA_ALIGN 8
+
+/* Unique per worker thread, never reused. */
+static __thread uint64_t arena_generation = 0;
+
+void arena_init(dpm_arena *a)
+{
+    a->chunks = NULL;
+    a->gen    = ++arena_generation;
+}
+
+/* Returns len bytes of uninitialized memory, or NULL. */
+void *arena_alloc(dpm_arena *a, size_t len)
+{
+    arena_chunk *chunk = a->chunks;
+    int hsize = (sizeof(arena_chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    int gotsize;
+    void *ptr;
+
+    len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < (int)len) {
+        /* Big allocations get a chunk to themselves. */
+        chunk = (arena_chunk *)bufpool_get(len + hsize > ARENA_CHUNK_SIZE ?
+                (int)len + hsize : ARENA_CHUNK_SIZE, &gotsize);
+        if (chunk == NULL)
+            return NULL;
+        chunk->size = gotsize;
+        chunk->used = hsize;
+        chunk->next = a->chunks;
+        a->chunks   = chunk;
+    }
+
+    ptr = (unsigned char *)chunk + chunk->used;
+    chunk->used += len;
+    return ptr;
+}
+
+/* Drop everything, but hang on to one chunk for the next round. */
+void arena_reset(dpm_arena *a)
+{
+    arena_chunk *chunk = a->chunks;
+    arena_chunk *next;
+    int hsize = (sizeof(arena_chunk) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (chunk == NULL || (chunk->next == NULL && chunk->used == hsize))
+        return;
+
+    /* The oldest chunk is the normal sized one, if any are. */
+    while (chunk->next) {
+        next = chunk->next;
+        bufpool_put((unsigned char *)chunk, chunk->size);
+        chunk = next;
+    }
+    if (chunk->size != ARENA_CHUNK_SIZE) {
+        bufpool_put((unsigned char *)chunk, chunk->size);
+        chunk = NULL;
+    } else {
+        chunk->used = hsize;
+    }
+
+    a->chunks = chunk;
+    a->gen    = ++arena_generation;
+}
+
+/* Drop everything and give all the memory back to the pool. */
+void arena_free(dpm_arena *a)
+{
+    arena_chunk *chunk;
+
+    if (a->chunks == NULL)
+        return;
+
+    while ( (chunk = a->chunks) != NULL ) {
+        a->chunks = chunk->next;
+        bufpool_put((unsigned char *)chunk, chunk->size);
+    }
+
+    a->gen = ++arena_generation;
+}
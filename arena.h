@@ -0,0 +1,33 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Bump allocator for packets parsed off the wire. */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/* Chunks are borrowed from the buffer pool. The header sits at the front. */
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    int    size; /* Size handed out by the pool, header included. */
+    int    used; /* Bytes carved off, header included. */
+} arena_chunk;
+
+/* Everything carved from an arena goes away at once. 'gen' changes every
+ * time that happens, so a holder of an arena pointer can tell whether it's
+ * still good by remembering the generation it saw. */
+typedef struct {
+    arena_chunk *chunks; /* Newest first. */
+    uint64_t     gen;
+} dpm_arena;
+
+void arena_init(dpm_arena *a);
+void *arena_alloc(dpm_arena *a, size_t len);
+void arena_reset(dpm_arena *a);
+void arena_free(dpm_arena *a);
+
+#endif /* ARENA_H */
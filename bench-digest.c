@@ -0,0 +1,86 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Times digest_query() over a mix of OLTP statements, sysbench style.
+ * make bench-digest && ./bench-digest [iterations] [-v]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "digest.h"
+
+static const char *queries[] = {
+    "SELECT c FROM sbtest1 WHERE id=4987",
+    "SELECT c FROM sbtest1 WHERE id BETWEEN 5012 AND 5111",
+    "SELECT SUM(k) FROM sbtest1 WHERE id BETWEEN 2316 AND 2415",
+    "SELECT c FROM sbtest1 WHERE id BETWEEN 4911 AND 5010 ORDER BY c",
+    "SELECT DISTINCT c FROM sbtest1 WHERE id BETWEEN 1 AND 100 ORDER BY c",
+    "UPDATE sbtest1 SET k=k+1 WHERE id=5022",
+    "UPDATE sbtest1 SET c='83868641912-28773972837-60736120486-75162659906-27563526494-20381887404-41576422241-93426793964-56405065102-33518432330' WHERE id=5041",
+    "DELETE FROM sbtest1 WHERE id=4975",
+    "INSERT INTO sbtest1 (id, k, c, pad) VALUES (4975, 5016, '49523471452-61024213412-28735432190-36723041856-47233542163-25513513124-73214528316-68232117863-43285213128-81424425312', '43762813146-80523120478-17530246122-67530218423-15263418632')",
+    "SELECT id, name, email FROM users WHERE account_id IN (12, 55, 89, 144, 233, 377, 610, 987) AND deleted_at IS NULL",
+    "/* app:checkout host:web12 */ SELECT o.id, o.total, i.sku, i.qty\n  FROM orders o\n  JOIN order_items i ON i.order_id = o.id\n WHERE o.customer_id = 99812\n   AND o.status = \"open\"\n ORDER BY o.created_at DESC LIMIT 20",
+    "BEGIN",
+    "COMMIT",
+    NULL,
+};
+
+int main(int argc, char **argv)
+{
+    int iterations = 1000000;
+    int verbose = 0;
+    int i, n, len, outlen;
+    long long bytes = 0, count = 0;
+    uint64_t hash, sink = 0;
+    struct timeval start, stop;
+    double secs;
+    char *out;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else {
+            iterations = atoi(argv[i]);
+        }
+    }
+
+    out = (char *)malloc(DIGEST_OUT_SIZE(4096));
+    if (out == NULL) {
+        perror("Could not malloc()");
+        return 1;
+    }
+
+    if (verbose) {
+        for (n = 0; queries[n]; n++) {
+            hash = digest_query(queries[n], strlen(queries[n]), out, &outlen);
+            printf("%016llx %.*s\n", (unsigned long long) hash, outlen, out);
+        }
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++) {
+        for (n = 0; queries[n]; n++) {
+            len = strlen(queries[n]);
+            sink += digest_query(queries[n], len, out, &outlen);
+            bytes += len;
+            count++;
+        }
+    }
+    gettimeofday(&stop, NULL);
+
+    secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+    printf("%lld queries in %.3fs: %.1f ns/query, %.1f MB/s (%llx)\n", count, secs,
+        secs * 1e9 / count, bytes / secs / (1024 * 1024), (unsigned long long) sink);
+
+    free(out);
+    return 0;
+}
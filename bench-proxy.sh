@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# What DPM costs per query: runs dpm-bench straight at a mysqld, then
+# through dpm with each startfile, and prints the difference.
+#
+# ./bench-proxy.sh -u whee -P toast -c 16 -t 10
+#
+# Arguments are passed to dpm-bench; -h and -p are filled in. The demo
+# startfiles listen on 127.0.0.1:5500 and use a mysqld on 127.0.0.1:3306.
+# Override with the variables below, e.g. STARTFILES="lua/startup.lua".
+#
+
+DPM=${DPM:-./dpm}
+DPM_ARGS=${DPM_ARGS:-}
+BENCH=${BENCH:-./dpm-bench}
+BACKEND_HOST=${BACKEND_HOST:-127.0.0.1}
+BACKEND_PORT=${BACKEND_PORT:-3306}
+PROXY_HOST=${PROXY_HOST:-127.0.0.1}
+PROXY_PORT=${PROXY_PORT:-5500}
+STARTFILES=${STARTFILES:-"lua/demo-direct.lua lua/demo-autoexplain.lua lua/demo-lib.lua lua/startup.lua"}
+
+for f in "$DPM" "$BENCH"; do
+    if [ ! -x "$f" ]; then
+        echo "$f not found; run make and make dpm-bench first" >&2
+        exit 1
+    fi
+done
+
+# Pulls one field out of dpm-bench's summary line.
+field() {
+    sed -n "s/^summary .*$1=\([0-9.]*\).*/\1/p"
+}
+
+run() {
+    label=$1
+    shift
+    echo "== $label"
+    out=`"$BENCH" "$@"`
+    status=$?
+    echo "$out" | grep -v '^summary '
+    if [ $status -ne 0 ]; then
+        return 1
+    fi
+    qps=`echo "$out" | field qps`
+    mean=`echo "$out" | field mean_us`
+    p99=`echo "$out" | field p99_us`
+}
+
+if ! run "direct $BACKEND_HOST:$BACKEND_PORT" -h "$BACKEND_HOST" -p "$BACKEND_PORT" "$@"; then
+    echo "Could not benchmark the backend" >&2
+    exit 1
+fi
+base_qps=$qps
+base_mean=$mean
+base_p99=$p99
+report="direct: $base_qps qps, mean ${base_mean}us, p99 ${base_p99}us"
+
+for startfile in $STARTFILES; do
+    $DPM -s "$startfile" $DPM_ARGS > /dev/null 2>&1 &
+    pid=$!
+    sleep ${DPM_WAIT:-1}
+
+    if run "dpm $startfile" -h "$PROXY_HOST" -p "$PROXY_PORT" "$@"; then
+        line=`echo "$mean $p99 $base_mean $base_p99" | awk '{ printf "%+.1fus mean, %+.1fus p99", $1 - $3, $2 - $4 }'`
+        report="$report
+$startfile: $qps qps, mean ${mean}us, p99 ${p99}us; overhead $line"
+    else
+        report="$report
+$startfile: failed"
+    fi
+
+    kill $pid 2> /dev/null
+    wait $pid 2> /dev/null
+done
+
+echo
+echo "$report"
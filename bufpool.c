@@ -0,0 +1,108 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Network buffers are only held while a packet is in flight. A mostly idle
+ * connection has no buffers at all; busy ones borrow from here and hand them
+ * back when they're drained. Buffers which would push the idle pool past
+ * max_free are released to malloc instead, so a burst of huge packets
+ * doesn't stay pinned forever.
+ */
+
+#include "proxy.h"
+
+static __thread bufpool *pool = NULL;
+
+/* Attach the calling thread to its pool. */
+void bufpool_init(bufpool *p, uint64_t max_free)
+{
+    memset(p, 0, sizeof(bufpool));
+    p->max_free = max_free;
+    pool = p;
+}
+
+/* Smallest class which fits size, or -1 if it's bigger than all of them. */
+static int bufpool_class(int size)
+{
+    int cls = 0;
+
+    while ((1 << (cls + BUFPOOL_MIN_SHIFT)) < size) {
+        if (++cls == BUFPOOL_CLASSES)
+            return -1;
+    }
+    return cls;
+}
+
+/* Returns a buffer of at least size bytes, or NULL. The real size, which
+ * must be passed back to bufpool_put(), goes into gotsize. */
+unsigned char *bufpool_get(int size, int *gotsize)
+{
+    bufpool_chunk *chunk;
+    int cls = bufpool_class(size);
+    int realsize;
+
+    if (cls == -1) {
+        /* Keep to powers of two so growing buffers double as before. */
+        realsize = 1 << (BUFPOOL_MIN_SHIFT + BUFPOOL_CLASSES);
+        while (realsize < size)
+            realsize *= 2;
+        chunk = malloc(realsize);
+        if (chunk == NULL)
+            return NULL;
+        pool->gets++;
+        pool->misses++;
+        pool->used_bytes += realsize;
+        *gotsize = realsize;
+        return (unsigned char *)chunk;
+    }
+
+    realsize = 1 << (cls + BUFPOOL_MIN_SHIFT);
+
+    if (pool->free[cls]) {
+        chunk = pool->free[cls];
+        pool->free[cls] = chunk->next;
+        pool->free_count[cls]--;
+        pool->free_bytes -= realsize;
+    } else {
+        chunk = malloc(realsize);
+        if (chunk == NULL)
+            return NULL;
+        pool->misses++;
+    }
+
+    pool->gets++;
+    pool->used_count[cls]++;
+    pool->used_bytes += realsize;
+    *gotsize = realsize;
+    return (unsigned char *)chunk;
+}
+
+void bufpool_put(unsigned char *buf, int size)
+{
+    bufpool_chunk *chunk = (bufpool_chunk *)buf;
+    int cls = bufpool_class(size);
+
+    pool->used_bytes -= size;
+
+    if (cls == -1) {
+        pool->trims++;
+        free(buf);
+        return;
+    }
+
+    pool->used_count[cls]--;
+
+    if (pool->free_bytes + size > pool->max_free) {
+        pool->trims++;
+        free(buf);
+        return;
+    }
+
+    chunk->next = pool->free[cls];
+    pool->free[cls] = chunk;
+    pool->free_count[cls]++;
+    pool->free_bytes += size;
+}
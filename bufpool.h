@@ -0,0 +1,41 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Size classed pool of network buffers. */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+/* Classes are powers of two from 2k to 1M. Anything bigger is malloc()'ed
+ * and free()'d directly. */
+#define BUFPOOL_MIN_SHIFT 11
+#define BUFPOOL_CLASSES   10
+
+/* Free buffers are chained through their own first bytes. */
+typedef struct bufpool_chunk {
+    struct bufpool_chunk *next;
+} bufpool_chunk;
+
+/* One of these per worker thread; buffers never cross threads. The counters
+ * are only written by the owner, and can be read by anyone for stats. */
+typedef struct {
+    bufpool_chunk *free[BUFPOOL_CLASSES];
+    int      free_count[BUFPOOL_CLASSES];
+    int      used_count[BUFPOOL_CLASSES];
+    uint64_t free_bytes; /* bytes sitting idle in the pool */
+    uint64_t used_bytes; /* bytes handed out, including oversized buffers */
+    uint64_t max_free; /* idle bytes kept before buffers are free()'d */
+    uint64_t gets; /* buffers handed out */
+    uint64_t misses; /* ... which had to be malloc()'ed */
+    uint64_t trims; /* buffers free()'d on return instead of pooled */
+} bufpool;
+
+void bufpool_init(bufpool *p, uint64_t max_free);
+unsigned char *bufpool_get(int size, int *gotsize);
+void bufpool_put(unsigned char *buf, int size);
+
+#endif /* BUFPOOL_H */
@@ -0,0 +1,1009 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Result cache. Clients attached to a cache have their SELECTs looked up by
+ * user, db and query text (whitespace squeezed) before they go anywhere. A
+ * hit is answered straight from the cache: the result set bytes the first
+ * client was sent are written out again in one go, with new sequence ids. A
+ * miss is captured as it's forwarded, and stored once the last EOF is through.
+ *
+ * Entries live for a TTL, and the memory they use is capped; past the cap
+ * entries are evicted CLOCK style, unreferenced first. Each entry is tagged
+ * with the tables its query reads. Writes to a table seen going through the
+ * proxy make every entry tagged with it stale: each table has a write count,
+ * and an entry stored before the last write is thrown away on lookup.
+ * Writes made around the proxy are only caught by the TTL.
+ *
+ * Entries are per worker thread, but the write counts are shared by the whole
+ * process, so a write through one worker invalidates every worker's copies.
+ * They're a fixed array of atomic counters indexed by table name hash; two
+ * tables landing in one slot only cost some extra misses. A write we can't
+ * follow bumps a process wide flush count, which every entry is checked
+ * against as well.
+ */
+
+#include <ctype.h>
+
+#include "proxy.h"
+#include "luaobj.h"
+#include "cache.h"
+
+#define CACHE_BUCKETS 1024 /* Starting size of the hash table. */
+#define CACHE_TAG_SLOTS 4096 /* Process wide table write counts. Power of two. */
+
+/* FNV-1a */
+#define CACHE_HASH_INIT 14695981039346656037ULL
+#define CACHE_HASH_PRIME 1099511628211ULL
+
+static uint64_t cache_tag_gens[CACHE_TAG_SLOTS];
+static uint64_t cache_flush_gen;
+
+/* Anything in a SELECT which makes its result depend on more than the
+ * tables it reads. */
+static const char *cache_bad_words[] = {
+    "FOR UPDATE",
+    "LOCK IN SHARE MODE",
+    "SQL_NO_CACHE",
+    "INTO",
+    "NOW(",
+    "RAND(",
+    "UUID",
+    "CURRENT_",
+    "CURDATE",
+    "CURTIME",
+    "SYSDATE",
+    "UNIX_TIMESTAMP",
+    "LAST_INSERT_ID",
+    "FOUND_ROWS",
+    "ROW_COUNT",
+    "CONNECTION_ID",
+    "GET_LOCK",
+    "SLEEP(",
+    "DATABASE(",
+    "USER(",
+    "@",
+    NULL,
+};
+
+/* Statements which change tables. */
+static const char *cache_write_starts[] = {
+    "INSERT",
+    "UPDATE",
+    "DELETE",
+    "REPLACE",
+    "TRUNCATE",
+    "ALTER",
+    "DROP",
+    "RENAME",
+    "LOAD",
+    "CREATE",
+    "CALL",
+    NULL,
+};
+
+/* Words which end a FROM list. */
+static const char *cache_from_ends[] = {
+    "WHERE",
+    "GROUP",
+    "ORDER",
+    "LIMIT",
+    "HAVING",
+    "ON",
+    "USING",
+    "SET",
+    "VALUES",
+    "UNION",
+    "FOR",
+    "LOCK",
+    "PROCEDURE",
+    "INTO",
+    NULL,
+};
+
+/* Words between a FROM, INTO, etc. and the table name. */
+static const char *cache_modifiers[] = {
+    "IGNORE",
+    "LOW_PRIORITY",
+    "HIGH_PRIORITY",
+    "DELAYED",
+    "QUICK",
+    "TABLE",
+    "TEMPORARY",
+    "ONLY",
+    "IF",
+    "NOT",
+    "EXISTS",
+    NULL,
+};
+
+static uint64_t _cache_hash(uint64_t hash, const char *str, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= CACHE_HASH_PRIME;
+    }
+    return hash;
+}
+
+static int _cache_in(const char *word, int wlen, const char **list)
+{
+    int i;
+
+    for (i = 0; list[i]; i++) {
+        if ((int)strlen(list[i]) == wlen && strncasecmp(word, list[i], wlen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int _cache_is_ident(char c)
+{
+    return isalnum((unsigned char)c) || c == '_' || c == '$' || c == '`' || c == '.';
+}
+
+/* Step over whitespace, parens and comments at the front of a query. */
+static void _cache_skip(const char **q, int *len)
+{
+    for (;;) {
+        while (*len && (isspace((unsigned char)**q) || **q == '(')) {
+            (*q)++;
+            (*len)--;
+        }
+        if (*len < 2 || (*q)[0] != '/' || (*q)[1] != '*')
+            return;
+        for (*q += 2, *len -= 2; *len >= 2 && ((*q)[0] != '*' || (*q)[1] != '/'); (*q)++, (*len)--);
+        if (*len < 2) {
+            *len = 0;
+            return;
+        }
+        *q   += 2;
+        *len -= 2;
+    }
+}
+
+/* Does the query start with one of these words? */
+static int _cache_starts(const char *q, int len, const char **list)
+{
+    int wlen = 0;
+
+    _cache_skip(&q, &len);
+    while (wlen < len && isalpha((unsigned char)q[wlen]))
+        wlen++;
+
+    return _cache_in(q, wlen, list);
+}
+
+/* Can this query's result be cached, going by its text alone? */
+static int _cache_default_ok(const char *q, int len)
+{
+    static const char *select[] = { "SELECT", NULL };
+    int wlen, i, j;
+
+    if (!_cache_starts(q, len, select))
+        return 0;
+
+    for (i = 0; cache_bad_words[i]; i++) {
+        wlen = strlen(cache_bad_words[i]);
+        for (j = 0; j + wlen <= len; j++) {
+            if (toupper((unsigned char)q[j]) == cache_bad_words[i][0] &&
+                strncasecmp(q + j, cache_bad_words[i], wlen) == 0)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Hash of a table name: lower case, without quotes or a db in front. */
+static uint64_t _cache_name_hash(const char *name, int len)
+{
+    uint64_t hash = CACHE_HASH_INIT;
+    const char *dot;
+    char ch;
+    int i;
+
+    for (dot = name + len - 1; dot >= name && *dot != '.'; dot--);
+    len -= dot + 1 - name;
+    name = dot + 1;
+
+    for (i = 0; i < len; i++) {
+        if (name[i] == '`')
+            continue;
+        ch = tolower((unsigned char)name[i]);
+        hash ^= (unsigned char)ch;
+        hash *= CACHE_HASH_PRIME;
+    }
+    return hash;
+}
+
+/* Find the tables a statement names after FROM, JOIN, INTO, UPDATE and
+ * TABLE, and in FROM lists. Returns how many went in tags, or -1 if there
+ * were more than max. */
+static int _cache_tables(const char *q, int len, uint64_t *tags, int max)
+{
+    const char *end = q + len;
+    const char *word;
+    uint64_t hash;
+    int n = 0, want = 0, in_from = 0, depth = 0, from_depth = 0;
+    int wlen, i;
+    char quote;
+
+    while (q < end) {
+        switch (*q) {
+        case '\'':
+        case '"':
+            for (quote = *q++; q < end && *q != quote; q++) {
+                if (*q == '\\')
+                    q++;
+            }
+            q++;
+            want = 0;
+            continue;
+        case '(':
+            /* A subquery or a column list; not a table. */
+            depth++;
+            want = 0;
+            q++;
+            continue;
+        case ')':
+            if (--depth < from_depth)
+                in_from = 0;
+            q++;
+            continue;
+        case ',':
+            if (in_from && depth == from_depth)
+                want = 1;
+            q++;
+            continue;
+        }
+
+        if (!_cache_is_ident(*q)) {
+            q++;
+            continue;
+        }
+
+        word = q;
+        while (q < end && _cache_is_ident(*q))
+            q++;
+        wlen = q - word;
+
+        if (want) {
+            if (_cache_in(word, wlen, cache_modifiers))
+                continue;
+            want = 0;
+            hash = _cache_name_hash(word, wlen);
+            for (i = 0; i < n && tags[i] != hash; i++);
+            if (i < n)
+                continue;
+            if (n == max)
+                return -1;
+            tags[n++] = hash;
+        } else if (wlen == 4 && strncasecmp(word, "FROM", 4) == 0) {
+            want       = 1;
+            in_from    = 1;
+            from_depth = depth;
+        } else if ((wlen == 4 && strncasecmp(word, "JOIN", 4) == 0) ||
+                   (wlen == 4 && strncasecmp(word, "INTO", 4) == 0) ||
+                   (wlen == 6 && strncasecmp(word, "UPDATE", 6) == 0) ||
+                   (wlen == 5 && strncasecmp(word, "TABLE", 5) == 0)) {
+            want = 1;
+        } else if (in_from && _cache_in(word, wlen, cache_from_ends)) {
+            in_from = 0;
+        }
+    }
+
+    return n;
+}
+
+/* Squeeze runs of whitespace outside of quotes to one space, and drop it and
+ * any ';' from the ends. out needs len bytes. Returns the new length. */
+static int _cache_normalize(const char *q, int len, char *out)
+{
+    int o = 0, i;
+    char quote = 0;
+
+    for (i = 0; i < len; i++) {
+        if (quote) {
+            out[o++] = q[i];
+            if (q[i] == '\\' && i + 1 < len) {
+                out[o++] = q[++i];
+            } else if (q[i] == quote) {
+                quote = 0;
+            }
+        } else if (isspace((unsigned char)q[i])) {
+            if (o && out[o - 1] != ' ')
+                out[o++] = ' ';
+        } else {
+            if (q[i] == '\'' || q[i] == '"' || q[i] == '`')
+                quote = q[i];
+            out[o++] = q[i];
+        }
+    }
+
+    while (o && (out[o - 1] == ' ' || out[o - 1] == ';'))
+        o--;
+
+    return o;
+}
+
+/*
+ * Table write counts.
+ */
+
+static uint64_t _cache_tag_gen(uint64_t hash)
+{
+    return __atomic_load_n(&cache_tag_gens[hash & (CACHE_TAG_SLOTS - 1)], __ATOMIC_ACQUIRE);
+}
+
+static void _cache_tag_bump(dpm_cache *cache, uint64_t hash)
+{
+    cache->invalidations++;
+    __atomic_add_fetch(&cache_tag_gens[hash & (CACHE_TAG_SLOTS - 1)], 1, __ATOMIC_ACQ_REL);
+}
+
+static uint64_t _cache_flush_gen(void)
+{
+    return __atomic_load_n(&cache_flush_gen, __ATOMIC_ACQUIRE);
+}
+
+static void _cache_flush(dpm_cache *cache);
+
+/* Empties this cache, and makes every other worker's entries stale too. */
+static void _cache_flush_all(dpm_cache *cache)
+{
+    __atomic_add_fetch(&cache_flush_gen, 1, __ATOMIC_ACQ_REL);
+    _cache_flush(cache);
+}
+
+/*
+ * Entries.
+ */
+
+static cache_entry *_cache_find(dpm_cache *cache, uint64_t hash, const char *key, int keylen)
+{
+    cache_entry *e;
+
+    for (e = cache->table[hash & (cache->buckets - 1)]; e; e = e->hnext) {
+        if (e->hash == hash && e->keylen == keylen && memcmp(e->key, key, keylen) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static int _cache_entry_size(cache_entry *e)
+{
+    return sizeof(cache_entry) + e->keylen + e->len;
+}
+
+static void _cache_entry_unlink(dpm_cache *cache, cache_entry *e)
+{
+    cache_entry **prev = &cache->table[e->hash & (cache->buckets - 1)];
+
+    while (*prev != e)
+        prev = &(*prev)->hnext;
+    *prev = e->hnext;
+
+    if (e->next == e) {
+        cache->hand = NULL;
+    } else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (cache->hand == e)
+            cache->hand = e->next;
+    }
+
+    cache->entries--;
+    cache->bytes -= _cache_entry_size(e);
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+static void _cache_flush(dpm_cache *cache)
+{
+    while (cache->hand)
+        _cache_entry_unlink(cache, cache->hand);
+}
+
+static int _cache_stale(cache_entry *e)
+{
+    int i;
+
+    if (_cache_flush_gen() != e->flushgen)
+        return 1;
+    for (i = 0; i < e->ntags; i++) {
+        if (_cache_tag_gen(e->tags[i].hash) != e->tags[i].gen)
+            return 1;
+    }
+    return 0;
+}
+
+/* Go round the clock until there's room for 'need' more bytes. Entries hit
+ * since the hand last passed get another go round. */
+static void _cache_evict(dpm_cache *cache, int need, time_t now)
+{
+    cache_entry *e;
+
+    while (cache->hand && cache->bytes + need > cache->memory) {
+        e = cache->hand;
+        if (e->referenced && e->expires > now) {
+            e->referenced = 0;
+            cache->hand   = e->next;
+            continue;
+        }
+        if (e->expires <= now) {
+            cache->expired++;
+        } else {
+            cache->evictions++;
+        }
+        _cache_entry_unlink(cache, e);
+    }
+}
+
+static void _cache_grow(dpm_cache *cache)
+{
+    cache_entry **table;
+    cache_entry *e, *next;
+    int buckets = cache->buckets * 2;
+    int i;
+
+    table = (cache_entry **)calloc(buckets, sizeof(cache_entry *));
+    if (table == NULL)
+        return;
+
+    for (i = 0; i < cache->buckets; i++) {
+        for (e = cache->table[i]; e; e = next) {
+            next     = e->hnext;
+            e->hnext = table[e->hash & (buckets - 1)];
+            table[e->hash & (buckets - 1)] = e;
+        }
+    }
+
+    free(cache->table);
+    cache->table   = table;
+    cache->buckets = buckets;
+}
+
+/* Store what a client captured. Takes its key and buffer. */
+static void _cache_store(dpm_cache *cache, cache_client *cc)
+{
+    cache_entry *e;
+    time_t now = time(NULL);
+    int i;
+
+    /* Written to while we were reading; it may be out of date already. */
+    if (_cache_flush_gen() != cc->flushgen)
+        return;
+    for (i = 0; i < cc->ntags; i++) {
+        if (_cache_tag_gen(cc->tags[i].hash) != cc->tags[i].gen)
+            return;
+    }
+
+    if ( (e = _cache_find(cache, cc->hash, cc->key, cc->keylen)) != NULL )
+        _cache_entry_unlink(cache, e);
+
+    e = (cache_entry *)malloc( sizeof(cache_entry) );
+    if (e == NULL) {
+        perror("Could not malloc()");
+        return;
+    }
+    e->hash    = cc->hash;
+    e->key     = cc->key;
+    e->keylen  = cc->keylen;
+    e->data    = cc->buf;
+    e->len     = cc->buflen;
+    e->expires = now + cc->ttl;
+    e->referenced = 0;
+    e->flushgen = cc->flushgen;
+    e->ntags   = cc->ntags;
+    memcpy(e->tags, cc->tags, sizeof(cache_tag) * cc->ntags);
+    cc->key     = NULL;
+    cc->buf     = NULL;
+    cc->bufsize = 0;
+
+    _cache_evict(cache, _cache_entry_size(e), now);
+    if (cache->bytes + _cache_entry_size(e) > cache->memory) {
+        free(e->key);
+        free(e->data);
+        free(e);
+        return;
+    }
+
+    if (cache->entries >= cache->buckets)
+        _cache_grow(cache);
+
+    e->hnext = cache->table[e->hash & (cache->buckets - 1)];
+    cache->table[e->hash & (cache->buckets - 1)] = e;
+
+    /* Newest goes just behind the hand, so it's visited last. */
+    if (cache->hand) {
+        e->next = cache->hand;
+        e->prev = cache->hand->prev;
+        e->prev->next = e;
+        cache->hand->prev = e;
+    } else {
+        e->next = e->prev = e;
+        cache->hand = e;
+    }
+
+    cache->entries++;
+    cache->bytes += _cache_entry_size(e);
+    cache->stores++;
+}
+
+/*
+ * Clients.
+ */
+
+/* Forget a miss being filled, if there is one. */
+void cache_abort(conn *c)
+{
+    cache_client *cc = c->cache;
+
+    cc->armed   = 0;
+    cc->filling = 0;
+    cc->buflen  = 0;
+    if (cc->key) {
+        free(cc->key);
+        cc->key = NULL;
+    }
+    if (cc->buf && cc->bufsize > cc->cache->max_entry) {
+        free(cc->buf);
+        cc->buf     = NULL;
+        cc->bufsize = 0;
+    }
+}
+
+/* Ask lua how long to cache a query for. Returns -1 if it has no opinion. */
+static int _cache_rule(dpm_cache *cache, cache_client *cc, const char *q, int len)
+{
+    int top = lua_gettop(L);
+    int ttl = -1;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cache->rule);
+    lua_pushlstring(L, q, len);
+    if (cc->db) {
+        lua_pushstring(L, cc->db);
+    } else {
+        lua_pushnil(L);
+    }
+
+    if (lua_pcall(L, 2, 1, 0) != 0) {
+        fprintf(stderr, "ERROR: running cache rule: %s\n", lua_tostring(L, -1));
+    } else if (lua_isnumber(L, -1)) {
+        ttl = lua_tointeger(L, -1);
+    } else if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        ttl = 0;
+    }
+
+    lua_settop(L, top);
+    return ttl;
+}
+
+/* Called from run_protocol() with a client's new command at readto. Answers
+ * it from the cache if possible. Returns 1 if it was answered, 0 if it should
+ * go on as usual, or -1 if the client should be closed. */
+int cache_client_command(conn *c)
+{
+    cache_client *cc = c->cache;
+    dpm_cache *cache = cc->cache;
+    const char *q = (const char *)c->rbuf + c->readto + 5;
+    int qlen = c->packetsize - 5;
+    int len, ulen, dlen, ttl, i;
+    uint64_t tags[CACHE_MAX_TAGS];
+    uint64_t hash;
+    cache_entry *e;
+    char *key;
+
+    cc->checked = 1;
+
+    /* Something's already in flight, which we'd answer ahead of. */
+    if (cc->armed || cc->filling)
+        return 0;
+    if (c->big_packet || c->rbuf[c->readto + 4] != COM_QUERY)
+        return 0;
+    if (cc->in_trans) {
+        cache->uncacheable++;
+        return 0;
+    }
+
+    ttl = cache->rule ? _cache_rule(cache, cc, q, qlen) : -1;
+    if (ttl == -1)
+        ttl = _cache_default_ok(q, qlen) ? cache->ttl : 0;
+    if (ttl <= 0) {
+        cache->uncacheable++;
+        return 0;
+    }
+
+    ulen = cc->user ? strlen(cc->user) : 0;
+    dlen = cc->db ? strlen(cc->db) : 0;
+    key  = (char *)malloc(ulen + dlen + qlen + 2);
+    if (key == NULL) {
+        perror("Could not malloc()");
+        return 0;
+    }
+    if (ulen)
+        memcpy(key, cc->user, ulen);
+    key[ulen] = '\0';
+    if (dlen)
+        memcpy(key + ulen + 1, cc->db, dlen);
+    key[ulen + dlen + 1] = '\0';
+    len  = ulen + dlen + 2 + _cache_normalize(q, qlen, key + ulen + dlen + 2);
+    hash = _cache_hash(CACHE_HASH_INIT, key, len);
+
+    if ( (e = _cache_find(cache, hash, key, len)) != NULL ) {
+        if (e->expires <= time(NULL)) {
+            cache->expired++;
+            _cache_entry_unlink(cache, e);
+        } else if (_cache_stale(e)) {
+            cache->invalidated++;
+            _cache_entry_unlink(cache, e);
+        } else {
+            free(key);
+            e->referenced = 1;
+            cache->hits++;
+            /* As if received_packet() had seen the command. It's consumed,
+             * so the next one in the buffer gets looked up too. */
+            c->packet_seq = 1;
+            cc->checked   = 0;
+            return conn_wire_bytes(c, e->data, e->len) == -1 ? -1 : 1;
+        }
+    }
+    cache->misses++;
+
+    i = _cache_tables(q, qlen, tags, CACHE_MAX_TAGS);
+    if (i == -1) {
+        free(key);
+        cache->uncacheable++;
+        return 0;
+    }
+
+    cc->armed  = 1;
+    cc->key    = key;
+    cc->keylen = len;
+    cc->hash   = hash;
+    cc->ttl    = ttl;
+    cc->ntags  = i;
+    for (i = 0; i < cc->ntags; i++)
+        cc->tags[i].hash = tags[i];
+
+    return 0;
+}
+
+/* Apply the writes seen since the last commit a second time, now that they're
+ * visible to everyone. */
+static void _cache_commit_wtags(cache_client *cc)
+{
+    int i;
+
+    if (cc->wtags_full) {
+        _cache_flush_all(cc->cache);
+        cc->cache->invalidations++;
+    } else {
+        for (i = 0; i < cc->nwtags; i++)
+            _cache_tag_bump(cc->cache, cc->wtags[i]);
+    }
+    cc->nwtags     = 0;
+    cc->wtags_full = 0;
+}
+
+/* Note the tables a write is about to change. They're invalidated now, to
+ * catch reads which overlap it, and again when it's committed. */
+static void _cache_write(cache_client *cc, const char *q, int len)
+{
+    uint64_t tags[CACHE_MAX_TAGS];
+    int n, i, j;
+
+    n = _cache_tables(q, len, tags, CACHE_MAX_TAGS);
+    if (n <= 0) {
+        /* CALL, or something we can't follow. */
+        _cache_flush_all(cc->cache);
+        cc->cache->invalidations++;
+        cc->wtags_full = 1;
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        _cache_tag_bump(cc->cache, tags[i]);
+        for (j = 0; j < cc->nwtags && cc->wtags[j] != tags[i]; j++);
+        if (j < cc->nwtags)
+            continue;
+        if (cc->nwtags == CACHE_MAX_TAGS) {
+            cc->wtags_full = 1;
+        } else {
+            cc->wtags[cc->nwtags++] = tags[i];
+        }
+    }
+}
+
+/* Called from run_protocol() once a client's command has been dealt with,
+ * before the read buffer moves past it. 'forwarded' is whether it went to a
+ * backend. */
+void cache_client_sent(conn *c, int forwarded)
+{
+    cache_client *cc = c->cache;
+    const char *q = (const char *)c->rbuf + c->readto + 5;
+    int len = c->packetsize - 5;
+    int i;
+
+    cc->checked = 0;
+    if (!forwarded) {
+        cache_abort(c);
+        return;
+    }
+
+    /* Only so much of a big packet is here. */
+    if (len > c->read - c->readto - 5)
+        len = c->read - c->readto - 5;
+
+    if (cc->armed) {
+        cc->armed   = 0;
+        cc->filling = 1;
+        cc->buflen  = 0;
+        cc->flushgen = _cache_flush_gen();
+        for (i = 0; i < cc->ntags; i++)
+            cc->tags[i].gen = _cache_tag_gen(cc->tags[i].hash);
+    }
+
+    switch (c->rbuf[c->readto + 4]) {
+    case COM_INIT_DB:
+        if (cc->new_db)
+            free(cc->new_db);
+        cc->new_db = strndup(q, len);
+        break;
+    case COM_QUERY:
+        _cache_skip(&q, &len);
+        if (len > 4 && strncasecmp(q, "USE", 3) == 0 && isspace((unsigned char)q[3])) {
+            for (q += 4, len -= 4; len && (isspace((unsigned char)*q) || *q == '`'); q++, len--);
+            while (len && (isspace((unsigned char)q[len - 1]) || q[len - 1] == '`' || q[len - 1] == ';'))
+                len--;
+            if (cc->new_db)
+                free(cc->new_db);
+            cc->new_db = strndup(q, len);
+        } else if (_cache_starts(q, len, cache_write_starts)) {
+            _cache_write(cc, q, len);
+        }
+        break;
+    }
+}
+
+/* Called from run_protocol() for packets a backend forwards to a client with
+ * a cache. */
+void cache_server_packet(conn *c, conn *server, int ptype, unsigned char *pkt, int len)
+{
+    cache_client *cc = c->cache;
+    unsigned char *nbuf;
+    int base, status = -1;
+    int nsize;
+
+    if (cc->filling) {
+        /* Lua may be rewriting the results; and the rest of a big row isn't
+         * coming through here. */
+        if (CALLBACK_AVAILABLE(server) || server->big_packet) {
+            cache_abort(c);
+        } else if (cc->buflen + len > cc->cache->max_entry) {
+            cc->cache->too_big++;
+            cache_abort(c);
+        } else {
+            if (cc->buflen + len > cc->bufsize) {
+                for (nsize = cc->bufsize ? cc->bufsize : 4096; nsize < cc->buflen + len; nsize *= 2);
+                nbuf = (unsigned char *)realloc(cc->buf, nsize);
+                if (nbuf == NULL) {
+                    perror("Could not realloc()");
+                    cache_abort(c);
+                    goto done;
+                }
+                cc->buf     = nbuf;
+                cc->bufsize = nsize;
+            }
+            memcpy(cc->buf + cc->buflen, pkt, len);
+            cc->buflen += len;
+        }
+    }
+
+done:
+    if (server->dpmstate != MYS_WAIT_CMD && server->dpmstate != MYS_RECV_ERR)
+        return;
+
+    /* The command is finished. */
+    if (ptype == dpm_eof) {
+        status = uint2korr(&pkt[7]);
+    } else if (ptype == dpm_ok) {
+        base = 5;
+        my_read_binary_field(pkt, &base); /* affected_rows */
+        my_read_binary_field(pkt, &base); /* insert_id */
+        status = uint2korr(&pkt[base]);
+    }
+
+    if (status != -1 && (status & SERVER_MORE_RESULTS_EXISTS)) {
+        cache_abort(c);
+        return;
+    }
+
+    if (cc->new_db) {
+        if (ptype == dpm_ok) {
+            if (cc->db)
+                free(cc->db);
+            cc->db = cc->new_db;
+        } else {
+            free(cc->new_db);
+        }
+        cc->new_db = NULL;
+    }
+
+    if (status != -1)
+        cc->in_trans = (status & SERVER_STATUS_IN_TRANS) != 0;
+    if (!cc->in_trans && (cc->nwtags || cc->wtags_full))
+        _cache_commit_wtags(cc);
+
+    if (cc->filling && ptype == dpm_eof && !cc->in_trans)
+        _cache_store(cc->cache, cc);
+    cache_abort(c);
+}
+
+/* Called from handle_close() for clients with a cache. */
+void cache_client_closed(conn *c)
+{
+    cache_client *cc = c->cache;
+
+    cache_abort(c);
+    if (cc->buf)
+        free(cc->buf);
+    if (cc->user)
+        free(cc->user);
+    if (cc->db)
+        free(cc->db);
+    if (cc->new_db)
+        free(cc->new_db);
+    free(cc);
+    c->cache = NULL;
+}
+
+/*
+ * Lua.
+ */
+
+static int _cache_opt_int(lua_State *L, const char *name, int def)
+{
+    int val;
+
+    lua_getfield(L, 1, name);
+    val = lua_isnil(L, -1) ? def : luaL_checkint(L, -1);
+    lua_pop(L, 1);
+
+    return val;
+}
+
+/* LUA function. dpm.cache({ memory = bytes, ttl = secs, max_entry = bytes }) */
+int new_cache(lua_State *L)
+{
+    dpm_cache *cache;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    cache = (dpm_cache *)malloc( sizeof(dpm_cache) );
+    if (cache == NULL) {
+        perror("Could not malloc()");
+        return luaL_error(L, "Unable to create cache");
+    }
+    memset(cache, 0, sizeof(dpm_cache));
+
+    cache->memory    = _cache_opt_int(L, "memory", 64 * 1024 * 1024);
+    cache->ttl       = _cache_opt_int(L, "ttl", 10);
+    cache->max_entry = _cache_opt_int(L, "max_entry", 1024 * 1024);
+    cache->buckets   = CACHE_BUCKETS;
+    cache->table     = (cache_entry **)calloc(CACHE_BUCKETS, sizeof(cache_entry *));
+    if (cache->table == NULL) {
+        perror("Could not calloc()");
+        free(cache);
+        return luaL_error(L, "Unable to create cache");
+    }
+
+    return new_obj(L, cache, "dpm.cache");
+}
+
+/* LUA method. cache:attach(client, user, db) has the client's queries looked
+ * up in the cache. user and db are what it logged in with. */
+int cache_attach(lua_State *L)
+{
+    dpm_cache **p = (dpm_cache **)luaL_checkudata(L, 1, "dpm.cache");
+    conn *c = check_conn(L, 2);
+    const char *user = luaL_optstring(L, 3, NULL);
+    const char *db   = luaL_optstring(L, 4, NULL);
+    cache_client *cc;
+
+    if (c == NULL || c->my_type != MY_CLIENT || c->alive == 0)
+        return luaL_error(L, "Arg 1 must be a valid client");
+
+    if (c->cache)
+        cache_client_closed(c);
+
+    cc = (cache_client *)malloc( sizeof(cache_client) );
+    if (cc == NULL) {
+        perror("Could not malloc()");
+        return luaL_error(L, "Unable to attach client");
+    }
+    memset(cc, 0, sizeof(cache_client));
+    cc->cache = *p;
+    cc->user  = user ? strdup(user) : NULL;
+    cc->db    = db && *db ? strdup(db) : NULL;
+
+    c->cache = (struct cache_client *)cc;
+
+    return 0;
+}
+
+/* LUA method. cache:rule(function(query, db) ... end) is asked about every
+ * query. It returns a TTL, 0 or false for "don't cache", or nil to leave it to
+ * the default. cache:rule(nil) removes it. */
+int cache_set_rule(lua_State *L)
+{
+    dpm_cache **p = (dpm_cache **)luaL_checkudata(L, 1, "dpm.cache");
+    dpm_cache *cache = *p;
+
+    if (!lua_isnil(L, 2))
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+
+    if (cache->rule)
+        luaL_unref(L, LUA_REGISTRYINDEX, cache->rule);
+    cache->rule = lua_isnil(L, 2) ? 0 : luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return 0;
+}
+
+/* LUA method. cache:invalidate(table) for writes the proxy didn't see. */
+int cache_invalidate(lua_State *L)
+{
+    dpm_cache **p = (dpm_cache **)luaL_checkudata(L, 1, "dpm.cache");
+    size_t len;
+    const char *name = luaL_checklstring(L, 2, &len);
+
+    _cache_tag_bump(*p, _cache_name_hash(name, len));
+
+    return 0;
+}
+
+/* LUA method. Empties the cache, in every worker. */
+int cache_flush(lua_State *L)
+{
+    dpm_cache **p = (dpm_cache **)luaL_checkudata(L, 1, "dpm.cache");
+
+    _cache_flush_all(*p);
+
+    return 0;
+}
+
+static void _cache_stat(lua_State *L, const char *name, uint64_t val)
+{
+    lua_pushnumber(L, (lua_Number)val);
+    lua_setfield(L, -2, name);
+}
+
+/* LUA method. Returns a table of counts and counters. */
+int cache_stats(lua_State *L)
+{
+    dpm_cache **p = (dpm_cache **)luaL_checkudata(L, 1, "dpm.cache");
+    dpm_cache *cache = *p;
+
+    lua_newtable(L);
+    _cache_stat(L, "entries", cache->entries);
+    _cache_stat(L, "bytes", cache->bytes);
+    _cache_stat(L, "hits", cache->hits);
+    _cache_stat(L, "misses", cache->misses);
+    _cache_stat(L, "uncacheable", cache->uncacheable);
+    _cache_stat(L, "stores", cache->stores);
+    _cache_stat(L, "too_big", cache->too_big);
+    _cache_stat(L, "evictions", cache->evictions);
+    _cache_stat(L, "expired", cache->expired);
+    _cache_stat(L, "invalidated", cache->invalidated);
+    _cache_stat(L, "invalidations", cache->invalidations);
+
+    return 1;
+}
@@ -0,0 +1,105 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Result caching for SELECTs. See cache.c */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_MAX_TAGS 8 /* Tables one entry can be invalidated by. */
+
+/* A table name, and how many times it had been written to. */
+typedef struct cache_tag {
+    uint64_t hash;
+    uint64_t gen;
+} cache_tag;
+
+typedef struct cache_entry {
+    uint64_t hash; /* Of the key. */
+    char    *key; /* user, db and query, \0 separated. */
+    int      keylen;
+    unsigned char *data; /* The whole result set, as the client got it. */
+    int      len;
+    time_t   expires;
+    uint8_t  referenced; /* Hit since the clock hand last passed. */
+    uint64_t flushgen; /* Process wide flush count when it was read. */
+    int      ntags;
+    cache_tag tags[CACHE_MAX_TAGS];
+    struct cache_entry *hnext; /* Hash chain. */
+    struct cache_entry *prev, *next; /* Clock ring. */
+} cache_entry;
+
+/* One per dpm.cache() call, per worker thread. Never freed. Table write
+ * counts are kept process wide, in cache.c, so every worker's entries see
+ * writes made through any of them. */
+typedef struct dpm_cache {
+    int    memory; /* Most bytes of entries kept. */
+    int    ttl; /* Default seconds an entry lives. */
+    int    max_entry; /* Biggest result set stored. */
+    int    rule; /* lua reference to a function deciding ttls, or 0. */
+
+    cache_entry **table;
+    int    buckets; /* Power of two. */
+    int    entries;
+    int    bytes;
+    cache_entry *hand; /* CLOCK. Evicts the first unreferenced entry. */
+
+    /* Counters for cache:stats() */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t uncacheable;
+    uint64_t stores;
+    uint64_t too_big;
+    uint64_t evictions;
+    uint64_t expired;
+    uint64_t invalidated; /* entries found stale on lookup */
+    uint64_t invalidations; /* table writes seen */
+} dpm_cache;
+
+/* A client's link to a cache, and the state of its command in flight. */
+typedef struct cache_client {
+    dpm_cache *cache;
+    char    *user;
+    char    *db;
+    char    *new_db; /* From a COM_INIT_DB or USE, once it succeeds. */
+    uint8_t  checked; /* The command in the read buffer was looked up. */
+    uint8_t  in_trans; /* Nothing is cached or served in a transaction. */
+
+    /* A miss being filled. 'armed' until the command goes to a backend. */
+    uint8_t  armed;
+    uint8_t  filling;
+    char    *key;
+    int      keylen;
+    uint64_t hash;
+    int      ttl;
+    uint64_t flushgen;
+    int      ntags;
+    cache_tag tags[CACHE_MAX_TAGS];
+    unsigned char *buf;
+    int      buflen;
+    int      bufsize;
+
+    /* Tables written to since the last commit. */
+    int      nwtags;
+    uint64_t wtags[CACHE_MAX_TAGS];
+    uint8_t  wtags_full; /* More than fit; everything is invalidated. */
+} cache_client;
+
+int new_cache(lua_State *L);
+int cache_attach(lua_State *L);
+int cache_set_rule(lua_State *L);
+int cache_invalidate(lua_State *L);
+int cache_flush(lua_State *L);
+int cache_stats(lua_State *L);
+
+int cache_client_command(conn *c);
+void cache_client_sent(conn *c, int forwarded);
+void cache_server_packet(conn *c, conn *server, int ptype, unsigned char *pkt, int len);
+void cache_abort(conn *c);
+void cache_client_closed(conn *c);
+
+#endif /* CACHE_H */
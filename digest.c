@@ -0,0 +1,255 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Query fingerprints. Queries which differ only in their literals, spacing,
+ * comments or case normalize to the same text, and so the same hash:
+ *
+ *   SELECT * FROM t WHERE id IN (1, 2, 3) AND name = 'bob' -- hi
+ *   select * from t where id in (?+) and name = ?
+ *
+ * Strings and numbers become '?', IN lists of nothing but literals become
+ * "(?+)", whitespace and comments squeeze down to one space (none next to
+ * commas and parens), and everything outside of `quoted` names is lower
+ * cased. Trailing semicolons go. It's one pass over the query; string
+ * literals, comments and runs of whitespace are skipped 16 bytes at a time
+ * where SSE2 is around.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "digest.h"
+
+/* FNV-1a */
+#define DIGEST_HASH_INIT 14695981039346656037ULL
+#define DIGEST_HASH_PRIME 1099511628211ULL
+
+/* Character classes, by table; ctype's are locale aware and slow. */
+#define D_SPACE 1
+#define D_WORD  2 /* Names and keywords: letters, digits, _, $ and UTF-8. */
+#define D_DIGIT 4
+#define D_UPPER 8
+
+/* Constant, so workers can share it without any setup. */
+static const unsigned char digest_class[256] = {
+    [' '] = D_SPACE, ['\t'] = D_SPACE, ['\n'] = D_SPACE,
+    ['\r'] = D_SPACE, ['\f'] = D_SPACE, ['\v'] = D_SPACE,
+    ['0' ... '9'] = D_DIGIT | D_WORD,
+    ['a' ... 'z'] = D_WORD,
+    ['A' ... 'Z'] = D_WORD | D_UPPER,
+    ['_'] = D_WORD, ['$'] = D_WORD,
+    [0x80 ... 0xff] = D_WORD,
+};
+
+#define IS_SPACE(c) (digest_class[(unsigned char)(c)] & D_SPACE)
+#define IS_WORD(c) (digest_class[(unsigned char)(c)] & D_WORD)
+#define IS_DIGIT(c) (digest_class[(unsigned char)(c)] & D_DIGIT)
+
+static inline char _digest_lower(char c)
+{
+    return (digest_class[(unsigned char)c] & D_UPPER) ? c + 32 : c;
+}
+
+/* First a or b at or after p, or end. */
+static const char *_digest_find2(const char *p, const char *end, char a, char b)
+{
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    __m128i chunk;
+    int mask;
+
+    while (p + 16 <= end) {
+        chunk = _mm_loadu_si128((const __m128i *)p);
+        mask  = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va),
+                                               _mm_cmpeq_epi8(chunk, vb)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != a && *p != b)
+        p++;
+    return p;
+}
+
+/* First thing at or after p which isn't a space, tab or newline, or end. */
+static const char *_digest_skip_space(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    __m128i sp = _mm_set1_epi8(' ');
+    __m128i tab = _mm_set1_epi8('\t');
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i cr = _mm_set1_epi8('\r');
+    __m128i chunk;
+    int mask;
+
+    /* Most runs are one space; don't bother unless there's more. */
+    while (p + 16 <= end && p[0] == ' ' && p[1] == ' ') {
+        chunk = _mm_loadu_si128((const __m128i *)p);
+        mask  = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, sp), _mm_cmpeq_epi8(chunk, tab)),
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, nl), _mm_cmpeq_epi8(chunk, cr))));
+        if (mask != 0xffff)
+            return p + __builtin_ctz(~mask);
+        p += 16;
+    }
+#endif
+    while (p < end && IS_SPACE(*p))
+        p++;
+    return p;
+}
+
+/* Normalize len bytes of query q into out, which needs
+ * DIGEST_OUT_SIZE(len) bytes, and return the hash of the result. The
+ * normalized length goes in *outlen; out isn't terminated. */
+uint64_t digest_query(const char *q, int len, char *out, int *outlen)
+{
+    const char *p = q;
+    const char *end = q + len;
+    uint64_t hash = DIGEST_HASH_INIT;
+    int o = 0;
+    int space = 0; /* Whitespace or a comment since the last token. */
+    int list = -1; /* Where the paren of an "in (" list was written. */
+    char c, quote;
+    int i;
+
+    while (p < end) {
+        c = *p;
+
+        if (IS_SPACE(c)) {
+            p = _digest_skip_space(p, end);
+            space = 1;
+            continue;
+        }
+
+        /* Comments. */
+        if (c == '/' && p + 1 < end && p[1] == '*') {
+            for (p += 2; ; p++) {
+                p = _digest_find2(p, end, '*', '*');
+                if (p + 1 >= end) {
+                    p = end;
+                    break;
+                }
+                if (p[1] == '/') {
+                    p += 2;
+                    break;
+                }
+            }
+            space = 1;
+            continue;
+        }
+        if (c == '#' || (c == '-' && p + 2 < end && p[1] == '-' && IS_SPACE(p[2]))) {
+            p = _digest_find2(p, end, '\n', '\n');
+            space = 1;
+            continue;
+        }
+
+        /* Squeezed whitespace comes out as one space, except where it never
+         * matters. */
+        if (space && o && out[o - 1] != '(' && out[o - 1] != ',' &&
+            c != ')' && c != ',')
+            out[o++] = ' ';
+        space = 0;
+
+        if (c == '\'' || c == '"') {
+            /* A string. Quotes are escaped with a backslash or doubled. */
+            for (quote = c, p++; ; p += 2) {
+                p = _digest_find2(p, end, quote, '\\');
+                if (p >= end || (*p == quote && (p + 1 >= end || p[1] != quote)))
+                    break;
+            }
+            if (p < end)
+                p++;
+            out[o++] = '?';
+            continue;
+        }
+
+        if (c == '`') {
+            /* Quoted names are copied as they are. */
+            const char *close = _digest_find2(p + 1, end, '`', '`');
+            if (close < end)
+                close++;
+            memcpy(out + o, p, close - p);
+            o += close - p;
+            p = close;
+            continue;
+        }
+
+        if (IS_DIGIT(c) || (c == '.' && p + 1 < end && IS_DIGIT(p[1]))) {
+            if (o && IS_WORD(out[o - 1])) {
+                /* Part of a name, like t1. */
+                while (p < end && IS_WORD(*p))
+                    out[o++] = _digest_lower(*p++);
+                continue;
+            }
+            if (c == '0' && p + 1 < end && (p[1] == 'x' || p[1] == 'X')) {
+                for (p += 2; p < end && IS_WORD(*p); p++);
+            } else {
+                while (p < end && (IS_DIGIT(*p) || *p == '.'))
+                    p++;
+                if (p < end && (*p == 'e' || *p == 'E')) {
+                    p++;
+                    if (p < end && (*p == '+' || *p == '-'))
+                        p++;
+                    while (p < end && IS_DIGIT(*p))
+                        p++;
+                }
+            }
+            out[o++] = '?';
+            continue;
+        }
+
+        if (IS_WORD(c)) {
+            while (p < end && IS_WORD(*p))
+                out[o++] = _digest_lower(*p++);
+            continue;
+        }
+
+        /* Punctuation and operators. IN lists are watched for. */
+        if (c == '(') {
+            if (o >= 3 && out[o - 1] == ' ' && out[o - 2] == 'n' && out[o - 3] == 'i' &&
+                (o == 3 || !IS_WORD(out[o - 4]))) {
+                list = o;
+            } else if (o >= 2 && out[o - 1] == 'n' && out[o - 2] == 'i' &&
+                (o == 2 || !IS_WORD(out[o - 3]))) {
+                /* "in(" reads as "in (" */
+                out[o++] = ' ';
+                list = o;
+            } else {
+                list = -1;
+            }
+        } else if (c == ')' && list != -1) {
+            for (i = list + 1; i < o && (out[i] == '?' || out[i] == ','); i++);
+            if (i == o && o > list + 1) {
+                o = list + 1;
+                out[o++] = '?';
+                out[o++] = '+';
+            }
+            list = -1;
+        } else if (c != ',' && list != -1) {
+            list = -1;
+        }
+        out[o++] = c;
+        p++;
+    }
+
+    while (o && (out[o - 1] == ';' || out[o - 1] == ' '))
+        o--;
+
+    for (i = 0; i < o; i++) {
+        hash ^= (unsigned char)out[i];
+        hash *= DIGEST_HASH_PRIME;
+    }
+
+    *outlen = o;
+    return hash;
+}
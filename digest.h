@@ -0,0 +1,18 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Query fingerprints. See digest.c */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+/* Room digest_query() needs to write a normalized query of len bytes. */
+#define DIGEST_OUT_SIZE(len) ((len) + (len) / 2 + 4)
+
+uint64_t digest_query(const char *q, int len, char *out, int *outlen);
+
+#endif /* DIGEST_H */
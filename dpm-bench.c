@@ -0,0 +1,754 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Load generator. Opens N client connections to a mysqld (or to DPM in
+ * front of one), logs them in with my_scramble(), and has each send
+ * COM_QUERYs, up to depth at a time, for a number of seconds. Prints
+ * queries per second and a latency histogram. Run it once straight at the
+ * backend and once through DPM and the difference is what the proxy costs;
+ * bench-proxy.sh does that for each startfile.
+ *
+ * make dpm-bench && ./dpm-bench -u user -P pass -c 16 -t 10
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <event.h>
+
+#include "sha1.h"
+#include "scramble.h"
+
+#define BENCH_MAX_QUERIES 16
+#define BENCH_MAX_DEPTH 64
+
+/* The few protocol bits needed; see portability.h and proxy.h for the rest. */
+#define CLIENT_LONG_PASSWORD     1
+#define CLIENT_LONG_FLAG         4
+#define CLIENT_CONNECT_WITH_DB   8
+#define CLIENT_PROTOCOL_41       512
+#define CLIENT_TRANSACTIONS      8192
+#define CLIENT_SECURE_CONNECTION 32768
+#define COM_QUERY 3
+
+/* Histogram buckets, log-linear as in latency.c: 16 per power of two. */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 40
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+
+enum bench_states {
+    BENCH_HANDSHAKE = 0, /* Waiting for the server's hello */
+    BENCH_AUTH, /* Sent our login */
+    BENCH_RUNNING,
+    BENCH_DEAD,
+};
+
+/* Where we are in the answer to the oldest query in flight. */
+enum bench_replies {
+    REPLY_FIRST = 0, /* OK, ERR or a field count */
+    REPLY_FIELDS,
+    REPLY_ROWS,
+};
+
+typedef struct {
+    int fd;
+    int state;
+    int reply;
+    struct event rev;
+    struct event wev;
+    int want_write;
+    unsigned char *rbuf;
+    int rsize;
+    int rlen;
+    unsigned char *wbuf;
+    int wsize;
+    int wlen;
+    int wdone;
+    int inflight;
+    int next_query;
+    uint64_t sent[BENCH_MAX_DEPTH]; /* Ring of send times, oldest first */
+    int sent_head;
+} bench_conn;
+
+static struct {
+    const char *host;
+    int port;
+    const char *sock;
+    const char *user;
+    const char *pass;
+    const char *db;
+    int conns;
+    int depth;
+    int seconds;
+    int warmup;
+    int verbose;
+    const char *queries[BENCH_MAX_QUERIES];
+    int query_count;
+} opts;
+
+static int running = 1;
+static int measuring = 0;
+static int live = 0;
+static uint64_t measure_start = 0;
+static uint64_t measure_end = 0;
+static uint64_t queries = 0;
+static uint64_t errors = 0;
+static uint64_t lat_total = 0;
+static uint64_t lat_min = 0;
+static uint64_t lat_max = 0;
+static uint32_t lat_buckets[LAT_BUCKETS];
+static int error_shown = 0;
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _lat_bucket(uint64_t v)
+{
+    int bits, shift;
+
+    if (v >= (1ULL << LAT_MAX_BITS))
+        return LAT_BUCKETS - 1;
+    if (v < LAT_SUB)
+        return (int)v;
+
+    bits  = 64 - __builtin_clzll(v);
+    shift = bits - LAT_SUB_BITS - 1;
+    return (shift + 1) * LAT_SUB + (int)((v >> shift) & (LAT_SUB - 1));
+}
+
+/* Highest value which lands in bucket i. */
+static uint64_t _lat_bucket_value(int i)
+{
+    int shift;
+
+    if (i < LAT_SUB)
+        return i;
+    shift = i / LAT_SUB - 1;
+    return ((uint64_t)(LAT_SUB + i % LAT_SUB + 1) << shift) - 1;
+}
+
+static uint64_t _lat_quantile(double q)
+{
+    uint64_t want = (uint64_t)(q * queries + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += lat_buckets[i];
+        if (seen >= want)
+            break;
+    }
+    if (i == LAT_BUCKETS || _lat_bucket_value(i) > lat_max)
+        return lat_max;
+    return _lat_bucket_value(i);
+}
+
+static void bench_close(bench_conn *c)
+{
+    if (c->state == BENCH_DEAD)
+        return;
+    event_del(&c->rev);
+    if (c->want_write)
+        event_del(&c->wev);
+    close(c->fd);
+    c->state = BENCH_DEAD;
+    if (--live == 0)
+        event_loopexit(NULL);
+}
+
+static int bench_room(bench_conn *c, int len)
+{
+    unsigned char *buf;
+    int size = c->wsize ? c->wsize : 4096;
+
+    while (size < c->wlen + len)
+        size *= 2;
+    if (size == c->wsize)
+        return 0;
+    buf = (unsigned char *)realloc(c->wbuf, size);
+    if (buf == NULL) {
+        perror("Could not realloc()");
+        return -1;
+    }
+    c->wbuf  = buf;
+    c->wsize = size;
+    return 0;
+}
+
+static void bench_write(int fd, short event, void *arg);
+
+/* Sends what's buffered; the rest goes when the socket's writable. */
+static int bench_flush(bench_conn *c)
+{
+    int n;
+
+    while (c->wdone < c->wlen) {
+        n = write(c->fd, c->wbuf + c->wdone, c->wlen - c->wdone);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return -1;
+            if (!c->want_write) {
+                event_set(&c->wev, c->fd, EV_WRITE, bench_write, c);
+                event_add(&c->wev, NULL);
+                c->want_write = 1;
+            }
+            return 0;
+        }
+        c->wdone += n;
+    }
+    c->wlen  = 0;
+    c->wdone = 0;
+    return 0;
+}
+
+static void bench_write(int fd, short event, void *arg)
+{
+    bench_conn *c = arg;
+
+    c->want_write = 0;
+    if (bench_flush(c) == -1) {
+        perror("write()");
+        bench_close(c);
+    }
+}
+
+/* Queues one packet. */
+static int bench_packet(bench_conn *c, int seq, const unsigned char *payload, int len)
+{
+    unsigned char *p;
+
+    if (bench_room(c, len + 4) == -1)
+        return -1;
+    p = c->wbuf + c->wlen;
+    p[0] = len & 0xff;
+    p[1] = (len >> 8) & 0xff;
+    p[2] = (len >> 16) & 0xff;
+    p[3] = seq;
+    memcpy(p + 4, payload, len);
+    c->wlen += len + 4;
+    return 0;
+}
+
+static int bench_send_query(bench_conn *c)
+{
+    const char *q = opts.queries[c->next_query];
+    unsigned char buf[1 + 4096];
+    int len = strlen(q);
+
+    c->next_query = (c->next_query + 1) % opts.query_count;
+    buf[0] = COM_QUERY;
+    memcpy(buf + 1, q, len);
+    if (bench_packet(c, 0, buf, len + 1) == -1)
+        return -1;
+
+    c->sent[(c->sent_head + c->inflight) % BENCH_MAX_DEPTH] = bench_now();
+    c->inflight++;
+    return 0;
+}
+
+/* Keeps depth queries in flight. */
+static int bench_fill(bench_conn *c)
+{
+    while (running && c->inflight < opts.depth) {
+        if (bench_send_query(c) == -1)
+            return -1;
+    }
+    return bench_flush(c);
+}
+
+/* Login packet, 4.1 style. */
+static int bench_auth(bench_conn *c, const char *scramble, int seq)
+{
+    unsigned char buf[512];
+    unsigned char *p = buf;
+    char scram[SHA1_DIGEST_LENGTH + 1];
+    uint32_t flags = CLIENT_LONG_PASSWORD | CLIENT_LONG_FLAG |
+        CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION;
+    int len;
+
+    if (opts.db)
+        flags |= CLIENT_CONNECT_WITH_DB;
+
+    p[0] = flags & 0xff;
+    p[1] = (flags >> 8) & 0xff;
+    p[2] = (flags >> 16) & 0xff;
+    p[3] = (flags >> 24) & 0xff;
+    p[4] = 0; /* max packet: 16M */
+    p[5] = 0;
+    p[6] = 0;
+    p[7] = 1;
+    p[8] = 33; /* utf8_general_ci */
+    memset(p + 9, 0, 23);
+    p += 32;
+
+    len = strlen(opts.user);
+    memcpy(p, opts.user, len + 1);
+    p += len + 1;
+
+    if (opts.pass[0]) {
+        my_scramble(scram, scramble, opts.pass);
+        *p++ = SHA1_DIGEST_LENGTH;
+        memcpy(p, scram, SHA1_DIGEST_LENGTH);
+        p += SHA1_DIGEST_LENGTH;
+    } else {
+        *p++ = 0;
+    }
+
+    if (opts.db) {
+        len = strlen(opts.db);
+        memcpy(p, opts.db, len + 1);
+        p += len + 1;
+    }
+
+    if (bench_packet(c, seq, buf, p - buf) == -1)
+        return -1;
+    c->state = BENCH_AUTH;
+    return bench_flush(c);
+}
+
+static void bench_show_error(const unsigned char *pkt, int len)
+{
+    int skip = 3;
+
+    /* 0xff, errno, then '#' and a sqlstate. */
+    if (len > 3 && pkt[3] == '#')
+        skip = 9;
+    if (len < skip)
+        skip = len;
+    fprintf(stderr, "Server error %d: %.*s\n", pkt[1] | (pkt[2] << 8),
+        len - skip, pkt + skip);
+}
+
+/* The server's hello: version, thread id, then the scramble in two parts. */
+static int bench_handshake(bench_conn *c, const unsigned char *pkt, int len, int seq)
+{
+    char scramble[SHA1_DIGEST_LENGTH];
+    const unsigned char *p = pkt + 1;
+    const unsigned char *end = pkt + len;
+
+    if (len < 1 || pkt[0] == 0xff) {
+        if (len > 0)
+            bench_show_error(pkt, len);
+        return -1;
+    }
+    while (p < end && *p)
+        p++;
+    p += 1 + 4; /* version terminator, thread id */
+    if (p + 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10 + 12 > end) {
+        fprintf(stderr, "Short handshake; need a 4.1 or newer server\n");
+        return -1;
+    }
+    memcpy(scramble, p, 8);
+    p += 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10;
+    memcpy(scramble + 8, p, 12);
+
+    return bench_auth(c, scramble, seq + 1);
+}
+
+/* Answer to our login. An 0xfe is a request to switch auth method; only
+ * mysql_native_password, with a fresh scramble, can be answered. */
+static int bench_auth_reply(bench_conn *c, const unsigned char *pkt, int len, int seq)
+{
+    char scram[SHA1_DIGEST_LENGTH + 1];
+    const char *plugin;
+    int plen;
+
+    if (len > 0 && pkt[0] == 0x00) {
+        c->state = BENCH_RUNNING;
+        return bench_fill(c);
+    }
+    if (len > 0 && pkt[0] == 0xfe) {
+        plugin = (const char *)pkt + 1;
+        plen = strnlen(plugin, len - 1);
+        if (strcmp(plugin, "mysql_native_password") != 0 ||
+            len < 1 + plen + 1 + SHA1_DIGEST_LENGTH) {
+            fprintf(stderr, "Server wants auth plugin '%.*s'; dpm-bench "
+                "only speaks mysql_native_password\n", plen, plugin);
+            return -1;
+        }
+        if (opts.pass[0]) {
+            my_scramble(scram, plugin + plen + 1, opts.pass);
+            if (bench_packet(c, seq + 1, (unsigned char *)scram, SHA1_DIGEST_LENGTH) == -1)
+                return -1;
+        } else if (bench_packet(c, seq + 1, (unsigned char *)"", 0) == -1) {
+            return -1;
+        }
+        return bench_flush(c);
+    }
+    if (len > 0 && pkt[0] == 0xff)
+        bench_show_error(pkt, len);
+    return -1;
+}
+
+/* The oldest query in flight was answered. */
+static void bench_done(bench_conn *c, int failed)
+{
+    uint64_t start = c->sent[c->sent_head];
+    uint64_t v;
+
+    c->sent_head = (c->sent_head + 1) % BENCH_MAX_DEPTH;
+    c->inflight--;
+    c->reply = REPLY_FIRST;
+
+    if (!measuring || start < measure_start)
+        return;
+
+    if (failed) {
+        errors++;
+        return;
+    }
+    v = bench_now() - start;
+    queries++;
+    lat_total += v;
+    if (lat_min == 0 || v < lat_min)
+        lat_min = v;
+    if (v > lat_max)
+        lat_max = v;
+    lat_buckets[_lat_bucket(v)]++;
+}
+
+/* One packet of a reply. EOFs are 0xfe and under 9 bytes; longer ones are
+ * rows which start with a long length. */
+static int bench_reply(bench_conn *c, const unsigned char *pkt, int len)
+{
+    int eof = len > 0 && len < 9 && pkt[0] == 0xfe;
+
+    if (c->inflight == 0) {
+        fprintf(stderr, "Reply with no query in flight\n");
+        return -1;
+    }
+
+    switch (c->reply) {
+    case REPLY_FIRST:
+        if (len > 0 && pkt[0] == 0x00) {
+            bench_done(c, 0);
+        } else if (len > 0 && pkt[0] == 0xff) {
+            if (!error_shown++)
+                bench_show_error(pkt, len);
+            bench_done(c, 1);
+        } else {
+            c->reply = REPLY_FIELDS;
+        }
+        break;
+    case REPLY_FIELDS:
+        if (eof)
+            c->reply = REPLY_ROWS;
+        break;
+    case REPLY_ROWS:
+        if (eof) {
+            bench_done(c, 0);
+        } else if (len > 0 && pkt[0] == 0xff) {
+            bench_done(c, 1);
+        }
+        break;
+    }
+    return 0;
+}
+
+static void bench_read(int fd, short event, void *arg)
+{
+    bench_conn *c = arg;
+    unsigned char *buf, *pkt;
+    int n, pos = 0, len, seq, ret = 0;
+
+    if (c->rlen == c->rsize) {
+        buf = (unsigned char *)realloc(c->rbuf, c->rsize * 2);
+        if (buf == NULL) {
+            perror("Could not realloc()");
+            bench_close(c);
+            return;
+        }
+        c->rbuf  = buf;
+        c->rsize *= 2;
+    }
+
+    n = read(fd, c->rbuf + c->rlen, c->rsize - c->rlen);
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        if (running)
+            fprintf(stderr, "Connection closed by server\n");
+        bench_close(c);
+        return;
+    }
+    if (n == -1)
+        return;
+    c->rlen += n;
+
+    while (ret == 0 && c->rlen - pos >= 4) {
+        pkt = c->rbuf + pos;
+        len = pkt[0] | (pkt[1] << 8) | (pkt[2] << 16);
+        seq = pkt[3];
+        if (c->rlen - pos < len + 4)
+            break;
+        pos += len + 4;
+
+        switch (c->state) {
+        case BENCH_HANDSHAKE:
+            ret = bench_handshake(c, pkt + 4, len, seq);
+            break;
+        case BENCH_AUTH:
+            ret = bench_auth_reply(c, pkt + 4, len, seq);
+            break;
+        case BENCH_RUNNING:
+            ret = bench_reply(c, pkt + 4, len);
+            break;
+        }
+    }
+
+    if (ret == 0 && c->state == BENCH_RUNNING)
+        ret = bench_fill(c);
+    if (ret == -1) {
+        bench_close(c);
+        return;
+    }
+
+    memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+    c->rlen -= pos;
+}
+
+static int bench_connect(void)
+{
+    struct sockaddr_in sin;
+    struct sockaddr_un sun_addr;
+    int fd, flags = 1;
+
+    if (opts.sock) {
+        if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+            perror("socket()");
+            return -1;
+        }
+        memset(&sun_addr, 0, sizeof(sun_addr));
+        sun_addr.sun_family = AF_UNIX;
+        strncpy(sun_addr.sun_path, opts.sock, sizeof(sun_addr.sun_path) - 1);
+        if (connect(fd, (struct sockaddr *)&sun_addr, sizeof(sun_addr)) == -1) {
+            perror(opts.sock);
+            close(fd);
+            return -1;
+        }
+    } else {
+        if ( (fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            perror("socket()");
+            return -1;
+        }
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port   = htons(opts.port);
+        if (inet_pton(AF_INET, opts.host, &sin.sin_addr) != 1) {
+            fprintf(stderr, "Bad address: %s\n", opts.host);
+            close(fd);
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+            perror("connect()");
+            close(fd);
+            return -1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+    }
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl()");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void bench_measure(int fd, short event, void *arg)
+{
+    measuring = 1;
+    measure_start = bench_now();
+}
+
+static void bench_stop(int fd, short event, void *arg)
+{
+    measure_end = bench_now();
+    measuring = 0;
+    running = 0;
+    event_loopexit(NULL);
+}
+
+static void bench_report(void)
+{
+    double secs = (measure_end - measure_start) / 1e9;
+    double mean = queries ? lat_total / 1000.0 / queries : 0;
+    uint64_t hist[LAT_MAX_BITS];
+    uint64_t us;
+    int i, b;
+
+    if (opts.sock) {
+        printf("%s: ", opts.sock);
+    } else {
+        printf("%s:%d: ", opts.host, opts.port);
+    }
+    printf("%d conns, depth %d, %d seconds\n", opts.conns, opts.depth, opts.seconds);
+    printf("queries: %llu, errors: %llu, qps: %.0f\n",
+        (unsigned long long) queries, (unsigned long long) errors,
+        secs > 0 ? queries / secs : 0);
+    if (queries == 0)
+        return;
+    printf("latency (us): min %.1f mean %.1f p50 %.1f p90 %.1f p99 %.1f "
+        "p99.9 %.1f max %.1f\n", lat_min / 1000.0, mean,
+        _lat_quantile(0.50) / 1000.0, _lat_quantile(0.90) / 1000.0,
+        _lat_quantile(0.99) / 1000.0, _lat_quantile(0.999) / 1000.0,
+        lat_max / 1000.0);
+
+    /* One line per power of two microseconds: queries under that long. */
+    if (opts.verbose) {
+        memset(hist, 0, sizeof(hist));
+        for (i = 0; i < LAT_BUCKETS; i++) {
+            us = _lat_bucket_value(i) / 1000;
+            b  = us ? 64 - __builtin_clzll(us) : 0;
+            hist[b] += lat_buckets[i];
+        }
+        for (b = 0; b < LAT_MAX_BITS; b++) {
+            if (hist[b] == 0)
+                continue;
+            printf("< %8lluus %10llu %.*s\n", 1ULL << b,
+                (unsigned long long) hist[b], (int)(hist[b] * 50 / queries),
+                "##################################################");
+        }
+    }
+
+    /* For bench-proxy.sh. */
+    printf("summary qps=%.0f mean_us=%.1f p50_us=%.1f p99_us=%.1f\n",
+        secs > 0 ? queries / secs : 0, mean, _lat_quantile(0.50) / 1000.0,
+        _lat_quantile(0.99) / 1000.0);
+}
+
+static void usage(void)
+{
+    printf("Usage: dpm-bench [options]\n"
+           "  -h host (default 127.0.0.1)    -p port (default 3306)\n"
+           "  -S unix socket path            -u user (default root)\n"
+           "  -P password                    -D database\n"
+           "  -c connections (default 16)    -d queries in flight per conn (default 1)\n"
+           "  -t seconds (default 10)        -w warmup seconds (default 1)\n"
+           "  -e query (repeatable, sent in turn; default SELECT 1)\n"
+           "  -v print the histogram\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct event measure_ev, stop_ev;
+    struct timeval tv;
+    bench_conn *conns;
+    bench_conn *c;
+    int ch, i;
+
+    opts.host    = "127.0.0.1";
+    opts.port    = 3306;
+    opts.user    = "root";
+    opts.pass    = "";
+    opts.conns   = 16;
+    opts.depth   = 1;
+    opts.seconds = 10;
+    opts.warmup  = 1;
+
+    while ( (ch = getopt(argc, argv, "h:p:S:u:P:D:c:d:t:w:e:v")) != -1) {
+        switch (ch) {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 'S': opts.sock = optarg; break;
+        case 'u': opts.user = optarg; break;
+        case 'P': opts.pass = optarg; break;
+        case 'D': opts.db = optarg; break;
+        case 'c': opts.conns = atoi(optarg); break;
+        case 'd': opts.depth = atoi(optarg); break;
+        case 't': opts.seconds = atoi(optarg); break;
+        case 'w': opts.warmup = atoi(optarg); break;
+        case 'v': opts.verbose = 1; break;
+        case 'e':
+            if (opts.query_count == BENCH_MAX_QUERIES) {
+                fprintf(stderr, "At most %d queries\n", BENCH_MAX_QUERIES);
+                return 1;
+            }
+            if (strlen(optarg) > 4096) {
+                fprintf(stderr, "Queries are limited to 4096 bytes\n");
+                return 1;
+            }
+            opts.queries[opts.query_count++] = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (opts.conns < 1 || opts.seconds < 1 || opts.warmup < 0 ||
+        opts.depth < 1 || opts.depth > BENCH_MAX_DEPTH) {
+        usage();
+        return 1;
+    }
+    if (opts.query_count == 0)
+        opts.queries[opts.query_count++] = "SELECT 1";
+    if (strlen(opts.user) > 200 || (opts.db && strlen(opts.db) > 200)) {
+        fprintf(stderr, "User and database names are limited to 200 bytes\n");
+        return 1;
+    }
+
+    event_init();
+
+    conns = (bench_conn *)calloc(opts.conns, sizeof(bench_conn));
+    if (conns == NULL) {
+        perror("Could not calloc()");
+        return 1;
+    }
+    for (i = 0; i < opts.conns; i++) {
+        c = &conns[i];
+        if ( (c->fd = bench_connect()) == -1)
+            return 1;
+        c->rsize = 16384;
+        if ( (c->rbuf = (unsigned char *)malloc(c->rsize)) == NULL) {
+            perror("Could not malloc()");
+            return 1;
+        }
+        event_set(&c->rev, c->fd, EV_READ | EV_PERSIST, bench_read, c);
+        event_add(&c->rev, NULL);
+        live++;
+    }
+
+    tv.tv_sec  = opts.warmup;
+    tv.tv_usec = 0;
+    evtimer_set(&measure_ev, bench_measure, NULL);
+    evtimer_add(&measure_ev, &tv);
+    tv.tv_sec  = opts.warmup + opts.seconds;
+    evtimer_set(&stop_ev, bench_stop, NULL);
+    evtimer_add(&stop_ev, &tv);
+
+    event_dispatch();
+
+    if (live < opts.conns) {
+        fprintf(stderr, "%d of %d connections failed\n", opts.conns - live, opts.conns);
+        if (live == 0)
+            return 1;
+    }
+    if (measure_end == 0)
+        measure_end = bench_now();
+    bench_report();
+
+    return 0;
+}
@@ -11,15 +11,33 @@
 #include "proxy.h"
 #include "sha1.h"
 #include "luaobj.h"
+#include "pool.h"
+#include "router.h"
+#include "cache.h"
+#include "latency.h"
+#include "admin.h"
+#include "metrics.h"
+#include "profile.h"
+#include "sampler.h"
+#include "uring.h"
 
 /* Internal defines */
 
 #undef DBUG
 
 #define BUF_SIZE 2048
+/* Trade rbuf for one this many times smaller, if that still fits the packet
+ * in progress. */
+#define RBUF_SHRINK 4
+#define BUF_SPLICE 65536 /* Most bytes splice()'d per call; the default pipe size. */
+#define ACCEPT_BACKOFF_US 100000 /* Listener nap when out of fds with no reserve. */
 
 #define VERSION "5"
 
+#ifndef DPMLIBDIR
+    #define DPMLIBDIR "."
+#endif
+
 const char *my_state_name[]={
     "Server connect", 
     "Client connect", 
@@ -45,32 +63,95 @@ const char *my_state_name[]={
     "Server sent fields",
 };
 
-/* Global structures/values. These will need to be thread local. */
+/* Global structures/values. Anything touching lua or libevent is thread
+ * local: each worker thread runs its own event base and lua state. */
+
+__thread struct lua_State *L;
+__thread struct event_base *dpm_base;
+__thread dpm_thread *dpm_self;
+__thread dpm_settings settings = {
+    64, /* accept_batch */
+    0,  /* max_conns */
+    65536, /* splice_min */
+    16384, /* stream_min */
+    1048576, /* write_high */
+    262144, /* write_low */
+    16777216, /* buffer_pool_max */
+    0, /* latency_digests */
+};
 
-struct lua_State *L;
+/* Client conns open on this worker, and an fd held in reserve so we can still
+ * accept() and close new clients when out of descriptors. */
+static __thread int dpm_client_count = 0;
+static __thread int dpm_reserve_fd   = -1;
 
+/* Read-only once the workers are started. */
 int urandom_sock = 0;
 int verbose      = 0;
 
+dpm_thread *dpm_threads = NULL;
+int dpm_thread_count    = 1;
+static char *dpm_startfile = DPMLIBDIR "/lua/startup.lua";
+
+/* Listening sockets which the kernel can't shard between threads for us are
+ * opened once, then dup()'ed into each worker. */
+#define MAX_SHARED_LISTENERS 32
+static struct {
+    char key[128];
+    int  fd;
+} shared_listeners[MAX_SHARED_LISTENERS];
+static int shared_listener_count = 0;
+static pthread_mutex_t shared_listener_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Track connections which have had their write buffers appended to.
  * This is walked during run_protocol() */
-conn *dpm_conn_flush_list = NULL;
+static __thread conn *dpm_conn_flush_list = NULL;
+
+/* Conn structs are carved out of slabs and recycled through a freelist.
+ * Closed conns wait on dpm_conn_closed until conn_reap() runs at the top of
+ * the next event, since whatever closed them may still be using the struct. */
+#define CONN_SLAB_SIZE 64
+static __thread conn *dpm_conn_freelist = NULL;
+static __thread conn *dpm_conn_closed   = NULL;
+static __thread uint64_t dpm_conn_counter = 1; /* Unique per worker thread. */
+
+/* Most iovecs handed to a single sendmsg(). */
+#define DPM_IOV_MAX 64
 
 /* Declarations */
 static void sig_hup(const int sig);
 int set_sock_nonblock(int fd);
-static int handle_accept(int fd);
+static void handle_accept(conn *l);
 static int handle_read(conn *c);
 static int handle_write(conn *c);
 static conn *init_conn(int newfd);
 static void handle_event(int fd, short event, void *arg);
-static int add_conn_event(conn *c, const int new_flags);
-//static int del_conn_event(conn *c, const int new_flags);
-static int update_conn_event(conn *c, const int new_flags);
+static int conn_want_write(conn *c);
+static int conn_pause_read(conn *c);
+static int conn_resume_read(conn *c);
+static int conn_start_reading(conn *c);
+static void conn_throttle_check(conn *c);
+static void conn_unthrottle(conn *c);
+#ifdef DPM_SPLICE
+static int conn_stream_start(conn *c);
+static int conn_stream(conn *c);
+#endif
 static int run_protocol(conn *c, int read, int written);
+static int forward_row_run(conn *c);
+static int forward_frames(conn *c);
+static int row_stream_left(conn *c);
+static int row_stream_head(conn *c);
+static int conn_cut_through(conn *c);
 
 static int my_next_packet_start(conn *c);
 static int grow_write_buffer(conn *c, int newsize);
+static void conn_release_rbuf(conn *c);
+static void conn_release_wbuf(conn *c);
+static int conn_compact_rbuf(conn *c);
+static int conn_write_ref(conn *c, unsigned char *ptr, int len);
+static int conn_write_materialize(conn *c);
+static int conn_write_materialize_from(conn *c, unsigned char *buf, int size);
+static void _wseg_reset(conn *c);
 static int sent_packet(conn *c, void **p, int ptype, int field_count);
 static int received_packet(conn *c, void **p, int *ptype, int field_count);
 
@@ -84,39 +165,40 @@ static void my_free_auth_packet(void *p);
 static int my_wire_auth_packet(conn *c, void *pkt);
 
 static void *my_consume_ok_packet(conn *c);
+static void *my_pin_ok_packet(void *pkt);
 static void my_free_ok_packet(void *p);
 static int my_wire_ok_packet(conn *c, void *pkt);
 
 static void *my_consume_err_packet(conn *c);
+static void *my_pin_err_packet(void *pkt);
 static void my_free_err_packet(void *pkt);
 static int my_wire_err_packet(conn *c, void *pkt);
 
 static void *my_consume_cmd_packet(conn *c);
+static void *my_pin_cmd_packet(void *pkt);
 static void my_free_cmd_packet(void *pkt);
 static int my_wire_cmd_packet(conn *c, void *pkt);
 
 static void *my_consume_rset_packet(conn *c);
+static void *my_pin_rset_packet(void *pkt);
 static void my_free_rset_packet(void *pkt);
 static int my_wire_rset_packet(conn *c, void *pkt);
 
 static void *my_consume_row_packet(conn *c);
+static void *my_pin_row_packet(void *pkt);
 static void my_free_row_packet(void *pkt);
 static int my_wire_row_packet(conn *c, void *pkt);
 
 static void *my_consume_field_packet(conn *c);
+static void *my_pin_field_packet(void *pkt);
 static void my_free_field_packet(void *pkt);
 static int my_wire_field_packet(conn *c, void *pkt);
 
 static void *my_consume_eof_packet(conn *c);
+static void *my_pin_eof_packet(void *pkt);
 static void my_free_eof_packet(void *pkt);
 static int my_wire_eof_packet(conn *c, void *pkt);
 
-static uint8_t my_char_val(uint8_t X);
-static void my_hex2octet(uint8_t *dst, const char *src, unsigned int len);
-static void my_crypt(char *dst, const unsigned char *s1, const unsigned char *s2, uint len);
-static void my_scramble(char *dst, const char *random, const char *pass);
-static int my_check_scramble(const char *remote_scram, const char *random, const char *stored_hash);
-
 /* Lua related forward declarations. */
 static int new_listener(lua_State *L);
 static int new_connect(lua_State *L);
@@ -166,11 +248,46 @@ inline const char *cbuffer_data(cbuffer_t *buf)
 /* Stack a connection for flushing later. */
 static void _dpm_add_to_flush_list(conn *c)
 {
-    if (dpm_conn_flush_list)
-        c->nextconn = (struct conn *)dpm_conn_flush_list;
+    if (c->on_flush_list)
+        return;
+    c->on_flush_list = 1;
+    c->nextconn = (struct conn *)dpm_conn_flush_list;
     dpm_conn_flush_list = c;
 }
 
+/* Pull a closing connection off the flush list. Anything else still queued
+ * to flush may reference its read buffer, so copy that data out first. If
+ * that fails, the conn's output can't be sent intact any more; drop it and
+ * shut the socket down, so the read side notices and closes it. */
+static void _dpm_del_from_flush_list(conn *c)
+{
+    conn **prev = &dpm_conn_flush_list;
+    conn *f;
+
+    for (f = dpm_conn_flush_list; f != NULL && c->rbuf; f = (conn *)f->nextconn) {
+        if (f == c || !f->alive)
+            continue;
+        if (conn_write_materialize_from(f, c->rbuf, c->rbufsize) == -1) {
+            fprintf(stderr, "Could not copy out pending writes for %llu\n", (unsigned long long) f->id);
+            _wseg_reset(f);
+            shutdown(f->fd, SHUT_RDWR);
+        }
+    }
+
+    if (!c->on_flush_list)
+        return;
+
+    for (f = dpm_conn_flush_list; f != NULL; f = (conn *)f->nextconn) {
+        if (f == c) {
+            *prev = (conn *)c->nextconn;
+            break;
+        }
+        prev = (conn **)&f->nextconn;
+    }
+    c->nextconn      = NULL;
+    c->on_flush_list = 0;
+}
+
 /* Stub function. In the future, should set a flag to reload or dump stuff */
 static void sig_hup(const int sig)
 {
@@ -191,51 +308,286 @@ int set_sock_nonblock(int fd)
     return 0;
 }
 
-static int add_conn_event(conn *c, const int new_flags)
+/* Connection event layer.
+ * The EV_READ | EV_PERSIST registration is made once in conn_start_reading()
+ * and left alone. Write interest is a one-shot event armed lazily when a
+ * send() hits EAGAIN; libevent drops it again after it fires. A full flush
+ * doesn't touch the event loop at all, where it used to cost an
+ * event_del/event_add pair for every read/write flip.
+ */
+static int conn_want_write(conn *c)
 {
-    int ret;
-    ret = update_conn_event(c, c->ev_flags | new_flags);
-    return ret;
+    if (c->want_write)
+        return 1;
+
+    c->event_calls++;
+    if (event_add(&c->wev, 0) == -1)
+        return 0;
+
+    c->want_write = 1;
+    return 1;
 }
 
-/* FIXME: Logic is wrong */
-/*static int del_conn_event(conn *c, const int new_flags)
+/* Take the read event out of the loop while we can't use what it'd give us. */
+static int conn_pause_read(conn *c)
 {
-    int ret;
-    ret = update_conn_event(c, c->ev_flags & ~new_flags);
-    return ret;
-}*/
+    if (c->read_paused)
+        return 1;
 
-static int update_conn_event(conn *c, const int new_flags)
+    if (dpm_io_uring) {
+        uring_pause_read(c);
+    } else {
+        c->event_calls++;
+        if (event_del(&c->ev) == -1)
+            return 0;
+    }
+
+    c->read_paused = 1;
+    return 1;
+}
+
+static int conn_resume_read(conn *c)
 {
-    if (c->ev_flags == new_flags) return 1;
-    if (event_del(&c->ev) == -1) return 0;
+    if (!c->read_paused)
+        return 1;
 
-    c->ev_flags = new_flags;
-    event_set(&c->ev, c->fd, new_flags, handle_event, (void *)c);
+    if (dpm_io_uring) {
+        uring_resume_read(c);
+    } else {
+        c->event_calls++;
+        if (event_add(&c->ev, 0) == -1)
+            return 0;
+    }
 
-    if (event_add(&c->ev, 0) == -1) return 0;
+    c->read_paused = 0;
     return 1;
 }
 
-static int handle_accept(int fd)
+/* Start watching a new conn for input. Under io_uring that's a multishot
+ * recv, which an outbound conn gets once its connect has gone through.
+ * Listeners always stay with libevent. */
+static int conn_start_reading(conn *c)
 {
-    struct sockaddr_in addr;
-    socklen_t addrlen = 0;
+    if (dpm_io_uring && !c->listener) {
+        if (c->mystate == my_connect)
+            return 0;
+        return uring_conn_start(c);
+    }
+
+    c->event_calls++;
+    return event_add(&c->ev, NULL);
+}
+
+/* Flow control. Once more than write_high bytes are queued for c, stop
+ * reading from the remote feeding it. The kernel buffers fill up behind that
+ * and TCP pushes back on the sender. Reads pick up again once c has drained
+ * to write_low. */
+static void conn_throttle_check(conn *c)
+{
+    conn *src = (conn *)c->remote;
+
+    if (src == NULL || !src->alive)
+        return;
+
+    if (!src->throttled) {
+        if (c->write_high > 0 && c->wpending > c->write_high) {
+            if (conn_pause_read(src) == 0)
+                return;
+            src->throttled = 1;
+            dpm_self->stats.throttled_conns++;
+            dpm_self->stats.throttles++;
+            if (verbose)
+                fprintf(stdout, "Throttling %llu: %d bytes queued for %llu\n", (unsigned long long) src->id, c->wpending, (unsigned long long) c->id);
+        }
+    } else if (c->wpending <= c->write_low) {
+        conn_unthrottle(src);
+    }
+}
+
+static void conn_unthrottle(conn *c)
+{
+    if (!c->throttled)
+        return;
+
+    c->throttled = 0;
+    dpm_self->stats.throttled_conns--;
+    /* A stalled splice keeps reads paused until the pipe drains. */
+    if (c->alive && c->pipe_bytes == 0)
+        conn_resume_read(c);
+}
+
+/* Tell a client we're full with a MySQL 1040 error and hang up, without
+ * building a conn or entering lua. The socket is fresh so the packet fits
+ * into the send buffer. */
+static void reject_conn(int fd)
+{
+    static const char msg[] = "Too many connections";
+    unsigned char pkt[13 + sizeof(msg)];
+    int psize = 9 + sizeof(msg) - 1;
+
+    int3store(&pkt[0], psize);
+    int1store(&pkt[3], 0);
+    pkt[4] = 255;
+    int2store(&pkt[5], 1040);
+    pkt[7] = '#';
+    memcpy(&pkt[8], "08004", 5);
+    memcpy(&pkt[13], msg, sizeof(msg) - 1);
+
+    send(fd, pkt, psize + 4, 0);
+    close(fd);
+}
+
+/* The back-off below is over; watch the listener again. */
+static void accept_backoff_done(int fd, short which, void *arg)
+{
+    conn *l = arg;
+
+    l->read_paused = 0;
+    l->event_calls++;
+    if (event_add(&l->ev, NULL) == -1)
+        fprintf(stderr, "Could not watch listener %d again\n", l->fd);
+}
+
+/* Out of fds: give up the reserve fd long enough to accept and immediately
+ * close the next client, so the listener doesn't spin on a full backlog.
+ * A reserve lost to an earlier failed reopen is retried first. Without one,
+ * the listener is left alone for ACCEPT_BACKOFF_US instead; listeners never
+ * write, so wev serves as the timer. Returns -1 if it backed off. */
+static int shed_accept(conn *l)
+{
+    struct timeval tv = { 0, ACCEPT_BACKOFF_US };
     int newfd;
 
-    if ( (newfd = accept(fd, (struct sockaddr *)&addr, &addrlen)) == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    if (dpm_reserve_fd == -1)
+        dpm_reserve_fd = open("/dev/null", O_RDONLY);
+
+    if (dpm_reserve_fd == -1) {
+        if (l->read_paused)
+            return -1;
+        if (verbose)
+            fprintf(stderr, "No reserve fd, pausing listener %d\n", l->fd);
+
+        l->event_calls++;
+        if (event_del(&l->ev) == -1)
+            return -1;
+        evtimer_set(&l->wev, accept_backoff_done, l);
+        event_base_set(dpm_base, &l->wev);
+        if (evtimer_add(&l->wev, &tv) == -1) {
+            event_add(&l->ev, NULL);
+            return -1;
+        }
+        l->read_paused = 1;
+        return -1;
+    }
+
+    close(dpm_reserve_fd);
+    if ( (newfd = accept(l->fd, NULL, NULL)) != -1)
+        close(newfd);
+    dpm_reserve_fd = open("/dev/null", O_RDONLY);
+    return 0;
+}
+
+/* Drain up to accept_batch clients from the listener's backlog. */
+static void handle_accept(conn *l)
+{
+    conn *newc;
+    int newfd, i;
+    int flags = 1;
+
+    for (i = 0; i < l->accept_batch; i++) {
+#ifdef SOCK_NONBLOCK
+        newfd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK);
+#else
+        newfd = accept(l->fd, NULL, NULL);
+#endif
+
+        if (newfd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno == EMFILE || errno == ENFILE) {
+                if (verbose)
+                    fprintf(stderr, "Out of file descriptors, dropping client\n");
+                if (shed_accept(l) == -1)
+                    break;
+                continue;
+            } else {
+                perror("Died on accept");
+                break;
+            }
+        }
+
+        /* Admin and metrics listeners are how you'd find out we're full,
+         * so they're let in regardless. */
+        if (settings.max_conns && dpm_client_count >= settings.max_conns &&
+            !l->admin && !l->metrics) {
             if (verbose)
-                fprintf(stderr, "Blocking error on accept. ignore?\n");
-        } else if (errno == EMFILE) {
-            fprintf(stderr, "Holy crap out of FDs!\n");
+                fprintf(stderr, "Hit max_conns (%d), rejecting client\n", settings.max_conns);
+            reject_conn(newfd);
+            continue;
+        }
+
+        if (verbose)
+            fprintf(stdout, "Got new client sock %d\n", newfd);
+
+#ifndef SOCK_NONBLOCK
+        if (set_sock_nonblock(newfd) == -1)
+            continue;
+#endif
+        if (l->listener == DPM_TCP)
+            setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+
+        /* Scrapers aren't MySQL clients; see metrics.c */
+        if (l->metrics) {
+            metrics_accept(newfd);
+            continue;
+        }
+
+        newc = init_conn(newfd);
+
+        if (newc == NULL) {
+            close(newfd);
+            continue;
+        }
+
+        newc->dpmstate   = MYC_WAIT_HANDSHAKE;
+        newc->my_type    = MY_CLIENT;
+        newc->write_high = l->write_high;
+        newc->write_low  = l->write_low;
+        newc->alive++;
+        dpm_client_count++;
+        dpm_self->stats.clients++;
+        dpm_self->stats.conns_accepted++;
+
+        if (conn_start_reading(newc) == -1) {
+            fprintf(stderr, "Could not watch client sock %d\n", newfd);
+            handle_close(newc);
+            continue;
+        }
+
+        if (l->admin) {
+            /* Answered by DPM itself; see admin.c */
+            if (admin_accept(newc) == -1) {
+                handle_close(newc);
+                continue;
+            }
         } else {
-            perror("Died on accept");
+            /* Pass the object up into lua for later inspection. */
+            new_conn_obj(L, newc);
+            /* And the id of our listener object. */
+            lua_pushinteger(L, l->id);
+
+            l->dpmstate = MYC_CONNECT;
+            run_lua_callback(l, 2);
         }
-    }
 
-    return newfd;
+        /* The callback might've written packets to the wire. */
+        if (newc->alive && (newc->towrite || newc->wsegcount)) {
+            if (handle_write(newc) == -1)
+                handle_close(newc);
+        }
+    }
 }
 
 void handle_close(conn *c)
@@ -243,9 +595,23 @@ void handle_close(conn *c)
     conn *remote;
     assert(c != 0);
 
+    /* Already closed (lua and the event loop can both try). */
+    if (!c->alive)
+        return;
+
     c->dpmstate = MY_CLOSING;
     run_lua_callback(c, 0);
     event_del(&c->ev);
+    /* A listener's wev is its accept back-off timer, see shed_accept(). */
+    if (c->want_write || (c->listener && c->read_paused))
+        event_del(&c->wev);
+    uring_conn_close(c);
+
+    /* Pooled backends and multiplexed clients sort out their own remotes. */
+    if (c->pool)
+        pool_conn_closed(c);
+    if (c->cache)
+        cache_client_closed(c);
 
     /* Release a connected remote connection.
      * FIXME: Is this detectable from within lua?
@@ -254,40 +620,152 @@ void handle_close(conn *c)
         remote = (conn *)c->remote;
         remote->remote = NULL;
         c->remote = NULL;
+        conn_unthrottle(remote);
+    }
+    if (c->throttled) {
+        c->throttled = 0;
+        dpm_self->stats.throttled_conns--;
     }
 
+    _dpm_del_from_flush_list(c);
+
     close(c->fd);
+    if (c->pipefd[0] != -1) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+        c->pipefd[0] = -1;
+        c->pipefd[1] = -1;
+    }
+    if (c->my_type == MY_CLIENT && !c->listener) {
+        dpm_client_count--;
+        dpm_self->stats.clients--;
+    }
     if (verbose)
         fprintf(stdout, "Closed connection for %llu listener: %s\n", (unsigned long long) c->id, c->listener ? "yes" : "no");
-    if (c->rbuf) free(c->rbuf);
-    if (c->wbuf) free(c->wbuf);
+    if (c->rbuf) bufpool_put(c->rbuf, c->rbufsize);
+    if (c->wbuf) bufpool_put(c->wbuf, c->wbufsize);
+    if (c->wsegs) free(c->wsegs);
+    c->rbuf      = NULL;
+    c->wbuf      = NULL;
+    c->rbufsize  = 0;
+    c->wbufsize  = 0;
+    c->wsegs     = NULL;
+    c->towrite   = 0;
+    c->wsegcount = 0;
+    c->wsegsent  = 0;
     c->alive = 0;
+    dpm_self->stats.conns_closed++;
+
+    c->nextconn = (struct conn *)dpm_conn_closed;
+    dpm_conn_closed = c;
+}
+
+static conn *conn_alloc(void)
+{
+    conn *slab;
+    conn *c;
+    int i;
+
+    if (dpm_conn_freelist == NULL) {
+        slab = (conn *)malloc(sizeof(conn) * CONN_SLAB_SIZE);
+        if (slab == NULL)
+            return NULL;
+        for (i = 0; i < CONN_SLAB_SIZE; i++) {
+            slab[i].id       = 0;
+            slab[i].nextconn = (struct conn *)dpm_conn_freelist;
+            dpm_conn_freelist = &slab[i];
+        }
+        dpm_self->stats.conn_structs      += CONN_SLAB_SIZE;
+        dpm_self->stats.conn_structs_free += CONN_SLAB_SIZE;
+    }
+
+    c = dpm_conn_freelist;
+    dpm_conn_freelist = (conn *)c->nextconn;
+    dpm_self->stats.conn_structs_free--;
+    return c;
+}
+
+static void _conn_unref_callbacks(conn *c)
+{
+    int i;
+
+    for (i = 0; i < TOTAL_STATES; i++) {
+        if (c->main_callback[i] != 0)
+            luaL_unref(L, LUA_REGISTRYINDEX, c->main_callback[i]);
+        c->main_callback[i] = 0;
+    }
+    if (c->package_callback_ref != 0)
+        luaL_unref(L, LUA_REGISTRYINDEX, c->package_callback_ref);
+    c->package_callback_ref = 0;
+    c->package_callback     = NULL;
+}
+
+/* Recycle conns closed since the last event. Drops their lua callback
+ * references, and zeroes the id so old handles and remote_ids no longer
+ * match anything. */
+void conn_reap(void)
+{
+    conn *c;
+
+    while ( (c = dpm_conn_closed) != NULL ) {
+        dpm_conn_closed = (conn *)c->nextconn;
+
+        _conn_unref_callbacks(c);
+
+        /* Packets lua still holds were left alone until now. */
+        arena_free(&c->arena);
+        arena_free(&c->row_arena);
+
+        c->id       = 0;
+        c->nextconn = (struct conn *)dpm_conn_freelist;
+        dpm_conn_freelist = c;
+        dpm_self->stats.conn_structs_free++;
+    }
+}
+
+/* Strip an open conn of its remote and lua callbacks, and give it a new id
+ * so any handles lua still has for it go stale, as if it had been closed.
+ * For handing a backend from one user to the next. */
+void conn_reset(conn *c)
+{
+    conn *remote = (conn *)c->remote;
+
+    if (remote) {
+        remote->remote    = NULL;
+        remote->remote_id = 0;
+        c->remote         = NULL;
+        c->remote_id      = 0;
+        conn_unthrottle(remote);
+        conn_unthrottle(c);
+    }
+
+    _conn_unref_callbacks(c);
+    c->id = dpm_conn_counter++;
 }
 
 /* Generic "Grow my write buffer" function. */
 static int grow_write_buffer(conn *c, int newsize)
 {
     unsigned char *new_wbuf;
+    int nextsize;
 
     if (c->wbufsize < newsize) {
-        /* Figure the next power of two using bit magic */
-        int nextsize = newsize - 1;
-        int i        = 1;
-        int intbits  = sizeof(nextsize) * 4;
-        for (; i != intbits; i *= 2) {
-           nextsize |= nextsize >> i; 
-        }
-        nextsize++;
-
-        if (verbose)
-            fprintf(stdout, "Reallocating write buffer from %d to %d\n", c->wbufsize, nextsize);
-        new_wbuf = realloc(c->wbuf, nextsize);
+        /* The pool hands out powers of two. */
+        new_wbuf = bufpool_get(newsize, &nextsize);
 
         if (new_wbuf == NULL) {
-            perror("Realloc output buffer");
+            perror("Growing output buffer");
             return -1;
         }
 
+        if (c->wbuf) {
+            if (verbose)
+                fprintf(stdout, "Growing write buffer from %d to %d\n", c->wbufsize, nextsize);
+            memcpy(new_wbuf, c->wbuf, c->towrite);
+            bufpool_put(c->wbuf, c->wbufsize);
+            dpm_self->stats.wbuf_grows++;
+        }
+
         c->wbuf     = new_wbuf;
         c->wbufsize = nextsize;
     }
@@ -295,86 +773,334 @@ static int grow_write_buffer(conn *c, int newsize)
     return 0;
 }
 
+/* Hand drained buffers back to the pool. */
+static void conn_release_rbuf(conn *c)
+{
+    if (c->rbuf == NULL || c->read != 0)
+        return;
+    bufpool_put(c->rbuf, c->rbufsize);
+    c->rbuf     = NULL;
+    c->rbufsize = 0;
+}
+
+/* Called once nothing refers into rbuf any more, with a partial packet left
+ * over. That tail is moved down to the front, so the buffer only grows when
+ * a single packet needs it to. If a spike left us with a buffer much bigger
+ * than the packet in progress, drop back to a smaller one at the same time.
+ * Returns -1 if out of memory. */
+static int conn_compact_rbuf(conn *c)
+{
+    int left = c->read - c->readto;
+    int need = left;
+    int size, newsize;
+    unsigned char *new_rbuf;
+
+    if (c->readto == 0)
+        return 0;
+
+    /* Make room for the whole packet, unless it's going to be streamed. */
+    if (left >= 4 && !c->frame_left) {
+        size = uint3korr(&c->rbuf[c->readto]) + 4;
+        if (size > need && size != MAX_PACKET_LENGTH + 4)
+            need = size;
+    }
+    if (need < BUF_SIZE)
+        need = BUF_SIZE;
+
+    if (c->rbufsize >= need * RBUF_SHRINK) {
+        new_rbuf = bufpool_get(need, &newsize);
+        if (new_rbuf == NULL)
+            return -1;
+        memcpy(new_rbuf, c->rbuf + c->readto, left);
+        bufpool_put(c->rbuf, c->rbufsize);
+        c->rbuf     = new_rbuf;
+        c->rbufsize = newsize;
+        dpm_self->stats.rbuf_shrinks++;
+    } else {
+        memmove(c->rbuf, c->rbuf + c->readto, left);
+        dpm_self->stats.rbuf_compactions++;
+    }
+
+    c->read   = left;
+    c->readto = 0;
+    return 0;
+}
+
+static void conn_release_wbuf(conn *c)
+{
+    if (c->wbuf == NULL || c->towrite != 0)
+        return;
+    bufpool_put(c->wbuf, c->wbufsize);
+    c->wbuf     = NULL;
+    c->wbufsize = 0;
+}
+
+/* Append a segment to the outbound chain, merging it into the last one when
+ * the two are contiguous. A run of forwarded rows out of one read buffer
+ * ends up as a single iovec. */
+static int _wseg_push(conn *c, unsigned char *ptr, int off, int len)
+{
+    dpm_wseg *s;
+    dpm_wseg *new_wsegs;
+
+    if (c->wsegcount) {
+        s = &c->wsegs[c->wsegcount - 1];
+        if (ptr == NULL && s->ptr == NULL && s->off + s->len == off) {
+            s->len += len;
+            c->wpending += len;
+            return 0;
+        } else if (ptr != NULL && s->ptr != NULL && s->ptr + s->len == ptr) {
+            s->len += len;
+            c->wpending += len;
+            return 0;
+        }
+    }
+
+    if (c->wsegcount == c->wsegsize) {
+        int newsize = c->wsegsize ? c->wsegsize * 2 : 8;
+        new_wsegs = realloc(c->wsegs, sizeof(dpm_wseg) * newsize);
+        if (new_wsegs == NULL) {
+            perror("Realloc write segments");
+            return -1;
+        }
+        c->wsegs    = new_wsegs;
+        c->wsegsize = newsize;
+    }
+
+    s = &c->wsegs[c->wsegcount++];
+    s->ptr = ptr;
+    s->off = off;
+    s->len = len;
+    c->wpending += len;
+    return 0;
+}
+
+/* Packets are wired by appending to wbuf at towrite. Cover anything new with
+ * a segment so it goes out in order with the referenced data. */
+static int _wseg_close_own(conn *c)
+{
+    if (c->towrite > c->wmark) {
+        if (_wseg_push(c, NULL, c->wmark, c->towrite - c->wmark) == -1)
+            return -1;
+        c->wmark = c->towrite;
+    }
+    return 0;
+}
+
+/* Queue len bytes at ptr for sending without copying them. The memory has to
+ * stay put until the write completes or conn_write_materialize() runs. */
+static int conn_write_ref(conn *c, unsigned char *ptr, int len)
+{
+    if (_wseg_close_own(c) == -1)
+        return -1;
+    return _wseg_push(c, ptr, 0, len);
+}
+
+/* Copy any referenced data still waiting to go out into our own wbuf, so the
+ * buffers it came from can be reused. */
+static int conn_write_materialize(conn *c)
+{
+    return conn_write_materialize_from(c, NULL, 0);
+}
+
+/* ... only what's referenced out of size bytes at buf, or all of it if buf
+ * is NULL. */
+static int conn_write_materialize_from(conn *c, unsigned char *buf, int size)
+{
+    int i;
+    dpm_wseg *s;
+
+    if (_wseg_close_own(c) == -1)
+        return -1;
+
+    for (i = c->wsegsent; i < c->wsegcount; i++) {
+        s = &c->wsegs[i];
+        if (s->ptr == NULL)
+            continue;
+        if (buf && (s->ptr < buf || s->ptr >= buf + size))
+            continue;
+        if (grow_write_buffer(c, c->towrite + s->len) == -1)
+            return -1;
+        memcpy(c->wbuf + c->towrite, s->ptr, s->len);
+        s->ptr = NULL;
+        s->off = c->towrite;
+        c->towrite += s->len;
+    }
+    c->wmark = c->towrite;
+
+    return 0;
+}
+
+/* Everything queued has been sent (or is being thrown away). */
+static void _wseg_reset(conn *c)
+{
+    c->towrite   = 0;
+    c->wmark     = 0;
+    c->wsegcount = 0;
+    c->wsegsent  = 0;
+    c->wsegoff   = 0;
+    c->wpending  = 0;
+    conn_release_wbuf(c);
+}
+
 /* handle buffering writes... we're looking for EAGAIN until we stop
  * transmitting.
- * We're assuming the write data was pre-populated.
- * NOTE: Need to support changes in written between calls
+ * We're assuming the write data was pre-populated. The whole segment chain
+ * goes out with one sendmsg(), unless it's longer than DPM_IOV_MAX.
  */
 static int handle_write(conn *c)
 {
+    struct iovec iov[DPM_IOV_MAX];
+    struct msghdr msg;
+    dpm_wseg *s;
+    size_t want;
     int wbytes;
+    int sent;
+    int flags;
+    int skip;
+    int i, n;
     int written = 0;
 
+    if (_wseg_close_own(c) == -1)
+        return -1;
+
+    if (dpm_io_uring)
+        return uring_write(c);
+
     /* Short circuit for outbound connections. */
-    if (c->towrite < 1) {
+    if (c->wsegcount < 1) {
         return written;
     }
 
     for(;;) {
-        if (c->written == c->towrite) {
+        if (c->wsegsent == c->wsegcount) {
             c->mystate = my_reading;
-            c->written = 0;
-            c->towrite = 0;
-            update_conn_event(c, EV_READ | EV_PERSIST);
+            _wseg_reset(c);
             break;
         }
 
-        wbytes = send(c->fd, c->wbuf + c->written, c->towrite - c->written, 0);
+        want = 0;
+        for (i = c->wsegsent, n = 0; i < c->wsegcount && n < DPM_IOV_MAX; i++, n++) {
+            s = &c->wsegs[i];
+            skip = i == c->wsegsent ? c->wsegoff : 0;
+            iov[n].iov_base = (s->ptr ? s->ptr : c->wbuf + s->off) + skip;
+            iov[n].iov_len  = s->len - skip;
+            want += iov[n].iov_len;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = n;
+
+        flags = 0;
+#ifdef MSG_MORE
+        /* Don't push out a short frame if we know more is right behind it. */
+        if (i < c->wsegcount || c->wmore)
+            flags |= MSG_MORE;
+#endif
+
+        wbytes = sendmsg(c->fd, &msg, flags);
+        c->write_calls++;
 
         if (wbytes == 0) {
             return -1;
         } else if (wbytes == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                if (add_conn_event(c, EV_WRITE) == 0) {
+                if (conn_want_write(c) == 0) {
                     fprintf(stderr, "Couldn't add write watch to %d\n", c->fd);
                     return -1;
                 }
                 /* Transient error. Come back later. */
-                return 0;
+                break;
+            } else if (errno == EINTR) {
+                continue;
             } else {
                 perror("Unhandled write error");
                 return -1;
             }
         }
 
-        c->written += wbytes;
-        written    += wbytes;
+        written += wbytes;
+        sent     = wbytes;
+        dpm_self->stats.bytes_written += wbytes;
+        c->wpending -= wbytes;
+
+        /* Step over what was sent. */
+        while (wbytes > 0) {
+            s = &c->wsegs[c->wsegsent];
+            if (wbytes < s->len - c->wsegoff) {
+                c->wsegoff += wbytes;
+                break;
+            }
+            wbytes -= s->len - c->wsegoff;
+            c->wsegsent++;
+            c->wsegoff = 0;
+        }
+
+        /* A short send means the socket buffer is full. The next send()
+         * would only return EAGAIN, so skip it and wait for writability. */
+        if ((size_t)sent < want) {
+            if (conn_want_write(c) == 0) {
+                fprintf(stderr, "Couldn't add write watch to %d\n", c->fd);
+                return -1;
+            }
+            break;
+        }
     }
 
+    c->wmore = 0;
     return written;
 }
 
-/* Handle buffered read events. Read into the buffer until we would block.
+/* Handle buffered read events. Read into the buffer until the socket is
+ * drained; a read which doesn't fill the space offered means there's nothing
+ * left, so we stop there instead of paying for a read() that only returns
+ * EAGAIN. The read event is level triggered, so anything arriving after
+ * that brings us straight back.
  * returns the total number of bytes read in the session. */
 static int handle_read(conn *c)
 {
     int rbytes;
+    int rsize;
     int newdata = 0;
+    int newsize;
     unsigned char *new_rbuf;
 
     for(;;) {
         /* We're in trouble if read is larger than rbufsize, right? ;) 
-         * Anyhoo, if so, we want to realloc up the buffer.
-         * TODO: Share buffers so we don't realloc so often... */
+         * Anyhoo, if so, we want a bigger buffer from the pool. Idle conns
+         * don't have one at all. */
         if (c->read >= c->rbufsize) {
+            /* Big packets are streamed out of whatever buffer we have. */
+            if (c->frame_left && c->rbufsize)
+                break;
             /* I'd prefer 1.5... */
-            if (verbose)
-                fprintf(stdout, "Reallocing input buffer from %d to %d\n",
-                    c->rbufsize, c->rbufsize * 2);
-            new_rbuf = realloc(c->rbuf, c->rbufsize * 2);
+            new_rbuf = bufpool_get(c->rbufsize ? c->rbufsize * 2 : BUF_SIZE, &newsize);
 
             if (new_rbuf == NULL) {
-                perror("Realloc input buffer");
+                perror("Growing input buffer");
                 return -1;
             }
 
-            /* The start of the new buffer might've changed: realloc(2) */
+            if (c->rbuf) {
+                if (verbose)
+                    fprintf(stdout, "Growing input buffer from %d to %d\n",
+                        c->rbufsize, newsize);
+                memcpy(new_rbuf, c->rbuf, c->read);
+                bufpool_put(c->rbuf, c->rbufsize);
+                dpm_self->stats.rbuf_grows++;
+            }
+
             c->rbuf = new_rbuf;
-            c->rbufsize *= 2;
+            c->rbufsize = newsize;
+            if (newsize > c->rbuf_peak)
+                c->rbuf_peak = newsize;
         }
 
         /* while bytes from read, pack into buffer. return when would block */
-        rbytes = read(c->fd, c->rbuf + c->read, c->rbufsize - c->read);
+        rsize  = c->rbufsize - c->read;
+        rbytes = read(c->fd, c->rbuf + c->read, rsize);
+        c->read_calls++;
 
         /* If signaled for reading and got zero bytes, close it up 
          * FIXME : Should we flush the command? */
@@ -384,7 +1110,9 @@ static int handle_read(conn *c)
             return -1;
         } else if (rbytes == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return 0;
+                break;
+            } else if (errno == EINTR) {
+                continue;
             } else {
                 return -1;
             }
@@ -392,7 +1120,11 @@ static int handle_read(conn *c)
 
         /* Successfuly read. Mark our progress */
         c->read += rbytes;
+        dpm_self->stats.bytes_read += rbytes;
         newdata += rbytes;
+
+        if (rbytes < rsize)
+            break;
     }
 
     /* Allows caller to arbitrarily measure progress, since we use a binary
@@ -401,24 +1133,332 @@ static int handle_read(conn *c)
     return newdata;
 }
 
-static conn *init_conn(int newfd)
+/* The io_uring engine's side of handle_write(): everything queued for c is
+ * handed over as one buffer, which the engine owns until the send is done.
+ * Forwarded data has to be copied for that, since the rbufs it's referenced
+ * from are compacted and reused long before the kernel gets to it. Our own
+ * wbuf is passed over whole when it's all there is.
+ * Returns the bytes to send, or -1 if out of memory. */
+int conn_take_writes(conn *c, unsigned char **buf, int *size)
 {
-    conn *newc;
-    static int my_connection_counter = 1; /* NOTE: Not positive if this should be global or not */
-
-    /* client typedef init should be its own function */
-    newc = (conn *)malloc( sizeof(conn) ); /* error handling */
-    memset(newc, 0, sizeof(conn));
-    newc->fd = newfd;
-    newc->id = my_connection_counter++;
-    newc->ev_flags = EV_READ | EV_PERSIST;
-    newc->mystate = my_reading;
-    newc->dpmstate = my_waiting;
+    dpm_wseg *s;
+    unsigned char *out;
+    int len = c->wpending;
+    int outsize;
+    int skip;
+    int pos = 0;
+    int i;
+
+    if (c->wsegsent == c->wsegcount) {
+        _wseg_reset(c);
+        return 0;
+    }
+
+    s = &c->wsegs[c->wsegsent];
+    if (c->wsegcount - c->wsegsent == 1 && s->ptr == NULL && s->off == 0 &&
+        c->wsegoff == 0) {
+        out     = c->wbuf;
+        outsize = c->wbufsize;
+        c->wbuf     = NULL;
+        c->wbufsize = 0;
+    } else {
+        out = bufpool_get(len, &outsize);
+        if (out == NULL) {
+            perror("Gathering writes");
+            return -1;
+        }
+        for (i = c->wsegsent; i < c->wsegcount; i++) {
+            s    = &c->wsegs[i];
+            skip = i == c->wsegsent ? c->wsegoff : 0;
+            memcpy(out + pos, (s->ptr ? s->ptr : c->wbuf + s->off) + skip, s->len - skip);
+            pos += s->len - skip;
+        }
+    }
+
+    c->mystate = my_reading;
+    _wseg_reset(c);
+    /* Still on its way, as far as flow control is concerned. */
+    c->wpending = len;
+
+    *buf  = out;
+    *size = outsize;
+    return len;
+}
+
+/* The io_uring engine received len bytes for c, or hit EOF (0) or an error
+ * (-1). What handle_event() does after handle_read(), minus the read. */
+void conn_received(conn *c, const unsigned char *data, int len)
+{
+    unsigned char *new_rbuf;
+    int newsize;
+    int want;
+
+    if (len <= 0) {
+        handle_close(c);
+        return;
+    }
+
+    if (c->read + len > c->rbufsize) {
+        for (want = c->rbufsize ? c->rbufsize * 2 : BUF_SIZE; want < c->read + len; want *= 2);
+        new_rbuf = bufpool_get(want, &newsize);
+
+        if (new_rbuf == NULL) {
+            perror("Growing input buffer");
+            handle_close(c);
+            return;
+        }
+
+        if (c->rbuf) {
+            if (verbose)
+                fprintf(stdout, "Growing input buffer from %d to %d\n",
+                    c->rbufsize, newsize);
+            memcpy(new_rbuf, c->rbuf, c->read);
+            bufpool_put(c->rbuf, c->rbufsize);
+            dpm_self->stats.rbuf_grows++;
+        }
+
+        c->rbuf = new_rbuf;
+        c->rbufsize = newsize;
+        if (newsize > c->rbuf_peak)
+            c->rbuf_peak = newsize;
+    }
+
+    memcpy(c->rbuf + c->read, data, len);
+    c->read += len;
+    c->read_calls++;
+    dpm_self->stats.bytes_read += len;
+
+    SAMPLER_PUSH(PHASE_PROTOCOL);
+    if (run_protocol(c, len, 0) == -1)
+        handle_close(c);
+    SAMPLER_POP();
+}
+
+/* The io_uring engine has sent everything handle_write() gave it last time.
+ * Send what's been queued since, then carry on as handle_event() does for a
+ * writable socket. */
+void conn_sent(conn *c)
+{
+    int wbytes = 0;
+
+    if (c->wsegcount || c->towrite > c->wmark) {
+        SAMPLER_PUSH(PHASE_WRITE);
+        wbytes = handle_write(c);
+        SAMPLER_POP();
+        if (wbytes < 0) {
+            handle_close(c);
+            return;
+        }
+    }
+    conn_throttle_check(c);
+
+    SAMPLER_PUSH(PHASE_PROTOCOL);
+    if (run_protocol(c, 0, wbytes) == -1)
+        handle_close(c);
+    SAMPLER_POP();
+}
+
+/* Rows which don't fit in one read can go out before they're all in, as
+ * long as nobody wants to look at them. Returns how many bytes of the row at
+ * readto are still to be read, or 0 if it can't be streamed. */
+static int row_stream_left(conn *c)
+{
+    conn *remote = (conn *)c->remote;
+    int have     = c->read - c->readto;
+    int size;
+
+    if (remote == NULL || !remote->alive)
+        return 0;
+    if (c->my_type != MY_SERVER || c->dpmstate != MYS_SENDING_ROWS || have < 5)
+        return 0;
+    if (c->big_packet || c->frame_left)
+        return 0;
+
+    size = uint3korr(&c->rbuf[c->readto]) + 4;
+    if (size <= have)
+        return 0;
+    /* Leave anything that might be an EOF or ERR to the normal path. */
+    if (c->rbuf[c->readto + 4] == 254 || c->rbuf[c->readto + 4] == 255)
+        return 0;
+    if (CALLBACK_AVAILABLE(c) || CALLBACK_AVAILABLE(remote))
+        return 0;
+
+    return size - have;
+}
+
+/* Drive the state machine for a streamable row, then forward what we have of
+ * it. The caller moves the rest. */
+static int row_stream_head(conn *c)
+{
+    conn *remote = (conn *)c->remote;
+    void *p      = NULL;
+    int ptype    = dpm_none;
+
+    received_packet(c, &p, &ptype, c->rbuf[c->readto + 4]);
+    sent_packet(remote, &p, ptype, c->field_count);
+    if (remote->cache)
+        cache_abort(remote);
+    int1store(&c->rbuf[c->readto + 3], remote->packet_seq - 1);
+    if (conn_write_ref(remote, c->rbuf + c->readto, c->read - c->readto) == -1)
+        return -1;
+    _dpm_add_to_flush_list(remote);
+
+    c->readto = c->read;
+    return 0;
+}
+
+/* Cut-through for big rows: the head goes to the remote now, and the rest is
+ * handed over by forward_frames() as it's read, straight out of whatever
+ * buffer we have. Rows big enough to splice() are left for that.
+ * Returns bytes forwarded, 0 if the row has to wait, -1 on error. */
+static int conn_cut_through(conn *c)
+{
+    int have = c->read - c->readto;
+    int left;
+
+    if (settings.stream_min < 1)
+        return 0;
+    if ((left = row_stream_left(c)) < settings.stream_min)
+        return 0;
+#ifdef DPM_SPLICE
+    if (!dpm_io_uring && settings.splice_min > 0 && left >= settings.splice_min)
+        return 0;
+#endif
+
+    if (row_stream_head(c) == -1)
+        return -1;
+    c->frame_left = left;
+
+    return have;
+}
+
+#ifdef DPM_SPLICE
+/* Large rows which nobody wants to look at are passed through the kernel:
+ * the header and whatever's been read so far are forwarded as normal, and
+ * the rest of the payload is splice()'d from our socket into a pipe and from
+ * there into the remote's socket. We're back to parsing at the next packet
+ * boundary, so EOF/ERR detection and sequence ids work as usual.
+ * Returns -1 if the connection should be closed. */
+static int conn_stream_start(conn *c)
+{
+    conn *remote = (conn *)c->remote;
+    int left;
+
+    /* io_uring has the socket; splice() would race it. */
+    if (settings.splice_min < 1 || dpm_io_uring)
+        return 0;
+    if ((left = row_stream_left(c)) < settings.splice_min)
+        return 0;
+    /* Writes already queued for the remote have to go out first. */
+    if (remote->wsegcount)
+        return 0;
+
+    if (c->pipefd[0] == -1 && pipe2(c->pipefd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("Creating splice pipe");
+        c->pipefd[0] = -1;
+        c->pipefd[1] = -1;
+        return 0;
+    }
+
+    if (row_stream_head(c) == -1)
+        return -1;
+    if (handle_write(remote) == -1 || conn_write_materialize(remote) == -1)
+        _wseg_reset(remote);
+
+    c->stream_left = left;
+
+    return conn_stream(c);
+}
+
+/* Move as much of the current packet as we can. Stops when our socket is
+ * empty, or pauses our reads while the remote's socket is full. */
+static int conn_stream(conn *c)
+{
+    conn *remote = (conn *)c->remote;
+    ssize_t n;
+
+    for (;;) {
+        if (c->pipe_bytes) {
+            if (remote == NULL || !remote->alive)
+                return -1;
+
+            /* Still flushing packets queued ahead of the splice. */
+            if (remote->wsegcount) {
+                if (conn_pause_read(c) == 0)
+                    return -1;
+                return 0;
+            }
+
+            n = splice(c->pipefd[0], NULL, remote->fd, NULL, c->pipe_bytes,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (c->stream_left ? SPLICE_F_MORE : 0));
+            remote->write_calls++;
+
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (conn_want_write(remote) == 0 || conn_pause_read(c) == 0)
+                        return -1;
+                    return 0;
+                } else if (errno == EINTR) {
+                    continue;
+                }
+                perror("Splicing to remote");
+                return -1;
+            }
+
+            c->pipe_bytes -= n;
+            dpm_self->stats.bytes_written += n;
+            continue;
+        }
+
+        if (!c->throttled && conn_resume_read(c) == 0)
+            return -1;
+
+        if (c->stream_left == 0)
+            return 0;
+
+        n = splice(c->fd, NULL, c->pipefd[1], NULL,
+            c->stream_left < BUF_SPLICE ? c->stream_left : BUF_SPLICE,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        c->read_calls++;
+
+        if (n == 0) {
+            return -1;
+        } else if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            perror("Splicing from socket");
+            return -1;
+        }
+
+        c->stream_left -= n;
+        c->pipe_bytes  += n;
+        dpm_self->stats.bytes_read += n;
+    }
+}
+#endif
+
+static conn *init_conn(int newfd)
+{
+    conn *newc;
+
+    /* client typedef init should be its own function */
+    newc = conn_alloc();
+    if (newc == NULL) {
+        perror("Could not allocate conn");
+        return NULL;
+    }
+    memset(newc, 0, sizeof(conn));
+    newc->fd = newfd;
+    newc->id = dpm_conn_counter++;
+    newc->mystate = my_reading;
+    newc->dpmstate = my_waiting;
 
     /* Misc inits, for clarity. */
     newc->read        = 0;
     newc->readto      = 0;
-    newc->written     = 0;
     newc->towrite     = 0;
     newc->my_type     = MY_CLIENT;
     newc->packetsize  = 0;
@@ -427,30 +1467,30 @@ static conn *init_conn(int newfd)
     newc->packet_seq  = 0;
     newc->listener    = 0;
     newc->nextconn    = NULL;
-
-    /* Set up the buffers. */
-    newc->rbufsize = BUF_SIZE;
-    newc->wbufsize = BUF_SIZE;
-
-    newc->rbuf = (unsigned char *)malloc( (size_t)newc->rbufsize );
-    newc->wbuf = (unsigned char *)malloc( (size_t)newc->wbufsize );
-
-    /* Cleaner way to do this? I guess not with C */
-    if (newc->rbuf == 0 || newc->wbuf == 0) {
-        if (newc->rbuf != 0) free(newc->rbuf);
-        if (newc->wbuf != 0) free(newc->wbuf);
-        free(newc);
-        perror("Could not malloc()");
-        return NULL;
-    }
+    newc->pipefd[0]   = -1;
+    newc->pipefd[1]   = -1;
+    newc->write_high  = settings.write_high;
+    newc->write_low   = settings.write_low;
+    arena_init(&newc->arena);
+    arena_init(&newc->row_arena);
+
+    /* Buffers are taken from the pool when there's something to hold. */
+    newc->rbuf     = NULL;
+    newc->wbuf     = NULL;
+    newc->rbufsize = 0;
+    newc->wbufsize = 0;
 
     newc->remote  = NULL;
 
     /* Callback structures. Rest are zero from above memset. */
     newc->package_callback = NULL;
 
-    event_set(&newc->ev, newfd, newc->ev_flags, handle_event, (void *)newc);
-    event_add(&newc->ev, NULL); /* error handling */
+    /* Added to the loop by conn_start_reading(). */
+    event_set(&newc->ev, newfd, EV_READ | EV_PERSIST, handle_event, (void *)newc);
+    event_base_set(dpm_base, &newc->ev);
+
+    event_set(&newc->wev, newfd, EV_WRITE, handle_event, (void *)newc);
+    event_base_set(dpm_base, &newc->wev);
 
     if (verbose)
         fprintf(stdout, "Made new conn structure for %d\n", newfd);
@@ -461,49 +1501,39 @@ static conn *init_conn(int newfd)
 static void handle_event(int fd, short event, void *arg)
 {
     conn *c = arg;
-    conn *newc = NULL;
-    struct linger l = {0, 0};
-    int newfd, rbytes, wbytes;
-    int flags = 1;
-    int err   = 0;
+    int rbytes = 0;
+    int wbytes = 0;
+    int err    = 0;
+
+    conn_reap();
 
     /* if we're the server socket, it's a new conn */
     if (c->listener) {
-        newfd = handle_accept(fd); /* error handling */
-        if (verbose)
-            fprintf(stdout, "Got new client sock %d\n", newfd);
-
-        set_sock_nonblock(newfd); /* error handling on this and below */
-        setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-        setsockopt(newfd, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof(l));
-        newc = init_conn(newfd);
-
-        if (newc == NULL)
-            return;
-
-        newc->dpmstate  = MYC_WAIT_HANDSHAKE;
-        newc->my_type   = MY_CLIENT;
-        newc->alive++;
-
-        /* Pass the object up into lua for later inspection. */
-        new_obj(L, newc, "dpm.conn");
-        /* And the id of our listener object. */
-        lua_pushinteger(L, c->id);
-
-        c->dpmstate = MYC_CONNECT;
-        run_lua_callback(c, 2);
+        SAMPLER_PUSH(PHASE_ACCEPT);
+        handle_accept(c);
+        SAMPLER_POP();
+        return;
+    }
 
-        /* The callback might've written packets to the wire. */
-        if (newc->towrite) {
-            if (handle_write(newc) == -1)
+   if (event & EV_READ) {
+#ifdef DPM_SPLICE
+        /* Mid-way through splicing a packet to the remote. */
+        if (c->stream_left || c->pipe_bytes) {
+            if (conn_stream(c) == -1) {
+                handle_close(c);
+                return;
+            }
+            if (c->stream_left || c->pipe_bytes)
                 return;
         }
-        return;
-   }
-   
-   if (event & EV_READ) {
-        /* Client socket. */
-        rbytes = handle_read(c);
+#endif
+        /* Client socket. io_uring delivers through conn_received(), so
+         * this is only a nudge to look at what's buffered. */
+        if (!dpm_io_uring) {
+            SAMPLER_PUSH(PHASE_READ);
+            rbytes = handle_read(c);
+            SAMPLER_POP();
+        }
         /* FIXME : Should we do the error handling at this level? Or lower? */
         if (rbytes < 0) {
             handle_close(c);
@@ -513,17 +1543,32 @@ static void handle_event(int fd, short event, void *arg)
     }
 
     if (event & EV_WRITE) {
+        /* One-shot; libevent has already forgotten about it. */
+        c->want_write = 0;
         if (c->mystate != my_connect) {
+          SAMPLER_PUSH(PHASE_WRITE);
           wbytes = handle_write(c);
+          SAMPLER_POP();
 
           if (wbytes < 0) {
               handle_close(c);
               return;
           }
+          conn_throttle_check(c);
         }
+#ifdef DPM_SPLICE
+        /* The remote was splicing to us and stalled on a full socket. */
+        if (c->remote && ((conn *)c->remote)->pipe_bytes && c->wsegcount == 0) {
+            conn *r = (conn *)c->remote;
+            if (conn_stream(r) == -1)
+                handle_close(r);
+        }
+#endif
     }
 
+    SAMPLER_PUSH(PHASE_PROTOCOL);
     err = run_protocol(c, rbytes, wbytes);
+    SAMPLER_POP();
     if (err == -1) {
         handle_close(c);
     }
@@ -615,95 +1660,6 @@ int my_size_binary_field(uint64_t length)
     return 9;
 }
 
-static uint8_t my_char_val(uint8_t X)
-{
-  return (unsigned int) (X >= '0' && X <= '9' ? X-'0' :
-      X >= 'A' && X <= 'Z' ? X-'A'+10 : X-'a'+10);
-}
-
-static void my_hex2octet(uint8_t *dst, const char *src, unsigned int len)
-{   
-  const char *str_end= src + len;
-  while (src < str_end) {
-      char tmp = my_char_val(*src++);
-      *dst++ = (tmp << 4) | my_char_val(*src++);
-  }
-}
-
-static void my_crypt(char *dst, const unsigned char *s1, const unsigned char *s2, uint len)
-{
-  const uint8_t *s1_end= s1 + len;
-  while (s1 < s1_end)
-    *dst++ = *s1++ ^ *s2++;
-}
-/* End. */
-
-/* Client scramble
- * random is 20 byte random scramble from the server.
- * pass is plaintext password supplied from client
- * dst is a 20 byte buffer to receive the jumbled mess. */
-static void my_scramble(char *dst, const char *random, const char *pass)
-{
-    SHA1_CTX context;
-    uint8_t hash1[SHA1_DIGEST_LENGTH];
-    uint8_t hash2[SHA1_DIGEST_LENGTH];
-    /* Make sure the null terminator's in the right spot. */
-    dst[SHA1_DIGEST_LENGTH] = '\0';
-
-    /* First hash the password. */
-    SHA1Init(&context);
-    SHA1Update(&context, (const uint8_t *) pass, strlen(pass));
-    SHA1Final(hash1, &context);
-
-    /* Second, hash the hash. */
-    SHA1Init(&context);
-    SHA1Update(&context, hash1, SHA1_DIGEST_LENGTH);
-    SHA1Final(hash2, &context);
-
-    /* Now we have the equivalent of SELECT PASSWORD('whatever') */
-    /* Now SHA1 the random message against hash2, then xor it against hash1 */
-    SHA1Init(&context);
-    SHA1Update(&context, (const uint8_t *) random, SHA1_DIGEST_LENGTH);
-    SHA1Update(&context, hash2, SHA1_DIGEST_LENGTH);
-    SHA1Final((uint8_t *) dst, &context);
-
-    my_crypt((char *)dst, (const unsigned char *) dst, hash1, SHA1_DIGEST_LENGTH);
-
-    /* The sha1 context has temporary data that needs to disappear. */
-    memset(&context, 0, sizeof(SHA1_CTX));
-}
-
-/* Server side check. */
-static int my_check_scramble(const char *remote_scram, const char *random, const char *stored_hash)
-{
-    uint8_t pass_hash[SHA1_DIGEST_LENGTH];
-    uint8_t rand_hash[SHA1_DIGEST_LENGTH];
-    uint8_t pass_orig[SHA1_DIGEST_LENGTH];
-    uint8_t pass_check[SHA1_DIGEST_LENGTH];
-    SHA1_CTX context;
-
-    /* Parse string into bytes... */
-    my_hex2octet(pass_hash, stored_hash, strlen(stored_hash));
-
-    /* Muck up our view of the password against our original random num */
-    SHA1Init(&context);
-    SHA1Update(&context, (const uint8_t *) random, SHA1_DIGEST_LENGTH);
-    SHA1Update(&context, pass_hash, SHA1_DIGEST_LENGTH);
-    SHA1Final(rand_hash, &context);
-
-    /* Pull out the client sha1 */
-    my_crypt((char *) pass_orig, (const unsigned char *) rand_hash, (const unsigned char *) remote_scram, SHA1_DIGEST_LENGTH);
-
-    /* Update it to be more like our own */
-    SHA1Init(&context);
-    SHA1Update(&context, pass_orig, SHA1_DIGEST_LENGTH);
-    SHA1Final(pass_check, &context);
-    memset(&context, 0, sizeof(SHA1_CTX));
-
-    /* Compare */
-    return memcmp(pass_hash, pass_check, SHA1_DIGEST_LENGTH);
-}
-
 /* If we're ready to send the next packet along, prep the header and
  * return the starting position. */
 static int my_next_packet_start(conn *c)
@@ -711,26 +1667,22 @@ static int my_next_packet_start(conn *c)
     int seq = 0;
     /* A couple sanity checks... First is that we must have enough bytes
      * readable to try consuming a header. */
-    if (c->readto + 3 > c->read)
+    if (c->readto + 4 > c->read)
         return -1;
 
     c->packetsize = uint3korr(&c->rbuf[c->readto]);
     seq           = uint1korr(&c->rbuf[c->readto + 3]);
     c->packetsize += 4;
 
-    /* Don't handle large packets right now.
-     * TODO: This actually shouldn't be too hard. Keep spooling with this
-     * function until we can scan to the end of the function within the buffer
-     * structure. Ugly, but the protocol's ugly anyway.
-     */
-    if (c->packetsize == 0 && seq == 255) {
-        fprintf(stderr, "***WARNING*** DPM does not support packet sizes larger than 16M currently. If you report this warning it will probably be fixed.");
-        handle_close(c);
-        return -1;
-    }
+    /* A full length frame means the packet carries on in the next frame.
+     * Those are never gathered up: the state machine gets the first frame as
+     * soon as its type byte is here, and the rest is streamed by
+     * forward_frames(). */
+    if (c->packetsize == MAX_PACKET_LENGTH + 4 && c->read - c->readto > 4)
+        c->big_packet = 1;
 
     /* If we've read a packet header, see if we have the whole packet. */
-    if (c->read - c->readto >= c->packetsize) {
+    if (c->big_packet || c->read - c->readto >= c->packetsize) {
         /* Test the packet header. Is it out of sequence? */
         /* FIXME: The MY_CLIENT hack is because we're not fully tracking client
          * state. So if the consumer is a client and the header's zero for no
@@ -746,6 +1698,19 @@ static int my_next_packet_start(conn *c)
     return -1;
 }
 
+/* Start of a pin_me routine: a heap copy of an arena packet's struct. */
+static void *_pin_copy(void *pkt, size_t size)
+{
+    void *n = malloc(size);
+
+    if (n == NULL) {
+        perror("Could not malloc()");
+        return NULL;
+    }
+    memcpy(n, pkt, size);
+    return n;
+}
+
 /* TODO: In another life this should be some crazy struct buffer. */
 static void my_free_handshake_packet(void *p)
 {
@@ -1185,9 +2150,9 @@ static void *my_consume_ok_packet(conn *c)
     uint64_t my_size = 0;
 
     /* Clear out the struct. */
-    p = (my_ok_packet *)malloc( sizeof(my_ok_packet) );
+    p = (my_ok_packet *)arena_alloc(&c->arena, sizeof(my_ok_packet));
     if (p == NULL) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     memset(p, 0, sizeof(my_ok_packet));
@@ -1195,6 +2160,7 @@ static void *my_consume_ok_packet(conn *c)
     p->h.ptype = dpm_ok;
     p->h.free_me = my_free_ok_packet;
     p->h.to_buf  = my_wire_ok_packet;
+    p->h.pin_me  = my_pin_ok_packet;
 
     p->affected_rows = my_read_binary_field(c->rbuf, &base);
 
@@ -1207,9 +2173,9 @@ static void *my_consume_ok_packet(conn *c)
     base += 2;
 
     if (c->packetsize > base - c->readto && (my_size = my_read_binary_field(c->rbuf, &base))) {
-        p->message = (char *)malloc( my_size );
+        p->message = (char *)arena_alloc(&c->arena, my_size);
         if (p->message == 0) {
-            perror("Could not malloc()");
+            perror("Could not allocate packet");
             return NULL;
         }
         p->message_len = my_size;
@@ -1218,11 +2184,35 @@ static void *my_consume_ok_packet(conn *c)
         p->message = NULL;
     }
 
-    new_obj(L, p, "dpm.ok");
+    new_packet_obj(L, p, "dpm.ok", &c->arena);
 
     return p;
 }
 
+/* Pinned packets are freed with free_me like any other, so everything
+ * hanging off of them has to be copied out as well. */
+static void *my_pin_ok_packet(void *pkt)
+{
+    my_ok_packet *p = pkt;
+    my_ok_packet *n;
+
+    n = (my_ok_packet *)_pin_copy(p, sizeof(my_ok_packet));
+    if (n == NULL)
+        return NULL;
+
+    if (p->message) {
+        n->message = (char *)malloc( p->message_len );
+        if (n->message == NULL) {
+            perror("Could not malloc()");
+            free(n);
+            return NULL;
+        }
+        memcpy(n->message, p->message, p->message_len);
+    }
+
+    return n;
+}
+
 static void my_free_err_packet(void *p)
 {
     free(p);
@@ -1301,9 +2291,9 @@ static void *my_consume_err_packet(conn *c)
     size_t my_size = 0;
 
     /* Clear out the struct. */
-    p = (my_err_packet *)malloc( sizeof(my_err_packet) );
+    p = (my_err_packet *)arena_alloc(&c->arena, sizeof(my_err_packet));
     if (p == NULL) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     memset(p, 0, sizeof(my_err_packet));
@@ -1311,6 +2301,7 @@ static void *my_consume_err_packet(conn *c)
     p->h.ptype = dpm_err;
     p->h.free_me = my_free_err_packet;
     p->h.to_buf = my_wire_err_packet;
+    p->h.pin_me = my_pin_err_packet;
 
     p->field_count = c->rbuf[base]; /* Always 255... */
     base++;
@@ -1341,11 +2332,16 @@ static void *my_consume_err_packet(conn *c)
     memcpy(p->message, &c->rbuf[base], my_size);
     p->message[my_size] = '\0';
 
-    new_obj(L, p, "dpm.err");
+    new_packet_obj(L, p, "dpm.err", &c->arena);
 
     return p;
 }
 
+static void *my_pin_err_packet(void *pkt)
+{
+    return _pin_copy(pkt, sizeof(my_err_packet));
+}
+
 void *my_new_cmd_packet()
 {
     my_cmd_packet *p;
@@ -1424,6 +2420,65 @@ static int my_wire_cmd_packet(conn *c, void *pkt)
     return 0;
 }
 
+/* Lua can't build a COM_CHANGE_USER, since the scramble is binary. The pool
+ * uses it to reset a backend's session. 'scramble' is the 20 byte response
+ * to the server's handshake, or NULL for no password. */
+int conn_change_user(conn *c, const char *user, const char *scramble, const char *db)
+{
+    my_cmd_packet cmd;
+    void *p = &cmd;
+    size_t user_size = strlen(user) + 1;
+    size_t db_size = db ? strlen(db) + 1 : 1;
+    int base = c->towrite;
+    int psize = 6 + user_size + db_size; /* header, command, scramble length */
+
+    if (scramble)
+        psize += 20;
+
+    if (grow_write_buffer(c, c->towrite + psize) == -1) {
+        return -1;
+    }
+
+    c->towrite += psize;
+
+    int3store(&c->wbuf[base], psize - 4);
+    base += 3;
+    int1store(&c->wbuf[base], 0);
+    base++;
+
+    c->wbuf[base] = COM_CHANGE_USER;
+    base++;
+
+    memcpy(&c->wbuf[base], user, user_size);
+    base += user_size;
+
+    if (scramble) {
+        c->wbuf[base] = 20;
+        base++;
+        memcpy(&c->wbuf[base], scramble, 20);
+        base += 20;
+    } else {
+        c->wbuf[base] = 0;
+        base++;
+    }
+
+    if (db) {
+        memcpy(&c->wbuf[base], db, db_size);
+    } else {
+        c->wbuf[base] = '\0';
+    }
+
+    _dpm_add_to_flush_list(c);
+
+    /* Only the command matters to the state machine. */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.h.ptype = dpm_cmd;
+    cmd.command = COM_CHANGE_USER;
+    sent_packet(c, &p, dpm_cmd, 0);
+
+    return 0;
+}
+
 static void *my_consume_cmd_packet(conn *c)
 {
     my_cmd_packet *p;
@@ -1431,9 +2486,9 @@ static void *my_consume_cmd_packet(conn *c)
     size_t my_size = 0;
 
     /* Clear out the struct. */
-    p = (my_cmd_packet *)malloc( sizeof(my_cmd_packet) );
+    p = (my_cmd_packet *)arena_alloc(&c->arena, sizeof(my_cmd_packet));
     if (p == NULL) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     memset(p, 0, sizeof(my_cmd_packet));
@@ -1441,37 +2496,64 @@ static void *my_consume_cmd_packet(conn *c)
     p->h.ptype   = dpm_cmd;
     p->h.free_me = my_free_cmd_packet;
     p->h.to_buf  = my_wire_cmd_packet;
+    p->h.pin_me  = my_pin_cmd_packet;
 
     p->command = c->rbuf[base];
     base++;
 
+    /* Big commands are streamed through, so lua only gets the command. */
+    if (c->big_packet) {
+        p->argument = NULL;
+        new_packet_obj(L, p, "dpm.cmd", &c->arena);
+        return p;
+    }
+
     my_size = c->packetsize - (base - c->readto);
 
-    p->argument = (char *)malloc( my_size + 1 );
+    p->argument = (char *)arena_alloc(&c->arena, my_size + 1);
     if (p->argument == 0) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     memcpy(p->argument, &c->rbuf[base], my_size);
     p->argument[my_size] = '\0';
 
-    new_obj(L, p, "dpm.cmd");
+    new_packet_obj(L, p, "dpm.cmd", &c->arena);
 
     return p;
 }
 
-void *my_new_rset_packet()
+static void *my_pin_cmd_packet(void *pkt)
 {
-    my_rset_packet *p;
+    my_cmd_packet *p = pkt;
+    my_cmd_packet *n;
 
-    p = (my_rset_packet *)malloc( sizeof(my_rset_packet) );
-    if (p == NULL) {
+    n = (my_cmd_packet *)_pin_copy(p, sizeof(my_cmd_packet));
+    if (n == NULL || p->argument == NULL)
+        return n;
+
+    n->argument = strdup(p->argument);
+    if (n->argument == NULL) {
         perror("Could not malloc()");
+        free(n);
         return NULL;
     }
-    memset(p, 0, sizeof(my_rset_packet));
 
-    p->h.ptype   = dpm_rset;
+    return n;
+}
+
+void *my_new_rset_packet()
+{
+    my_rset_packet *p;
+
+    p = (my_rset_packet *)malloc( sizeof(my_rset_packet) );
+    if (p == NULL) {
+        perror("Could not malloc()");
+        return NULL;
+    }
+    memset(p, 0, sizeof(my_rset_packet));
+
+    p->h.ptype   = dpm_rset;
     p->h.free_me = my_free_rset_packet;
     p->h.to_buf  = my_wire_rset_packet;
 
@@ -1496,9 +2578,9 @@ static void *my_consume_rset_packet(conn *c)
     int base = c->readto + 4;
 
     /* Clear out the struct. */
-    p = (my_rset_packet *)malloc( sizeof(my_rset_packet) );
+    p = (my_rset_packet *)arena_alloc(&c->arena, sizeof(my_rset_packet));
     if (p == NULL) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     memset(p, 0, sizeof(my_rset_packet));
@@ -1506,6 +2588,7 @@ static void *my_consume_rset_packet(conn *c)
     p->h.ptype   = dpm_rset;
     p->h.free_me = my_free_rset_packet;
     p->h.to_buf  = my_wire_rset_packet;
+    p->h.pin_me  = my_pin_rset_packet;
 
     p->field_count = my_read_binary_field(c->rbuf, &base);
     c->field_count = p->field_count;
@@ -1514,17 +2597,39 @@ static void *my_consume_rset_packet(conn *c)
         p->extra = my_read_binary_field(c->rbuf, &base);
     }
 
-    p->fields = malloc( sizeof(my_rset_field_header) * p->field_count );
+    p->fields = arena_alloc(&c->arena, sizeof(my_rset_field_header) * p->field_count);
     if (p->fields == NULL) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
 
-    new_obj(L, p, "dpm.rset");
+    new_packet_obj(L, p, "dpm.rset", &c->arena);
 
     return p;
 }
 
+/* Fields can only be added to a pinned rset, so there are no field
+ * references to carry over. */
+static void *my_pin_rset_packet(void *pkt)
+{
+    my_rset_packet *p = pkt;
+    my_rset_packet *n;
+
+    n = (my_rset_packet *)_pin_copy(p, sizeof(my_rset_packet));
+    if (n == NULL)
+        return NULL;
+
+    n->fields = malloc( sizeof(my_rset_field_header) * p->field_count );
+    if (n->fields == NULL) {
+        perror("Could not malloc()");
+        free(n);
+        return NULL;
+    }
+    memcpy(n->fields, p->fields, sizeof(my_rset_field_header) * p->fields_total);
+
+    return n;
+}
+
 /* This is a magic packet, but the only thing we need to really send
  * will be the one field. We can send 'extra' once I know what the crap it is.
  */
@@ -1592,9 +2697,9 @@ static void *my_consume_field_packet(conn *c)
     unsigned char *start_ptr;
 
     /* Clear out the struct. */
-    p = (my_field_packet *)malloc( sizeof(my_field_packet) );
+    p = (my_field_packet *)arena_alloc(&c->arena, sizeof(my_field_packet));
     if (p == NULL) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     memset(p, 0, sizeof(my_field_packet));
@@ -1602,6 +2707,7 @@ static void *my_consume_field_packet(conn *c)
     p->h.ptype   = dpm_field;
     p->h.free_me = my_free_field_packet;
     p->h.to_buf  = my_wire_field_packet;
+    p->h.pin_me  = my_pin_field_packet;
 
     /* This packet type has a ton of dynamic length fields.
      * What we're going to do instead of 6 mallocs is use an offset table
@@ -1610,9 +2716,9 @@ static void *my_consume_field_packet(conn *c)
 
     my_size = c->packetsize + 12; /* Extra room for null bytes */
 
-    p->fields = (unsigned char *)malloc( my_size );
+    p->fields = (unsigned char *)arena_alloc(&c->arena, my_size);
     if (p->fields == NULL) {
-        perror("Malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     start_ptr = p->fields;
@@ -1690,11 +2796,40 @@ static void *my_consume_field_packet(conn *c)
         p->has_default++;
     }
 
-    new_obj(L, p, "dpm.field");
+    new_packet_obj(L, p, "dpm.field", &c->arena);
 
     return p;
 }
 
+/* The strings all point into 'fields', which ends after org_name's null. */
+static void *my_pin_field_packet(void *pkt)
+{
+    my_field_packet *p = pkt;
+    my_field_packet *n;
+    size_t my_size = p->org_name + p->org_name_len + 1 - p->fields;
+
+    n = (my_field_packet *)_pin_copy(p, sizeof(my_field_packet));
+    if (n == NULL)
+        return NULL;
+
+    n->fields = (unsigned char *)malloc( my_size );
+    if (n->fields == NULL) {
+        perror("Could not malloc()");
+        free(n);
+        return NULL;
+    }
+    memcpy(n->fields, p->fields, my_size);
+
+    n->catalog   = n->fields + (p->catalog - p->fields);
+    n->db        = n->fields + (p->db - p->fields);
+    n->table     = n->fields + (p->table - p->fields);
+    n->org_table = n->fields + (p->org_table - p->fields);
+    n->name      = n->fields + (p->name - p->fields);
+    n->org_name  = n->fields + (p->org_name - p->fields);
+
+    return n;
+}
+
 static int my_wire_field_packet(conn *c, void *pkt)
 {
     my_field_packet *p = pkt;
@@ -1809,14 +2944,16 @@ static void my_free_row_packet(void *pkt)
     free(p);
 }
 
+/* A consumed row only lives as long as its callback, and so does the read
+ * buffer it came from, so the row data isn't copied at all. */
 static void *my_consume_row_packet(conn *c)
 {
     my_row_packet *p;
     int base = c->readto + 4;
 
-    p = malloc( sizeof(my_row_packet) );
+    p = (my_row_packet *)arena_alloc(&c->row_arena, sizeof(my_row_packet));
     if (p == NULL) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     memset(p, 0, sizeof(my_row_packet));
@@ -1824,19 +2961,35 @@ static void *my_consume_row_packet(conn *c)
     p->h.ptype   = dpm_row;
     p->h.free_me = my_free_row_packet;
     p->h.to_buf  = my_wire_row_packet;
+    p->h.pin_me  = my_pin_row_packet;
 
-    /* We manage this memory with a lua string reference.
-     * This should make it simpler to pass into lua later, and allows tricks
-     * when packing and unpacking the rows.
-     */
-    lua_pushlstring(L, (const char *) &c->rbuf[base], c->packetsize - 4);
-    p->packed_row_lref = luaL_ref(L, LUA_REGISTRYINDEX);
+    p->data     = &c->rbuf[base];
+    p->data_len = c->packetsize - 4;
 
-    new_obj(L, p, "dpm.row");
+    new_packet_obj(L, p, "dpm.row", &c->row_arena);
 
     return p;
 }
 
+/* Pinned rows are managed with a lua string reference, same as the ones
+ * lua packs itself. */
+static void *my_pin_row_packet(void *pkt)
+{
+    my_row_packet *p = pkt;
+    my_row_packet *n;
+
+    n = (my_row_packet *)_pin_copy(p, sizeof(my_row_packet));
+    if (n == NULL)
+        return NULL;
+
+    lua_pushlstring(L, (const char *) p->data, p->data_len);
+    n->packed_row_lref = luaL_ref(L, LUA_REGISTRYINDEX);
+    n->data     = NULL;
+    n->data_len = 0;
+
+    return n;
+}
+
 static int my_wire_row_packet(conn *c, void *pkt)
 {
     my_row_packet *p = pkt;
@@ -1846,12 +2999,20 @@ static int my_wire_row_packet(conn *c, void *pkt)
     size_t len  = 0;
     const char *rdata;
 
-    lua_rawgeti(L, LUA_REGISTRYINDEX, p->packed_row_lref);
-    rdata  = lua_tolstring(L, -1, &len);
+    if (p->data) {
+        rdata = (const char *) p->data;
+        len   = p->data_len;
+        lua_pushnil(L);
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, p->packed_row_lref);
+        rdata = lua_tolstring(L, -1, &len);
+    }
     psize += len;
 
-    if (grow_write_buffer(c, c->towrite + psize) == -1)
+    if (grow_write_buffer(c, c->towrite + psize) == -1) {
+        lua_pop(L, 1);
         return -1;
+    }
 
     c->towrite += psize;
 
@@ -1903,9 +3064,9 @@ static void *my_consume_eof_packet(conn *c)
     int base = c->readto + 4;
  
     /* Clear out the struct. */
-    p = malloc( sizeof(my_eof_packet) );
+    p = (my_eof_packet *)arena_alloc(&c->arena, sizeof(my_eof_packet));
     if (p == NULL) {
-        perror("Could not malloc()");
+        perror("Could not allocate packet");
         return NULL;
     }
     memset(p, 0, sizeof(my_eof_packet));
@@ -1913,6 +3074,7 @@ static void *my_consume_eof_packet(conn *c)
     p->h.ptype   = dpm_eof;
     p->h.free_me = my_free_eof_packet;
     p->h.to_buf  = my_wire_eof_packet;
+    p->h.pin_me  = my_pin_eof_packet;
 
     /* Skip field_count, is always 0xFE */
     base++;
@@ -1923,11 +3085,16 @@ static void *my_consume_eof_packet(conn *c)
     p->server_status= uint2korr(&c->rbuf[base]);
     base += 2;
 
-    new_obj(L, p, "dpm.eof");
+    new_packet_obj(L, p, "dpm.eof", &c->arena);
 
     return p;
 }
 
+static void *my_pin_eof_packet(void *pkt)
+{
+    return _pin_copy(pkt, sizeof(my_eof_packet));
+}
+
 void *my_new_eof_packet()
 {
     my_eof_packet *p;
@@ -1959,6 +3126,7 @@ static void my_free_eof_packet(void *pkt)
 static int sent_packet(conn *c, void **p, int ptype, int field_count)
 {
     int ret = 0;
+    int state = c->dpmstate;
 
     #ifdef DBUG
     fprintf(stdout, "TX START State: [%llu] %s\n", (unsigned long long) c->id, my_state_name[c->dpmstate]);
@@ -1995,11 +3163,16 @@ static int sent_packet(conn *c, void **p, int ptype, int field_count)
             my_cmd_packet *cmd = (my_cmd_packet *)*p;
             c->last_cmd = cmd->command;
             c->dpmstate = MYS_GOT_CMD;
+            if (c->pool)
+                pool_conn_sent(c);
             }
             break;
         }
     }
 
+    if (c->dpmstate != state)
+        dpm_self->stats.states[c->dpmstate]++;
+
     #ifdef DBUG
     fprintf(stdout, "TX END State: [%llu] %s\n", (unsigned long long) c->id, my_state_name[c->dpmstate]);
     #endif
@@ -2016,6 +3189,7 @@ static int sent_packet(conn *c, void **p, int ptype, int field_count)
 static int received_packet(conn *c, void **p, int *ptype, int field_count)
 {
     int nargs = 0;
+    int state = c->dpmstate;
     pkt_func consumer = NULL;
     #ifdef DBUG
     fprintf(stdout, "RX START State: [%llu] %s\n", (unsigned long long) c->id, my_state_name[c->dpmstate]);
@@ -2036,6 +3210,8 @@ static int received_packet(conn *c, void **p, int *ptype, int field_count)
             c->dpmstate = MYC_WAITING;
             break;
         case MYC_WAITING:
+            /* A new command; whatever's left of the last one can go. */
+            arena_free(&c->arena);
             /* command packets must always be consumed. */
             *p = my_consume_cmd_packet(c);
             *ptype = dpm_cmd;
@@ -2043,6 +3219,8 @@ static int received_packet(conn *c, void **p, int *ptype, int field_count)
             /* Kick off the packet sequencer. */
             c->packet_seq = 1;
             nargs++;
+            if (!c->admin)
+                latency_start(c, (my_cmd_packet *)*p);
             break;
         }
         break;
@@ -2072,6 +3250,8 @@ static int received_packet(conn *c, void **p, int *ptype, int field_count)
                 break;
             case COM_INIT_DB:
             case COM_QUIT:
+            case COM_PING:
+            case COM_CHANGE_USER:
                 c->dpmstate = MYS_SENDING_OK;
                 break;
             case COM_STATISTICS:
@@ -2193,13 +3373,32 @@ static int received_packet(conn *c, void **p, int *ptype, int field_count)
         if (c->dpmstate == MYS_WAIT_CMD) {
             c->packet_seq = 0;
         }
+
+        /* The command's answered; stop the client's clock. Replies to a
+         * session replay aren't the client's. */
+        if (c->dpmstate == MYS_WAIT_CMD || c->dpmstate == MYS_RECV_ERR) {
+            if (c->pool)
+                pool_conn_done(c);
+            if (c->pool_state != POOL_REPLAY && c->remote &&
+                ((conn *)c->remote)->lat_entry)
+                latency_done((conn *)c->remote);
+        }
     }
 
-    if (consumer && CALLBACK_AVAILABLE(c)) {
-        *p = consumer(c);
+    if (consumer && (CALLBACK_AVAILABLE(c) || POOL_MANAGED(c) || c->admin)) {
+        /* Most of a big packet is still on the wire; lua gets nil. */
+        if (c->big_packet) {
+            lua_pushnil(L);
+        } else {
+            *p = consumer(c);
+        }
         nargs++;
     }
 
+    dpm_self->stats.packets[*ptype]++;
+    if (c->dpmstate != state)
+        dpm_self->stats.states[c->dpmstate]++;
+
     #ifdef DBUG
     fprintf(stdout, "RX END State: [%llu] %s\n", (unsigned long long) c->id, my_state_name[c->dpmstate]);
     #endif
@@ -2209,6 +3408,114 @@ static int received_packet(conn *c, void **p, int *ptype, int field_count)
 /* Run the "MySQL" protocol on a socket. Generic state machine logic.
  * Would've loved to use Ragel, but it doesn't make sense here.
  */
+/* Fast path for resultset rows. While a backend is sending rows to a client
+ * and neither has a callback for it, rows don't change any state. Scan every
+ * complete row in the buffer, stamping the client's sequence ids into the
+ * headers as we go, and hand the whole run to the remote as one segment.
+ * Stops at anything which could be an EOF or ERR, or a packet which isn't
+ * fully read; those take the normal path.
+ * Returns the number of rows forwarded, or -1 if the connection should be
+ * closed: the headers have been stamped by then, so the rows can't go back
+ * to the normal path. */
+static int forward_row_run(conn *c)
+{
+    conn *remote = (conn *)c->remote;
+    unsigned char *buf = c->rbuf;
+    int pos   = c->readto;
+    int count = 0;
+    int size;
+
+    if (remote == NULL || c->my_type != MY_SERVER || c->dpmstate != MYS_SENDING_ROWS)
+        return 0;
+    if (remote->my_type != MY_CLIENT || remote->dpmstate != MYC_WAITING)
+        return 0;
+    if (CALLBACK_AVAILABLE(c) || CALLBACK_AVAILABLE(remote))
+        return 0;
+
+    while (pos + 5 <= c->read) {
+        size = uint3korr(&buf[pos]) + 4;
+        if (pos + size > c->read || size == 4 || size == MAX_PACKET_LENGTH + 4)
+            break;
+        if (buf[pos + 4] == 255 || (buf[pos + 4] == 254 && size < 10))
+            break;
+
+        if (buf[pos + 3] != (unsigned char)(c->packet_seq + count)) {
+            fprintf(stderr, "***WARNING*** Packets appear to be out of order: type [%d] conn [%d], header [%d]\n", c->my_type, (unsigned char)(c->packet_seq + count), buf[pos + 3]);
+        }
+        buf[pos + 3] = (unsigned char)(remote->packet_seq + count);
+
+        pos += size;
+        count++;
+    }
+
+    if (count == 0)
+        return 0;
+
+    if (conn_write_ref(remote, buf + c->readto, pos - c->readto) == -1)
+        return -1;
+    _dpm_add_to_flush_list(remote);
+    if (remote->cache)
+        cache_server_packet(remote, c, dpm_row, buf + c->readto, pos - c->readto);
+
+    c->packet_seq      += count;
+    remote->packet_seq += count;
+    dpm_self->stats.packets[dpm_row] += count;
+    c->readto = pos;
+
+    return count;
+}
+
+/* Streams the rest of a big packet, as it arrives. Each frame is stamped
+ * with the remote's next sequence id; the first frame shorter than
+ * MAX_PACKET_LENGTH is the last one. If the first frame wasn't forwarded,
+ * neither is the rest.
+ * Returns the number of bytes handled, 0 if more need to be read, or -1 if
+ * the connection should be closed. */
+static int forward_frames(conn *c)
+{
+    conn *remote = (conn *)c->remote;
+    int have     = c->read - c->readto;
+    int seq;
+
+    if (c->frame_left == 0) {
+        /* Next frame header. */
+        if (have < 4)
+            return 0;
+        c->frame_left = uint3korr(&c->rbuf[c->readto]) + 4;
+        seq           = uint1korr(&c->rbuf[c->readto + 3]);
+        if (c->frame_left != MAX_PACKET_LENGTH + 4)
+            c->big_packet = 0;
+
+        if ((unsigned char)c->packet_seq != seq) {
+            fprintf(stderr, "***WARNING*** Packets appear to be out of order: type [%d] conn [%d], header [%d]\n", c->my_type, c->packet_seq, seq);
+        }
+        c->packet_seq++;
+
+        if (!c->big_discard && remote && remote->alive) {
+            int1store(&c->rbuf[c->readto + 3], remote->packet_seq);
+            remote->packet_seq++;
+        }
+    }
+
+    if (have > c->frame_left)
+        have = c->frame_left;
+    if (have == 0)
+        return 0;
+
+    if (!c->big_discard && remote && remote->alive) {
+        if (conn_write_ref(remote, c->rbuf + c->readto, have) == -1)
+            return -1;
+        _dpm_add_to_flush_list(remote);
+    }
+
+    c->readto     += have;
+    c->frame_left -= have;
+    if (c->frame_left == 0 && !c->big_packet)
+        c->big_discard = 0;
+
+    return have;
+}
+
 static int run_protocol(conn *c, int read, int written)
 {
     int err = 0;
@@ -2216,6 +3523,14 @@ static int run_protocol(conn *c, int read, int written)
     socklen_t errsize = sizeof(err);
     conn *remote = NULL;
 
+    /* handle_close() unlinks both ends, but a recycled remote is cheap to
+     * catch: its id won't match any more. */
+    if (c->remote && ((conn *)c->remote)->id != c->remote_id) {
+        fprintf(stderr, "***WARNING*** Dropping stale remote %llu from conn %llu\n", (unsigned long long) c->remote_id, (unsigned long long) c->id);
+        c->remote    = NULL;
+        c->remote_id = 0;
+    }
+
     switch (c->mystate) {
     case my_connect:
         /* Socket was connecting. Lets see if it's good now. */
@@ -2232,25 +3547,78 @@ static int run_protocol(conn *c, int read, int written)
         /* Neat. we're all good. */
         if (verbose)
             fprintf(stdout, "Successfully connected outbound socket %d\n", c->fd);
-        update_conn_event(c, EV_READ | EV_PERSIST);
         c->mystate  = my_reading;
         c->dpmstate = MYS_CONNECT;
+        if (dpm_io_uring && conn_start_reading(c) == -1)
+            return -1;
     case my_reading:
         /* If we've read the full packet size, we can write it to the
          * other guy
          * FIXME: Making assumptions about remote, duh :P
          */
 
-        while ( (next_packet = my_next_packet_start(c)) != -1 ) {
+        /* A callback may close us, which releases the read buffer. */
+        while (c->alive) {
             int ptype = dpm_none;
             void *p = NULL;
             int ret = 0;
             int cbret = 0;
+            int forwarded = 0;
+            int have;
+
+            /* The tail of a packet too big for one frame. */
+            if (c->big_packet || c->frame_left) {
+                if ((ret = forward_frames(c)) == -1)
+                    return -1;
+                if (ret == 0)
+                    break;
+                continue;
+            }
+
+            /* Rows nobody's watching go out in bulk. */
+            if ((ret = forward_row_run(c)) == -1)
+                return -1;
+            if (ret > 0)
+                continue;
+
+            if ((next_packet = my_next_packet_start(c)) == -1) {
+                /* Big rows don't wait to be read in whole. */
+                if ((ret = conn_cut_through(c)) == -1)
+                    return -1;
+                if (ret > 0)
+                    continue;
+                break;
+            }
 
             #ifdef DBUG
             fprintf(stdout, "Read from %llu packet size %u.\n", (unsigned long long) c->id, c->packetsize);
             #endif
 
+            /* Cached results don't need a backend at all. */
+            if (c->cache && c->dpmstate == MYC_WAITING && !c->cache->checked) {
+                if ((ret = cache_client_command(c)) == -1)
+                    return -1;
+                if (ret == 1) {
+                    c->readto += c->packetsize;
+                    continue;
+                }
+            }
+
+            /* Multiplexed clients need a backend before a command can go
+             * anywhere. Until then, it stays in the buffer. */
+            if (c->session && c->dpmstate == MYC_WAITING) {
+                if ((ret = pool_mux_acquire(c)) == -1)
+                    return -1;
+                if (ret == 0)
+                    break;
+            }
+
+            /* Only the start of a big packet is here; that much is handled
+             * like any other packet. */
+            have = c->packetsize;
+            if (c->big_packet && c->read - c->readto < have)
+                have = c->read - c->readto;
+
             /* Drive the packet state machine. */
             ret = received_packet(c, &p, &ptype, c->rbuf[c->readto + 4]);
 
@@ -2258,55 +3626,107 @@ static int run_protocol(conn *c, int read, int written)
              * check that a pointer was returned. */
             /* if (p == NULL) return -1; */
 
-            if (CALLBACK_AVAILABLE(c)) {
+            if (POOL_MANAGED(c)) {
+                /* Nobody's using it; the pool gets the packet. */
+                ret = pool_conn_packet(c, p, ptype);
+                lua_settop(L, 0);
+                if (ret == -1)
+                    return -1;
+                cbret = DPM_NOPROXY;
+            } else if (c->admin) {
+                ret = admin_packet(c, p, ptype);
+                lua_settop(L, 0);
+                if (ret == -1)
+                    return -1;
+                cbret = DPM_NOPROXY;
+            } else if (CALLBACK_AVAILABLE(c)) {
                 cbret = run_lua_callback(c, ret);
+            } else {
+                /* Nobody wanted what was consumed. */
+                lua_settop(L, 0);
             }
 
             /* Handle writing to a remote if one exists */
             if ( c->remote && ( cbret == DPM_OK || cbret == DPM_FLUSH_DISCONNECT ) ) {
                 remote = (conn *)c->remote;
-                if (grow_write_buffer(remote, remote->towrite + c->packetsize) == -1) {
-                    return -1;
-                }
 
                 /* Drive other half of state machine. */
                 ret = sent_packet(remote, &p, ptype, c->field_count);
                 /* TODO: at this point we could decide not to send a
                  * packet. worth investigating?
                  */
-                memcpy(remote->wbuf + remote->towrite, c->rbuf + next_packet, c->packetsize);
-                /* We track our own sequence, so overwrite what's there. */
-                int1store(&remote->wbuf[remote->towrite + 3], remote->packet_seq - 1);
-                remote->towrite += c->packetsize;
+                /* We track our own sequence, so overwrite what's there. The
+                 * packet is consumed, so that's done in place, and the
+                 * remote sends straight out of our read buffer. */
+                int1store(&c->rbuf[next_packet + 3], remote->packet_seq - 1);
+                if (conn_write_ref(remote, c->rbuf + next_packet, have) == -1) {
+                    return -1;
+                }
                 _dpm_add_to_flush_list(remote);
+                forwarded = 1;
+
+                if (remote->cache)
+                    cache_server_packet(remote, c, ptype, c->rbuf + next_packet, have);
+            } else if (c->big_packet) {
+                c->big_discard = 1;
             }
 
+            if (c->cache)
+                cache_client_sent(c, forwarded);
+
             /* Flush (above) and disconnect the conns */
             if (remote && cbret == DPM_FLUSH_DISCONNECT) {
                 remote->remote = NULL;
                 c->remote      = NULL;
             }
 
+            /* Lent backends go back between statements. */
+            if (c->pool_state == POOL_LENT &&
+                (c->dpmstate == MYS_WAIT_CMD || c->dpmstate == MYS_RECV_ERR)) {
+                pool_mux_done(c, ptype);
+            } else if (c->session) {
+                pool_mux_idle(c);
+            }
+
             /* Copied in the packet; advance to next packet. */
-            c->readto += c->packetsize;
+            c->readto    += have;
+            c->frame_left = c->packetsize - have;
+
+            /* A row is done with once its callback is. Everything else
+             * hangs around until the server is done with the command. */
+            if (ptype == dpm_row) {
+                arena_reset(&c->row_arena);
+            } else if (c->my_type == MY_SERVER &&
+                (c->dpmstate == MYS_WAIT_CMD || c->dpmstate == MYS_RECV_ERR)) {
+                arena_free(&c->row_arena);
+                arena_free(&c->arena);
+            }
         }
         if (c == NULL)
             break;
 
-        /* Reuse the remote pointer and flip through the list of connections
-         * to flush. */
-        while (dpm_conn_flush_list) {
-            handle_write(dpm_conn_flush_list);
-            remote = (conn *)dpm_conn_flush_list->nextconn;
-            dpm_conn_flush_list->nextconn = NULL;
-            dpm_conn_flush_list = (conn *)remote;
-        }
-        dpm_conn_flush_list = NULL;
+        /* A partial packet is buffered or streaming, so the remote will get
+         * more soon. */
+        if (c->remote && (c->read > c->readto || c->frame_left || c->big_packet))
+            ((conn *)c->remote)->wmore = 1;
+
+        /* Whatever doesn't fit in the socket gets copied out of our read
+         * buffer, which is about to be reused. */
+        dpm_flush_conns();
+
+#ifdef DPM_SPLICE
+        if (c->alive && conn_stream_start(c) == -1)
+            return -1;
+#endif
 
-        /* Any pending packet reads? If none, reset boofer. */
+        /* Any pending packet reads? If none, give the boofer back. */
         if (c->readto == c->read) {
             c->read    = 0;
             c->readto  = 0;
+            conn_release_rbuf(c);
+        } else if (c->alive && conn_compact_rbuf(c) == -1) {
+            perror("Shrinking input buffer");
+            return -1;
         }
         break;
     }
@@ -2314,6 +3734,38 @@ static int run_protocol(conn *c, int read, int written)
     return 0;
 }
 
+/* Flip through the list of connections which were written to, and send
+ * what they can take. */
+void dpm_flush_conns(void)
+{
+    conn *c;
+    uint64_t n = 0;
+
+    SAMPLER_PUSH(PHASE_FLUSH);
+    while (dpm_conn_flush_list) {
+        n++;
+        c = dpm_conn_flush_list;
+        dpm_conn_flush_list = (conn *)c->nextconn;
+        c->nextconn      = NULL;
+        c->on_flush_list = 0;
+        if (!c->alive)
+            continue;
+        if (handle_write(c) == -1 || conn_write_materialize(c) == -1) {
+            /* Broken; the read side will notice and close it. */
+            _wseg_reset(c);
+        }
+        conn_throttle_check(c);
+    }
+
+    if (n) {
+        dpm_self->stats.flushes++;
+        dpm_self->stats.flushed_conns += n;
+        if (n > dpm_self->stats.flush_list_max)
+            dpm_self->stats.flush_list_max = n;
+    }
+    SAMPLER_POP();
+}
+
 /* Take present state value and attempt a lua callback.
  * callbacks[conn->id][statename]->() in lua's own terms.
  * if there is a "wait for state" value named, short circuit unless that state
@@ -2322,6 +3774,7 @@ static int run_protocol(conn *c, int read, int written)
 static int run_lua_callback(conn *c, int nargs)
 {
     int ret = 0;
+    int err;
     int cb;
 
     #ifdef DBUG
@@ -2342,6 +3795,8 @@ static int run_lua_callback(conn *c, int nargs)
         return 0;
     }
 
+    dpm_self->stats.callbacks++;
+
     /* The conn id is always the last argument (duh, should it be the first?) */
     lua_pushinteger(L, c->id);
     nargs++;
@@ -2358,7 +3813,15 @@ static int run_lua_callback(conn *c, int nargs)
     lua_insert(L, 1);
 
     /* Finally, call the function? Push some args too */
-    if (lua_pcall(L, nargs, 1, 0) != 0) {
+    SAMPLER_PUSH(PHASE_LUA);
+    if (dpm_profile_on) {
+        err = profile_pcall(L, nargs, cb, c->dpmstate);
+    } else {
+        err = lua_pcall(L, nargs, 1, 0);
+    }
+    SAMPLER_POP();
+    SAMPLER_LUA_DONE();
+    if (err != 0) {
         fprintf(stderr, "ERROR: running callback '%s': %s\n", my_state_name[c->dpmstate], lua_tostring(L, -1));
         lua_pop(L, -1);
     }
@@ -2380,13 +3843,13 @@ static int run_lua_callback(conn *c, int nargs)
  */
 static int close_conn(lua_State *L)
 {
-    conn **c = luaL_checkudata(L, 1, "dpm.conn");
+    conn *c = check_conn(L, 1);
     lua_pop(L, 1);
 
-    if ((*c)->alive == 0) {
+    if (c == NULL || c->alive == 0) {
         lua_pushnil(L);
     } else {
-        handle_close(*c);
+        handle_close(c);
         lua_pushinteger(L, 1);
     }
 
@@ -2428,20 +3891,20 @@ static int crypt_pass(lua_State *L)
 /* LUA command for attaching a client with a backend. */
 static int proxy_connect(lua_State *L)
 {
-    conn **c = (conn **)luaL_checkudata(L, 1, "dpm.conn");
-    conn **r = (conn **)luaL_checkudata(L, 2, "dpm.conn");
+    conn *c = check_conn(L, 1);
+    conn *r = check_conn(L, 2);
 
-    if ((*c)->my_type != MY_CLIENT || (*c)->alive == 0) {
+    if (c == NULL || c->my_type != MY_CLIENT || c->alive == 0) {
         luaL_error(L, "Arg 1 must be a valid client");
     }
-    if ((*r)->my_type != MY_SERVER || (*c)->alive == 0) {
+    if (r == NULL || r->my_type != MY_SERVER || r->alive == 0) {
         luaL_error(L, "Arg 2 must be a valid backend");
     }
 
-    (*c)->remote    = (struct conn *)*r;
-    (*c)->remote_id = (*r)->id;
-    (*r)->remote    = (struct conn *)*c;
-    (*r)->remote_id = (*c)->id;
+    c->remote    = (struct conn *)r;
+    c->remote_id = r->id;
+    r->remote    = (struct conn *)c;
+    r->remote_id = c->id;
 
     return 0;
 }
@@ -2449,19 +3912,21 @@ static int proxy_connect(lua_State *L)
 /* LUA command for detaching a client and backend. */
 static int proxy_disconnect(lua_State *L)
 {
-    conn **c = (conn **)luaL_checkudata(L, 1, "dpm.conn");
+    conn *c = check_conn(L, 1);
     conn *r = NULL;
 
-    if (!(*c)->remote) {
+    if (c == NULL || !c->remote) {
         luaL_error(L, "Must specify a connected client/server to disconnect.");
     }
 
-    r = (conn *) (*c)->remote;
+    r = (conn *) c->remote;
 
-    r->remote       = NULL;
-    r->remote_id    = 0;
-    (*c)->remote    = NULL;
-    (*c)->remote_id = 0;
+    r->remote    = NULL;
+    r->remote_id = 0;
+    c->remote    = NULL;
+    c->remote_id = 0;
+    conn_unthrottle(r);
+    conn_unthrottle(c);
 
     return 0;
 }
@@ -2500,59 +3965,97 @@ static int dpm_time_hires(lua_State *L)
 /* LUA command for wiring a packet into a connection. */
 static int wire_packet(lua_State *L)
 {
-    conn **c = luaL_checkudata(L, 1, "dpm.conn");
+    conn *c = check_conn(L, 1);
     my_packet_fuzz **p;
 
-    if (!(*c)->alive)
+    if (c == NULL || !c->alive)
         luaL_error(L, "Cannot write to invalid connection");
 
-    luaL_checktype(L, 2, LUA_TUSERDATA);
+    p = (my_packet_fuzz **)&check_packet(L, 2)->p;
 
-    p = lua_touserdata(L, 2);
+    if (verbose)
+        fprintf(stdout, "Wrote packet of type [%d] to sock [%llu] with server type [%d]\n", (*p)->h.ptype, (unsigned long long)c->id, c->my_type);
 
-    (*p)->h.to_buf(*c, *p);
+    lua_settop(L, 0);
+    conn_wire_packet(c, *p);
 
-    /* Link up connections which will need buffers flushed. */
-    _dpm_add_to_flush_list(*c);
+    return 0;
+}
 
-    if (verbose)
-        fprintf(stdout, "Wrote packet of type [%d] to sock [%llu] with server type [%d]\n", (*p)->h.ptype, (unsigned long long)(*c)->id, (*c)->my_type);
+/* Write a packet into a conn and drive its state machine. The conn is
+ * flushed when the current event is done. */
+int conn_wire_packet(conn *c, void *pkt)
+{
+    my_packet_fuzz *p = (my_packet_fuzz *)pkt;
+
+    if (p->h.to_buf(c, p) == -1)
+        return -1;
+
+    /* Link up connections which will need buffers flushed. */
+    _dpm_add_to_flush_list(c);
 
     /* FIXME: sent_packet doesn't need the field count at all? */
-    lua_settop(L, 0);
-    sent_packet(*c, (void **) p, (*p)->h.ptype, 0);
+    sent_packet(c, &pkt, p->h.ptype, 0);
+    return 0;
+}
 
+/* Write whole packets out of a buffer, renumbered from the conn's sequence
+ * id. Nothing is parsed, so the state machine is left alone. The conn is
+ * flushed when the current event is done. */
+int conn_wire_bytes(conn *c, unsigned char *data, int len)
+{
+    int base = c->towrite;
+    int pos;
+
+    if (grow_write_buffer(c, c->towrite + len) == -1)
+        return -1;
+
+    memcpy(&c->wbuf[base], data, len);
+    c->towrite += len;
+
+    for (pos = base; pos + 4 <= c->towrite; pos += uint3korr(&c->wbuf[pos]) + 4) {
+        int1store(&c->wbuf[pos + 3], c->packet_seq);
+        c->packet_seq++;
+    }
+
+    _dpm_add_to_flush_list(c);
     return 0;
 }
 
-static void _init_new_connect(int outsock)
+static conn *_init_new_connect(int outsock)
 {
     conn *c;
 
     c = init_conn(outsock);
+    if (c == NULL) {
+        close(outsock);
+        return NULL;
+    }
 
     /* Special state for outbound requests. */
     c->mystate = my_connect;
     c->my_type = MY_SERVER;
     c->alive++;
+    conn_start_reading(c); /* error handling */
 
     /* We watch for a write to this guy to see if it succeeds */
-    add_conn_event(c, EV_WRITE);
+    conn_want_write(c);
 
-    new_obj(L, c, "dpm.conn");
-
-    return;
+    return c;
 }
 
-/* Outbound connection function for unix sockets. */
-static int new_connect_unix(lua_State *L)
+/* Start a nonblocking connect to a unix socket. NULL if it failed outright. */
+conn *conn_connect_unix(const char *dpath)
 {
     int outsock;
     struct sockaddr_un dest_addr;
     int flags = 1;
-    const char *dpath = luaL_checkstring(L, 1);
 
-    outsock = socket(AF_UNIX, SOCK_STREAM, 0); /* check errors */
+    outsock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (outsock == -1) {
+        perror("socket()");
+        return NULL;
+    }
     set_sock_nonblock(outsock); /* check errors */
     setsockopt(outsock, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
 
@@ -2564,26 +4067,25 @@ static int new_connect_unix(lua_State *L)
     if (connect(outsock, (const struct sockaddr *)&dest_addr, sizeof(dest_addr)) == -1) {
         if (errno != EINPROGRESS) {
             close(outsock);
-            lua_pushnil(L);
-            return 1;
+            return NULL;
         }
     }
 
-    _init_new_connect(outsock);
-
-    return 1;
+    return _init_new_connect(outsock);
 }
 
-/* Outbound connection function */
-static int new_connect(lua_State *L)
+/* ... and to an IP address. */
+conn *conn_connect(const char *ip_addr, int port_num)
 {
     int outsock;
     struct sockaddr_in dest_addr;
     int flags = 1;
-    const char *ip_addr = luaL_checkstring(L, 1);
-    int port_num     = (int)luaL_checkinteger(L, 2);
 
-    outsock = socket(AF_INET, SOCK_STREAM, 0); /* check errors */
+    outsock = socket(AF_INET, SOCK_STREAM, 0);
+    if (outsock == -1) {
+        perror("socket()");
+        return NULL;
+    }
 
     dest_addr.sin_family = AF_INET;
     dest_addr.sin_port = htons(port_num);
@@ -2599,12 +4101,39 @@ static int new_connect(lua_State *L)
     if (connect(outsock, (const struct sockaddr *)&dest_addr, sizeof(dest_addr)) == -1) {
         if (errno != EINPROGRESS) {
             close(outsock);
-            lua_pushnil(L);
-            return 1;
+            return NULL;
         }
     }
 
-    _init_new_connect(outsock);
+    return _init_new_connect(outsock);
+}
+
+/* Outbound connection function for unix sockets. */
+static int new_connect_unix(lua_State *L)
+{
+    conn *c = conn_connect_unix(luaL_checkstring(L, 1));
+
+    if (c == NULL) {
+        lua_pushnil(L);
+    } else {
+        new_conn_obj(L, c);
+    }
+
+    return 1;
+}
+
+/* Outbound connection function */
+static int new_connect(lua_State *L)
+{
+    const char *ip_addr = luaL_checkstring(L, 1);
+    int port_num     = (int)luaL_checkinteger(L, 2);
+    conn *c = conn_connect(ip_addr, port_num);
+
+    if (c == NULL) {
+        lua_pushnil(L);
+    } else {
+        new_conn_obj(L, c);
+    }
 
     return 1;
 }
@@ -2613,32 +4142,55 @@ static void _init_new_listener(int l_socket, int type)
 {
     conn *listener = init_conn(l_socket);
 
-    listener->ev_flags = EV_READ | EV_PERSIST;
-
     listener->listener = type;
+    listener->accept_batch = settings.accept_batch;
+    listener->write_high   = settings.write_high;
+    listener->write_low    = settings.write_low;
     listener->alive++;
+    conn_start_reading(listener); /* error handling */
 
-    event_set(&listener->ev, l_socket, listener->ev_flags, handle_event, (void *)listener);
-    event_add(&listener->ev, NULL);
-
-    new_obj(L, listener, "dpm.conn");
+    new_conn_obj(L, listener);
 
     return;
 }
 
-/* First arg is path, second arg is the mask. Path is non optional. */
-static int new_listener_unix(lua_State *L)
+/* With multiple workers, the first thread to open a listener which can't be
+ * sharded by the kernel registers it here. Other threads get a dup() of the
+ * same socket and take turns accepting from it.
+ * Caller must hold shared_listener_lock. Returns -1 if not found.
+ */
+static int _shared_listener_dup(const char *key)
+{
+    int i;
+
+    for (i = 0; i < shared_listener_count; i++) {
+        if (strcmp(shared_listeners[i].key, key) == 0)
+            return dup(shared_listeners[i].fd);
+    }
+
+    return -1;
+}
+
+static void _shared_listener_add(const char *key, int l_socket)
+{
+    if (shared_listener_count == MAX_SHARED_LISTENERS) {
+        fprintf(stderr, "Too many shared listeners, not sharing %s\n", key);
+        return;
+    }
+
+    strncpy(shared_listeners[shared_listener_count].key, key, 127);
+    shared_listeners[shared_listener_count].fd = l_socket;
+    shared_listener_count++;
+}
+
+/* Creates, binds and listens on a unix socket. Returns the socket. */
+static int _new_listener_unix(const char *spath, int mask)
 {
     struct sockaddr_un addr;
     int flags = 1;
     int l_socket = 0;
-    int mask = 0700;
     struct stat mstat;
     int prev_mask;
-    const char *spath = luaL_checkstring(L, 1);
-
-    if (!lua_isnoneornil(L, 2))
-        mask = strtol(luaL_checkstring(L, 2), NULL, 8);
 
     if ( (l_socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
         perror("unix socket");
@@ -2670,6 +4222,38 @@ static int new_listener_unix(lua_State *L)
         return -1;
     }
 
+    return l_socket;
+}
+
+/* First arg is path, second arg is the mask. Path is non optional. */
+static int new_listener_unix(lua_State *L)
+{
+    int l_socket = 0;
+    int mask = 0700;
+    const char *spath = luaL_checkstring(L, 1);
+
+    if (!lua_isnoneornil(L, 2))
+        mask = strtol(luaL_checkstring(L, 2), NULL, 8);
+
+    /* Unix sockets can't be bound once per thread; share the first one. */
+    if (dpm_thread_count > 1) {
+        pthread_mutex_lock(&shared_listener_lock);
+        if ( (l_socket = _shared_listener_dup(spath)) != -1) {
+            pthread_mutex_unlock(&shared_listener_lock);
+            _init_new_listener(l_socket, DPM_UNIX);
+            return 1;
+        }
+        l_socket = _new_listener_unix(spath, mask);
+        if (l_socket != -1)
+            _shared_listener_add(spath, l_socket);
+        pthread_mutex_unlock(&shared_listener_lock);
+    } else {
+        l_socket = _new_listener_unix(spath, mask);
+    }
+
+    if (l_socket == -1)
+        return -1;
+
     _init_new_listener(l_socket, DPM_UNIX);
 
     return 1;
@@ -2699,6 +4283,12 @@ static int new_listener(lua_State *L)
 
     setsockopt(l_socket, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
     setsockopt(l_socket, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+    /* Every worker binds its own copy of the listener, and the kernel
+     * balances new connections between them. */
+    if (dpm_thread_count > 1)
+        setsockopt(l_socket, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+#endif
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port_num);
@@ -2726,18 +4316,238 @@ static int new_listener(lua_State *L)
     return 1;
 }
 
-#ifndef DPMLIBDIR
-    #define DPMLIBDIR "."
-#endif
+/* Tunables exposed to lua. All of them are plain ints in dpm_settings. */
+static const struct {
+    const char *name;
+    size_t      offset;
+} settings_regs [] = {
+    {"accept_batch", offsetof(dpm_settings, accept_batch)},
+    {"max_conns", offsetof(dpm_settings, max_conns)},
+    {"splice_min", offsetof(dpm_settings, splice_min)},
+    {"stream_min", offsetof(dpm_settings, stream_min)},
+    {"write_high", offsetof(dpm_settings, write_high)},
+    {"write_low", offsetof(dpm_settings, write_low)},
+    {"buffer_pool_max", offsetof(dpm_settings, buffer_pool_max)},
+    {"latency_digests", offsetof(dpm_settings, latency_digests)},
+    {NULL, 0},
+};
 
-int main (int argc, char **argv)
+/* LUA command for changing tunables. Takes an optional table of
+ * name = value pairs to set, and returns a table of all current values.
+ * ie: dpm.settings({ accept_batch = 32, max_conns = 5000 })
+ */
+static int dpm_settings_lua(lua_State *L)
+{
+    dpm_settings s = settings;
+    int i;
+
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_pushnil(L);
+        while (lua_next(L, 1) != 0) {
+            const char *name = luaL_checkstring(L, -2);
+            for (i = 0; settings_regs[i].name; i++) {
+                if (strcmp(settings_regs[i].name, name) == 0)
+                    break;
+            }
+            if (settings_regs[i].name == NULL)
+                return luaL_error(L, "Unknown setting: %s", name);
+            *(int *)((char *)&s + settings_regs[i].offset) = luaL_checkint(L, -1);
+            lua_pop(L, 1);
+        }
+
+        /* Nothing changes unless all of it makes sense. */
+        for (i = 0; settings_regs[i].name; i++) {
+            if (*(int *)((char *)&s + settings_regs[i].offset) < 0)
+                return luaL_error(L, "%s can't be negative", settings_regs[i].name);
+        }
+        if (s.accept_batch < 1)
+            return luaL_error(L, "accept_batch must be at least 1");
+        if (s.write_high && s.write_low > s.write_high)
+            return luaL_error(L, "write_low can't be above write_high");
+
+        settings = s;
+        dpm_self->pool.max_free = settings.buffer_pool_max;
+    }
+
+    lua_createtable(L, 0, sizeof(settings_regs) / sizeof(settings_regs[0]));
+    for (i = 0; settings_regs[i].name; i++) {
+        lua_pushinteger(L, *(int *)((char *)&settings + settings_regs[i].offset));
+        lua_setfield(L, -2, settings_regs[i].name);
+    }
+
+    return 1;
+}
+
+/* Names of enum dpm_packet_types, for counters. */
+static const char *dpm_packet_name[TOTAL_PACKET_TYPES] = {
+    "none", "handshake", "auth", "ok", "cmd", "err", "rset", "field", "row",
+    "eof", "stats",
+};
+
+static void _stats_sum(dpm_thread_stats *total, bufpool *pool)
+{
+    dpm_thread *t;
+    int i, j, cls;
+
+    memset(total, 0, sizeof(*total));
+    memset(pool, 0, sizeof(*pool));
+    for (i = 0; i < dpm_thread_count; i++) {
+        t = &dpm_threads[i];
+        total->throttled_conns += t->stats.throttled_conns;
+        total->throttles       += t->stats.throttles;
+        total->conn_structs    += t->stats.conn_structs;
+        total->conn_structs_free += t->stats.conn_structs_free;
+        total->packets_pinned    += t->stats.packets_pinned;
+        total->rbuf_compactions  += t->stats.rbuf_compactions;
+        total->rbuf_shrinks      += t->stats.rbuf_shrinks;
+        total->rbuf_grows        += t->stats.rbuf_grows;
+        total->wbuf_grows        += t->stats.wbuf_grows;
+        total->conns_accepted    += t->stats.conns_accepted;
+        total->conns_closed      += t->stats.conns_closed;
+        total->clients           += t->stats.clients;
+        total->bytes_read        += t->stats.bytes_read;
+        total->bytes_written     += t->stats.bytes_written;
+        total->callbacks         += t->stats.callbacks;
+        total->flushes           += t->stats.flushes;
+        total->flushed_conns     += t->stats.flushed_conns;
+        if (t->stats.flush_list_max > total->flush_list_max)
+            total->flush_list_max = t->stats.flush_list_max;
+        total->uring_submits     += t->stats.uring_submits;
+        total->uring_completions += t->stats.uring_completions;
+        for (j = 0; j < TOTAL_PACKET_TYPES; j++)
+            total->packets[j] += t->stats.packets[j];
+        for (j = 0; j < TOTAL_STATES; j++)
+            total->states[j] += t->stats.states[j];
+
+        for (cls = 0; cls < BUFPOOL_CLASSES; cls++) {
+            pool->free_count[cls] += t->pool.free_count[cls];
+            pool->used_count[cls] += t->pool.used_count[cls];
+        }
+        pool->free_bytes += t->pool.free_bytes;
+        pool->used_bytes += t->pool.used_bytes;
+        pool->gets       += t->pool.gets;
+        pool->misses     += t->pool.misses;
+        pool->trims      += t->pool.trims;
+    }
+}
+
+/* Adds up the counters of every worker and hands them to fn one at a time,
+ * by the names dpm.stats() and SHOW DPM STATUS use. Other workers' counters
+ * are read without locking, so they can be a moment behind. */
+void dpm_stats_each(dpm_stat_func fn, void *arg)
+{
+    dpm_thread_stats total;
+    bufpool pool;
+    char name[64];
+    const char *s;
+    int i, j;
+
+    _stats_sum(&total, &pool);
+
+    fn(arg, "conns_accepted", total.conns_accepted);
+    fn(arg, "conns_closed", total.conns_closed);
+    fn(arg, "clients", total.clients);
+    fn(arg, "bytes_read", total.bytes_read);
+    fn(arg, "bytes_written", total.bytes_written);
+    fn(arg, "callbacks", total.callbacks);
+    fn(arg, "throttled_conns", total.throttled_conns);
+    fn(arg, "throttles", total.throttles);
+    fn(arg, "conn_structs", total.conn_structs);
+    fn(arg, "conn_structs_free", total.conn_structs_free);
+    fn(arg, "packets_pinned", total.packets_pinned);
+    fn(arg, "rbuf_grows", total.rbuf_grows);
+    fn(arg, "rbuf_compactions", total.rbuf_compactions);
+    fn(arg, "rbuf_shrinks", total.rbuf_shrinks);
+    fn(arg, "wbuf_grows", total.wbuf_grows);
+    fn(arg, "buffer_bytes_used", pool.used_bytes);
+    fn(arg, "buffer_bytes_free", pool.free_bytes);
+    fn(arg, "buffer_gets", pool.gets);
+    fn(arg, "buffer_misses", pool.misses);
+    fn(arg, "buffer_trims", pool.trims);
+    fn(arg, "flushes", total.flushes);
+    fn(arg, "flushed_conns", total.flushed_conns);
+    fn(arg, "flush_list_max", total.flush_list_max);
+    fn(arg, "uring_submits", total.uring_submits);
+    fn(arg, "uring_completions", total.uring_completions);
+
+    for (i = 0; i < TOTAL_PACKET_TYPES; i++) {
+        snprintf(name, sizeof(name), "packets_%s", dpm_packet_name[i]);
+        fn(arg, name, total.packets[i]);
+    }
+
+    /* "Server sending rows" is state_server_sending_rows */
+    for (i = 0; i < (int)(sizeof(my_state_name) / sizeof(my_state_name[0])); i++) {
+        strcpy(name, "state_");
+        for (s = my_state_name[i], j = 6; *s && j < (int)sizeof(name) - 1; s++, j++)
+            name[j] = *s == ' ' ? '_' : tolower((unsigned char)*s);
+        name[j] = '\0';
+        fn(arg, name, total.states[i]);
+    }
+}
+
+/* LUA command for reading counters, summed across all workers.
+ * ie: dpm.stats().throttled_conns
+ */
+static void _stats_field(lua_State *L, const char *name, uint64_t val)
+{
+    lua_pushnumber(L, (lua_Number) val);
+    lua_setfield(L, -2, name);
+}
+
+static void _stats_lua_field(void *arg, const char *name, uint64_t val)
+{
+    _stats_field((lua_State *)arg, name, val);
+}
+
+static int dpm_stats_lua(lua_State *L)
+{
+    dpm_thread_stats total;
+    bufpool pool;
+    int cls;
+
+    lua_createtable(L, 0, 64);
+    dpm_stats_each(_stats_lua_field, L);
+
+    _stats_sum(&total, &pool);
+
+    /* Per size class: { [2048] = { used = n, free = n }, ... } */
+    lua_createtable(L, 0, BUFPOOL_CLASSES);
+    for (cls = 0; cls < BUFPOOL_CLASSES; cls++) {
+        lua_pushinteger(L, 1 << (cls + BUFPOOL_MIN_SHIFT));
+        lua_createtable(L, 0, 2);
+        _stats_field(L, "used", pool.used_count[cls]);
+        _stats_field(L, "free", pool.free_count[cls]);
+        lua_settable(L, -3);
+    }
+    lua_setfield(L, -2, "buffer_classes");
+
+    return 1;
+}
+
+/* Thread info for lua scripts. Returns the worker number and worker count.
+ * Useful to only run one-off tasks (status printing, etc) from worker 0. */
+static int dpm_thread_info(lua_State *L)
+{
+    lua_pushinteger(L, dpm_self->num);
+    lua_pushinteger(L, dpm_thread_count);
+    return 2;
+}
+
+/* Set up the event base and lua state for the calling thread, then run the
+ * startfile. Every worker gets its own completely independent copy of the
+ * script, its listeners, backends and timers.
+ */
+static int init_thread(dpm_thread *t)
 {
-    struct sigaction sa;
     static const struct luaL_Reg dpm [] = {
         {"listener", new_listener},
         {"listener_unix", new_listener_unix},
         {"connect", new_connect},
         {"connect_unix", new_connect_unix},
+        {"pool", new_pool},
+        {"router", new_router},
+        {"cache", new_cache},
         {"close", close_conn},
         {"wire_packet", wire_packet},
         {"check_pass", check_pass},
@@ -2747,18 +4557,134 @@ int main (int argc, char **argv)
         {"gettimeofday", dpm_gettimeofday},
         {"time", dpm_time},
         {"time_hires", dpm_time_hires},
+        {"thread", dpm_thread_info},
+        {"settings", dpm_settings_lua},
+        {"stats", dpm_stats_lua},
+        {"admin", admin_listener},
+        {"metrics", metrics_listener},
+        {"profile", profile_lua},
+        {"profile_dump", profile_dump},
+        {"sampler", sampler_lua},
+        {"sampler_dump", sampler_dump},
+        {"latency", latency_snapshot},
+        {"latency_top", latency_top},
         {NULL, NULL},
     };
+
+    /* The main thread keeps libevent's "current" base for compatibility. */
+    if (t->num == 0) {
+        t->base = event_init();
+    } else {
+        t->base = event_base_new();
+    }
+
+    if (t->base == NULL) {
+        fprintf(stderr, "Could not create event base for thread %d\n", t->num);
+        return -1;
+    }
+
+    dpm_base = t->base;
+    dpm_self = t;
+    bufpool_init(&t->pool, settings.buffer_pool_max);
+    if (latency_init(t) == -1)
+        return -1;
+    if (t->num == 0) {
+        profile_init_signal();
+        sampler_init();
+    }
+
+    if ( (dpm_reserve_fd = open("/dev/null", O_RDONLY)) == -1) {
+        perror("Opening reserve fd");
+        return -1;
+    }
+    if (dpm_io_uring && uring_init() == -1)
+        return -1;
+
+    L = lua_open();
+
+    if (L == NULL) {
+        fprintf(stderr, "Could not create lua state\n");
+        return -1;
+    }
+    t->L = L;
+    luaL_openlibs(L);
+
+    luaL_register(L, "dpm", dpm);
+    register_obj_types(L); /* Internal call to fill all custom metatables */
+
+    if (luaL_dofile(L, dpm_startfile)) {
+        fprintf(stdout, "Could not run lua initializer: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+    dpm_thread *t = arg;
+
+    if (init_thread(t) == -1)
+        exit(-1);
+
+    event_base_dispatch(t->base);
+
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    struct sigaction sa;
     /* Argument parsing helper. */
-    int c;
-    char *startfile = DPMLIBDIR "/lua/startup.lua";
+    int c, i;
     static struct option l_options[] = {
         {"startfile", 1, 0, 's'},
+        {"threads", 1, 0, 't'},
         {"verbose", 2, 0, 'v'},
+        {"io", 1, 0, 'i'},
         {"help", 3, 0, 'h'},
         {0, 0, 0, 0},
     };
 
+    /* Time to do argument parsing! */
+    while ( (c = getopt_long(argc, argv, "s:t:v:i:h", l_options, NULL) ) != -1) {
+        switch (c) {
+        case 's':
+            dpm_startfile = optarg;
+            break;
+        case 't':
+            dpm_thread_count = atoi(optarg);
+            if (dpm_thread_count < 1) {
+                fprintf(stderr, "Number of threads must be at least 1\n");
+                return -1;
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "uring") == 0) {
+                dpm_io_uring = 1;
+            } else if (strcmp(optarg, "libevent") != 0) {
+                fprintf(stderr, "--io must be 'libevent' or 'uring'\n");
+                return -1;
+            }
+            break;
+        case 'v':
+            if (optarg) {
+                verbose = atoi(optarg);
+            } else {
+                verbose++;
+            }
+            break;
+        default:
+            printf("Dormando's Proxy for MySQL release " VERSION "\n");
+            printf("Usage: --startfile startupfile.lua (default 'startup.lua')\n"
+                   "       --threads [num] (worker threads, default 1)\n"
+                   "       --io [libevent|uring] (I/O engine, default libevent)\n"
+                   "       --verbose [num] (increase verbosity)\n");
+            return -1;
+        }
+    }
+
     /* Init /dev/urandom socket... */
     if( (urandom_sock = open("/dev/urandom", O_RDONLY)) == -1 ) {
         perror("Opening /dev/urandom");
@@ -2774,9 +4700,6 @@ int main (int argc, char **argv)
         return -1;
     }
 
-    /* Initialize the event system. */
-    event_init();
-
     /* Lets ignore SIGPIPE... sorry, just about yanking this from memcached.
      * I tried to use the manpages but it came out exactly the same :P
      */
@@ -2794,48 +4717,37 @@ int main (int argc, char **argv)
         return -1;
     }
 
-    L = lua_open();
+    /* Fall back to libevent if this kernel (or build) can't do it. */
+    if (dpm_io_uring && uring_probe() == -1) {
+        fprintf(stderr, "io_uring unavailable, using libevent\n");
+        dpm_io_uring = 0;
+    }
 
-    if (L == NULL) {
-        fprintf(stderr, "Could not create lua state\n");
+    dpm_threads = calloc(dpm_thread_count, sizeof(dpm_thread));
+    if (dpm_threads == NULL) {
+        perror("Could not malloc()");
         return -1;
     }
-    luaL_openlibs(L);
 
-    luaL_register(L, "dpm", dpm);
-    register_obj_types(L); /* Internal call to fill all custom metatables */
+    /* The main thread is worker 0. Bring it up first so startfile errors are
+     * reported once, before any other threads exist. */
+    dpm_threads[0].thread_id = pthread_self();
+    if (init_thread(&dpm_threads[0]) == -1)
+        return -1;
 
-    /* Time to do argument parsing! */
-    while ( (c = getopt_long(argc, argv, "s:v:h", l_options, NULL) ) != -1) {
-        switch (c) {
-        case 's':
-            startfile = optarg;
-            break;
-        case 'v':
-            if (optarg) {
-                verbose = atoi(optarg);
-            } else {
-                verbose++;
-            }
-            break;
-        default:
-            printf("Dormando's Proxy for MySQL release " VERSION "\n");
-            printf("Usage: --startfile startupfile.lua (default 'startup.lua')\n"
-                   "       --verbose [num] (increase verbosity)\n");
+    for (i = 1; i < dpm_thread_count; i++) {
+        dpm_threads[i].num = i;
+        if (pthread_create(&dpm_threads[i].thread_id, NULL, worker_thread,
+            &dpm_threads[i]) != 0) {
+            perror("Could not start worker thread");
             return -1;
         }
     }
 
-    if (luaL_dofile(L, startfile)) {
-        fprintf(stdout, "Could not run lua initializer: %s\n", lua_tostring(L, -1));
-        lua_pop(L, 1);
-        return -1;
-    }
-
     if (verbose)
         fprintf(stdout, "Starting event dispatcher...\n");
 
-    event_dispatch();
+    event_base_dispatch(dpm_base);
 
     return 0;
 }
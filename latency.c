@@ -0,0 +1,387 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Latency histograms per query digest. When a client sends a COM_QUERY the
+ * query is digested (see digest.c) and the time noted; when the backend
+ * answering it finishes with an OK, EOF or ERR the time taken is added to
+ * the histogram for that digest.
+ *
+ * Each worker keeps its own table, up to settings.latency_digests entries;
+ * queries seen after that are lumped together. Readers merge the tables of
+ * every worker. Histograms are log-linear: each power of two is split into
+ * 16 buckets, so percentiles are accurate to about 6%.
+ */
+
+#include "proxy.h"
+#include "digest.h"
+#include "latency.h"
+
+#define LAT_MERGE_HASH 1024
+
+uint64_t latency_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _lat_bucket(uint64_t v)
+{
+    int bits, shift;
+
+    if (v >= (1ULL << LAT_MAX_BITS))
+        return LAT_BUCKETS - 1;
+    if (v < LAT_SUB)
+        return (int)v;
+
+    bits  = 64 - __builtin_clzll(v);
+    shift = bits - LAT_SUB_BITS - 1;
+    return (shift + 1) * LAT_SUB + (int)((v >> shift) & (LAT_SUB - 1));
+}
+
+/* Highest value which lands in bucket i. */
+static uint64_t _lat_bucket_value(int i)
+{
+    int shift;
+
+    if (i < LAT_SUB)
+        return i;
+    shift = i / LAT_SUB - 1;
+    return ((uint64_t)(LAT_SUB + i % LAT_SUB + 1) << shift) - 1;
+}
+
+static latency_entry *_lat_new_entry(uint64_t digest, const char *text, int len)
+{
+    latency_entry *e = (latency_entry *)calloc(1, sizeof(latency_entry));
+
+    if (e == NULL) {
+        perror("Could not calloc()");
+        return NULL;
+    }
+    if (len > LAT_TEXT - 1)
+        len = LAT_TEXT - 1;
+    e->digest = digest;
+    memcpy(e->text, text, len);
+    e->text[len] = '\0';
+    return e;
+}
+
+int latency_init(dpm_thread *t)
+{
+    latency_table *lt = (latency_table *)calloc(1, sizeof(latency_table));
+
+    if (lt == NULL) {
+        perror("Could not calloc()");
+        return -1;
+    }
+    pthread_mutex_init(&lt->lock, NULL);
+    t->latency = (struct latency_table *)lt;
+    return 0;
+}
+
+/* Finds or makes the entry for a digest. Called with the lock held. */
+static latency_entry *_lat_find(latency_table *lt, uint64_t digest,
+        const char *text, int len)
+{
+    latency_entry **head = &lt->hash[digest & (LAT_HASH - 1)];
+    latency_entry *e;
+
+    for (e = *head; e != NULL; e = e->next) {
+        if (e->digest == digest)
+            return e;
+    }
+
+    if (lt->entries < settings.latency_digests) {
+        if ( (e = _lat_new_entry(digest, text, len)) == NULL)
+            return NULL;
+        e->next = *head;
+        *head = e;
+        lt->entries++;
+        return e;
+    }
+
+    if (lt->other == NULL)
+        lt->other = _lat_new_entry(0, "(other)", 7);
+    return lt->other;
+}
+
+/* A client sent a command. Only queries are timed; the rest have no digest
+ * and are quick. */
+void latency_start(conn *c, my_cmd_packet *p)
+{
+    latency_table *lt = (latency_table *)dpm_self->latency;
+    char buf[4096];
+    char *out = buf;
+    uint64_t digest;
+    int len, outlen;
+
+    c->lat_entry = NULL;
+    if (settings.latency_digests <= 0 || lt == NULL || p == NULL ||
+        p->command != COM_QUERY || p->argument == NULL)
+        return;
+
+    len = strlen(p->argument);
+    if (DIGEST_OUT_SIZE(len) > (int)sizeof(buf)) {
+        out = (char *)malloc(DIGEST_OUT_SIZE(len));
+        if (out == NULL) {
+            perror("Could not malloc()");
+            return;
+        }
+    }
+    digest = digest_query(p->argument, len, out, &outlen);
+
+    pthread_mutex_lock(&lt->lock);
+    c->lat_entry = (struct latency_entry *)_lat_find(lt, digest, out, outlen);
+    c->lat_gen   = lt->gen;
+    pthread_mutex_unlock(&lt->lock);
+
+    if (out != buf)
+        free(out);
+    c->lat_start = latency_now();
+}
+
+/* The backend finished answering client c. */
+void latency_done(conn *c)
+{
+    latency_table *lt = (latency_table *)dpm_self->latency;
+    latency_entry *e = (latency_entry *)c->lat_entry;
+    uint64_t v;
+
+    if (e == NULL)
+        return;
+    v = latency_now() - c->lat_start;
+    c->lat_entry = NULL;
+
+    pthread_mutex_lock(&lt->lock);
+    /* The table was reset since; e is gone. */
+    if (c->lat_gen == lt->gen) {
+        e->count++;
+        e->total += v;
+        if (v > e->max)
+            e->max = v;
+        e->buckets[_lat_bucket(v)]++;
+    }
+    pthread_mutex_unlock(&lt->lock);
+}
+
+static void _lat_reset(latency_table *lt)
+{
+    latency_entry *e, *next;
+    int i;
+
+    for (i = 0; i < LAT_HASH; i++) {
+        for (e = lt->hash[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+        lt->hash[i] = NULL;
+    }
+    free(lt->other);
+    lt->other   = NULL;
+    lt->entries = 0;
+    lt->gen++;
+}
+
+static void _lat_add(latency_entry *dst, latency_entry *src)
+{
+    int i;
+
+    dst->count += src->count;
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (i = 0; i < LAT_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+/* Adds src to the merged copy of its digest, making one if need be. */
+static int _lat_merge_one(latency_entry **merged, int *count, latency_entry *src)
+{
+    latency_entry **head = &merged[src->digest & (LAT_MERGE_HASH - 1)];
+    latency_entry *e;
+
+    for (e = *head; e != NULL; e = e->next) {
+        if (e->digest == src->digest)
+            break;
+    }
+    if (e == NULL) {
+        e = _lat_new_entry(src->digest, src->text, strlen(src->text));
+        if (e == NULL)
+            return -1;
+        e->next = *head;
+        *head = e;
+        (*count)++;
+    }
+    _lat_add(e, src);
+    return 0;
+}
+
+/* Copies every worker's table into one, optionally resetting them as it
+ * goes. Returns the merged entries as a malloc'd array of *count. */
+static latency_entry **_lat_merge(int reset, int *count)
+{
+    latency_entry *merged[LAT_MERGE_HASH];
+    latency_entry **list, *e;
+    latency_table *lt;
+    int i, j, n = 0;
+
+    memset(merged, 0, sizeof(merged));
+    *count = 0;
+    for (i = 0; i < dpm_thread_count; i++) {
+        lt = (latency_table *)dpm_threads[i].latency;
+        if (lt == NULL)
+            continue;
+        pthread_mutex_lock(&lt->lock);
+        for (j = 0; j < LAT_HASH; j++) {
+            for (e = lt->hash[j]; e != NULL; e = e->next) {
+                if (e->count)
+                    _lat_merge_one(merged, count, e);
+            }
+        }
+        if (lt->other && lt->other->count)
+            _lat_merge_one(merged, count, lt->other);
+        if (reset)
+            _lat_reset(lt);
+        pthread_mutex_unlock(&lt->lock);
+    }
+
+    list = (latency_entry **)malloc(sizeof(latency_entry *) * (*count + 1));
+    for (i = 0; i < LAT_MERGE_HASH; i++) {
+        for (e = merged[i]; e != NULL; e = e->next) {
+            if (list)
+                list[n++] = e;
+        }
+    }
+    if (list == NULL) {
+        perror("Could not malloc()");
+        for (i = 0; i < LAT_MERGE_HASH; i++) {
+            while ( (e = merged[i]) != NULL ) {
+                merged[i] = e->next;
+                free(e);
+            }
+        }
+        *count = 0;
+    }
+    return list;
+}
+
+static void _lat_free_list(latency_entry **list, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        free(list[i]);
+    free(list);
+}
+
+/* Value at quantile q, in ns. */
+static uint64_t _lat_quantile(latency_entry *e, double q)
+{
+    uint64_t want = (uint64_t)(q * e->count + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += e->buckets[i];
+        if (seen >= want)
+            break;
+    }
+    if (i == LAT_BUCKETS)
+        return e->max;
+    /* The top bucket's value is rounded up; max is exact. */
+    return _lat_bucket_value(i) > e->max ? e->max : _lat_bucket_value(i);
+}
+
+static void _lat_field(lua_State *L, const char *name, uint64_t ns)
+{
+    lua_pushnumber(L, (lua_Number)ns / 1000.0);
+    lua_setfield(L, -2, name);
+}
+
+/* Leaves a table describing e on the stack. Times are in microseconds. */
+static void _lat_push(lua_State *L, latency_entry *e)
+{
+    char hex[17];
+
+    lua_createtable(L, 0, 9);
+    if (e->digest) {
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) e->digest);
+        lua_pushstring(L, hex);
+    } else {
+        lua_pushstring(L, "other");
+    }
+    lua_setfield(L, -2, "digest");
+    lua_pushstring(L, e->text);
+    lua_setfield(L, -2, "text");
+    lua_pushnumber(L, (lua_Number)e->count);
+    lua_setfield(L, -2, "count");
+    _lat_field(L, "total", e->total);
+    _lat_field(L, "mean", e->count ? e->total / e->count : 0);
+    _lat_field(L, "max", e->max);
+    _lat_field(L, "p50", _lat_quantile(e, 0.50));
+    _lat_field(L, "p99", _lat_quantile(e, 0.99));
+    _lat_field(L, "p999", _lat_quantile(e, 0.999));
+}
+
+/* LUA command: dpm.latency([reset]). Returns every digest's numbers, keyed
+ * by digest. */
+int latency_snapshot(lua_State *L)
+{
+    latency_entry **list;
+    int i, count;
+
+    list = _lat_merge(lua_toboolean(L, 1), &count);
+
+    lua_createtable(L, 0, count);
+    for (i = 0; i < count; i++) {
+        _lat_push(L, list[i]);
+        lua_getfield(L, -1, "digest");
+        lua_insert(L, -2);
+        lua_settable(L, -3);
+    }
+
+    if (list)
+        _lat_free_list(list, count);
+    return 1;
+}
+
+static int _lat_cmp_total(const void *a, const void *b)
+{
+    const latency_entry *x = *(const latency_entry **)a;
+    const latency_entry *y = *(const latency_entry **)b;
+
+    if (x->total == y->total)
+        return 0;
+    return x->total > y->total ? -1 : 1;
+}
+
+/* LUA command: dpm.latency_top([n], [reset]). The n digests queries spent
+ * the most time in, as an array, most first. */
+int latency_top(lua_State *L)
+{
+    latency_entry **list;
+    int n = luaL_optint(L, 1, 10);
+    int i, count;
+
+    list = _lat_merge(lua_toboolean(L, 2), &count);
+    if (count > 1)
+        qsort(list, count, sizeof(latency_entry *), _lat_cmp_total);
+    if (n > count)
+        n = count;
+
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        _lat_push(L, list[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    if (list)
+        _lat_free_list(list, count);
+    return 1;
+}
@@ -0,0 +1,52 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Per query digest latency histograms. See latency.c */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/* Buckets are log-linear, HDR style: 16 per power of two, so any recorded
+ * value is within 1/16th of the one reported. Values past 2^LAT_MAX_BITS ns
+ * (about 18 minutes) land in the last bucket. */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 40
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+
+#define LAT_TEXT 256 /* Normalized query text kept per digest. */
+#define LAT_HASH 256 /* Hash chains per worker. */
+
+typedef struct latency_entry {
+    uint64_t digest; /* 0 is the catch-all for digests past the limit. */
+    char     text[LAT_TEXT];
+    uint64_t count;
+    uint64_t total; /* ns */
+    uint64_t max; /* ns */
+    uint32_t buckets[LAT_BUCKETS];
+    struct latency_entry *next;
+} latency_entry;
+
+/* One per worker. Only the owner records, but any worker may read or reset,
+ * so everything is under the lock. */
+typedef struct latency_table {
+    pthread_mutex_t lock;
+    latency_entry *hash[LAT_HASH];
+    latency_entry *other; /* Queries seen once the table is full. */
+    int      entries;
+    uint64_t gen; /* Bumped by resets; samples started before one are dropped. */
+} latency_table;
+
+uint64_t latency_now(void);
+int latency_init(dpm_thread *t);
+void latency_start(conn *c, my_cmd_packet *p);
+void latency_done(conn *c);
+
+int latency_snapshot(lua_State *L);
+int latency_top(lua_State *L);
+
+#endif /* LATENCY_H */
@@ -145,6 +145,9 @@ listen:register(dpm.MYC_CONNECT, new_client)
 -- Uncomment these lines to also listen on a unix domain socket.
 -- listen2 = dpm.listener_unix("/tmp/dpmsock", "0770")
 -- listen2:register(dpm.MYC_CONNECT, new_client)
+-- Or these, to read counters with "SHOW DPM STATUS" from any mysql client.
+-- admin = dpm.listener("127.0.0.1", 5501)
+-- dpm.admin(admin, "whee", passdb["whee"])
 
 -- Example of the timer interface. Every few seconds, print a count.
 timer = dpm.new_timer()
@@ -9,15 +9,24 @@
 
 #include "proxy.h"
 #include "luaobj.h"
+#include "pool.h"
+#include "router.h"
+#include "cache.h"
+#include "digest.h"
+#include "sampler.h"
 
 /* Forward declarations */
 static int conn_gc(lua_State *L);
 static int callback_gc(lua_State *L);
 static int timer_gc(lua_State *L);
 static int packet_gc(lua_State *L);
+static int packet_pin(lua_State *L);
+static int cmd_digest(lua_State *L);
 
 static int  obj_index(lua_State *L);
-static void obj_add(lua_State *L, obj_reg *r);
+static int  conn_index(lua_State *L);
+static int  packet_index(lua_State *L);
+static void obj_add(lua_State *L, obj_reg *r, lua_CFunction index_func);
 static int  new_lua_obj(lua_State *L);
 
 /* Accessors */
@@ -46,6 +55,9 @@ static int obj_callback_register(lua_State *L, void *var, void *var2);
 /* Special connection accessors. */
 static int obj_conn_package_register(lua_State *L, void *var, void *var2);
 static int obj_conn_socket_address(lua_State *L, void *var, void *var2);
+static int obj_conn_accept_batch(lua_State *L, void *var, void *var2);
+static int obj_conn_write_high(lua_State *L, void *var, void *var2);
+static int obj_conn_write_low(lua_State *L, void *var, void *var2);
 
 /* Resultset accessors. */
 static int obj_rset_field_count(lua_State *L, void *var, void *var2);
@@ -63,10 +75,19 @@ static const obj_reg conn_regs [] = {
     {"id", obj_uint64_t, LO_READONLY, offsetof(conn, id), 0},
     {"remote_id", obj_uint64_t, LO_READONLY, offsetof(conn, remote_id), 0},
     {"listener", obj_int, LO_READONLY, offsetof(conn, listener), 0},
+    {"accept_batch", obj_conn_accept_batch, LO_READWRITE, offsetof(conn, accept_batch), 0},
+    {"write_high", obj_conn_write_high, LO_READWRITE, offsetof(conn, write_high), 0},
+    {"write_low", obj_conn_write_low, LO_READWRITE, offsetof(conn, write_low), 0},
+    {"throttled", obj_uint8_t, LO_READONLY, offsetof(conn, throttled), 0},
     {"my_type", obj_uint8_t, LO_READONLY, offsetof(conn, my_type), 0},
     {"register", obj_callback_register, LO_READWRITE, offsetof(conn, main_callback), 0},
     {"package_register", obj_conn_package_register, LO_READWRITE, offsetof(conn, package_callback), 0},
     {"socket_address", obj_conn_socket_address, LO_READONLY, offsetof(conn, fd), 0},
+    {"read_calls", obj_uint64_t, LO_READONLY, offsetof(conn, read_calls), 0},
+    {"write_calls", obj_uint64_t, LO_READONLY, offsetof(conn, write_calls), 0},
+    {"event_calls", obj_uint64_t, LO_READONLY, offsetof(conn, event_calls), 0},
+    {"rbuf_size", obj_int, LO_READONLY, offsetof(conn, rbufsize), 0},
+    {"rbuf_peak", obj_int, LO_READONLY, offsetof(conn, rbuf_peak), 0},
     {NULL, NULL, 0, 0, 0},
 };
 
@@ -86,7 +107,7 @@ static const obj_reg auth_regs [] = {
     {"max_packet_size", obj_uint32_t, LO_READWRITE, offsetof(my_auth_packet, max_packet_size), 0},
     {"charset_number", obj_uint8_t, LO_READWRITE, offsetof(my_auth_packet, charset_number), 0},
     {"user", obj_string, LO_READWRITE, offsetof(my_auth_packet, user), 15},
-    {"databasename", obj_pstring, LO_READWRITE, offsetof(my_auth_packet, databasename), 0},
+    {"databasename", obj_pstring, LO_READWRITE|LO_PIN, offsetof(my_auth_packet, databasename), 0},
     {NULL, NULL, 0, 0, 0},
 };
 
@@ -110,7 +131,7 @@ static const obj_reg err_regs [] = {
 
 static const obj_reg cmd_regs [] = {
     {"command", obj_uint8_t, LO_READWRITE, offsetof(my_cmd_packet, command), 0},
-    {"argument", obj_pstring, LO_READWRITE, offsetof(my_cmd_packet, argument), 0},
+    {"argument", obj_pstring, LO_READWRITE|LO_PIN, offsetof(my_cmd_packet, argument), 0},
     {NULL, NULL, 0, 0, 0},
 };
 
@@ -119,8 +140,8 @@ static const obj_reg cmd_regs [] = {
  * field packet storage.
  */
 static const obj_reg rset_regs [] = {
-    {"field_count", obj_rset_field_count, LO_READWRITE, offsetof(my_rset_packet, field_count), 0},
-    {"add_field", obj_rset_add_field, LO_READWRITE, offsetof(my_rset_packet, fields), 0},
+    {"field_count", obj_rset_field_count, LO_READWRITE|LO_PIN, offsetof(my_rset_packet, field_count), 0},
+    {"add_field", obj_rset_add_field, LO_READWRITE|LO_PIN, offsetof(my_rset_packet, fields), 0},
     {"remove_field", obj_rset_remove_field, LO_READWRITE, offsetof(my_rset_packet, fields), 0},
     {"pack_row", obj_rset_pack_row, LO_READWRITE, offsetof(my_rset_packet, fields), 0},
     {"parse_row_array", obj_rset_parse_row_array, LO_READWRITE, offsetof(my_rset_packet, fields), 0},
@@ -133,7 +154,7 @@ static const obj_reg rset_regs [] = {
  * of efficiency (for now) the dynamic part of the packet is only rewriteable.
  */
 static const obj_reg field_regs [] = {
-    {"name", obj_field_name, LO_READWRITE, 0, 0},
+    {"name", obj_field_name, LO_READWRITE|LO_PIN, 0, 0},
     {"full", obj_field_full, LO_READWRITE, 0, 0},
     {NULL, NULL, 0, 0, 0},
 };
@@ -161,8 +182,36 @@ static const obj_reg timer_regs [] = {
     {NULL, NULL, 0, 0, 0},
 };
 
+static const obj_reg pool_regs [] = {
+    {"min", obj_int, LO_READWRITE, offsetof(dpm_pool, min), 0},
+    {"max", obj_int, LO_READWRITE, offsetof(dpm_pool, max), 0},
+    {"idle_timeout", obj_int, LO_READWRITE, offsetof(dpm_pool, idle_timeout), 0},
+    {"ping_interval", obj_int, LO_READWRITE, offsetof(dpm_pool, ping_interval), 0},
+    {NULL, NULL, 0, 0, 0},
+};
+
+static const obj_reg router_regs [] = {
+    {"read_after_write", obj_int, LO_READWRITE, offsetof(dpm_router, read_after_write), 0},
+    {NULL, NULL, 0, 0, 0},
+};
+
+static const obj_reg cache_regs [] = {
+    {"memory", obj_int, LO_READWRITE, offsetof(dpm_cache, memory), 0},
+    {"ttl", obj_int, LO_READWRITE, offsetof(dpm_cache, ttl), 0},
+    {"max_entry", obj_int, LO_READWRITE, offsetof(dpm_cache, max_entry), 0},
+    {NULL, NULL, 0, 0, 0},
+};
+
 static const luaL_Reg generic_m [] = {
     {"__gc", packet_gc},
+    {"pin", packet_pin},
+    {NULL, NULL},
+};
+
+static const luaL_Reg cmd_m [] = {
+    {"__gc", packet_gc},
+    {"pin", packet_pin},
+    {"digest", cmd_digest},
     {NULL, NULL},
 };
 
@@ -181,20 +230,49 @@ static const luaL_Reg timer_m [] = {
     {NULL, NULL},
 };
 
+/* Pools live as long as their worker, so no __gc. */
+static const luaL_Reg pool_m [] = {
+    {"checkout", pool_checkout},
+    {"checkin", pool_checkin},
+    {"multiplex", pool_multiplex},
+    {"stats", pool_stats},
+    {NULL, NULL},
+};
+
+static const luaL_Reg router_m [] = {
+    {"route", router_route},
+    {"add_replica", router_add_replica},
+    {"remove_replica", router_remove_replica},
+    {"stats", router_stats},
+    {NULL, NULL},
+};
+
+static const luaL_Reg cache_m [] = {
+    {"attach", cache_attach},
+    {"rule", cache_set_rule},
+    {"invalidate", cache_invalidate},
+    {"flush", cache_flush},
+    {"stats", cache_stats},
+    {NULL, NULL},
+};
+
 static const obj_toreg regs [] = {
-    {"dpm.conn", conn_regs, conn_m, NULL, NULL},
-    {"dpm.handshake", handshake_regs, generic_m, my_new_handshake_packet, "new_handshake_pkt"},
-    {"dpm.auth", auth_regs, generic_m, my_new_auth_packet, "new_auth_pkt"},
-    {"dpm.ok", ok_regs, generic_m, my_new_ok_packet, "new_ok_pkt"},
-    {"dpm.err", err_regs, generic_m, my_new_err_packet, "new_err_pkt"},
-    {"dpm.cmd", cmd_regs, generic_m, my_new_cmd_packet, "new_cmd_pkt"},
-    {"dpm.rset", rset_regs, generic_m, my_new_rset_packet, "new_rset_pkt"},
-    {"dpm.field", field_regs, generic_m, my_new_field_packet, "new_field_pkt"},
-    {"dpm.row", row_regs, generic_m, my_new_row_packet, "new_row_pkt"},
-    {"dpm.eof", eof_regs, generic_m, my_new_eof_packet, "new_eof_pkt"},
-    {"dpm.callback", callback_regs, callback_m, my_new_callback_object, "new_callback"},
-    {"dpm.timer", timer_regs, timer_m, my_new_timer_object, "new_timer"},
-    {NULL, NULL, NULL, NULL, NULL},
+    {"dpm.conn", conn_regs, conn_m, NULL, NULL, conn_index},
+    {"dpm.handshake", handshake_regs, generic_m, my_new_handshake_packet, "new_handshake_pkt", packet_index},
+    {"dpm.auth", auth_regs, generic_m, my_new_auth_packet, "new_auth_pkt", packet_index},
+    {"dpm.ok", ok_regs, generic_m, my_new_ok_packet, "new_ok_pkt", packet_index},
+    {"dpm.err", err_regs, generic_m, my_new_err_packet, "new_err_pkt", packet_index},
+    {"dpm.cmd", cmd_regs, cmd_m, my_new_cmd_packet, "new_cmd_pkt", packet_index},
+    {"dpm.rset", rset_regs, generic_m, my_new_rset_packet, "new_rset_pkt", packet_index},
+    {"dpm.field", field_regs, generic_m, my_new_field_packet, "new_field_pkt", packet_index},
+    {"dpm.row", row_regs, generic_m, my_new_row_packet, "new_row_pkt", packet_index},
+    {"dpm.eof", eof_regs, generic_m, my_new_eof_packet, "new_eof_pkt", packet_index},
+    {"dpm.callback", callback_regs, callback_m, my_new_callback_object, "new_callback", NULL},
+    {"dpm.timer", timer_regs, timer_m, my_new_timer_object, "new_timer", NULL},
+    {"dpm.pool", pool_regs, pool_m, NULL, NULL, NULL},
+    {"dpm.router", router_regs, router_m, NULL, NULL, NULL},
+    {"dpm.cache", cache_regs, cache_m, NULL, NULL, NULL},
+    {NULL, NULL, NULL, NULL, NULL, NULL},
 };
 
 void *my_new_callback_object()
@@ -243,22 +321,15 @@ void _obj_timer_cancel(my_timer_obj *o)
 /* Nothing special for now. This ensures we don't segfault when calling the
  * packet gc on a connection obj.
  */
+/* An unreferenced conn gets closed. The struct itself belongs to the
+ * conn slab, and has probably been recycled already if it was closed. */
 static int conn_gc(lua_State *L)
 {
-    int i;
-    conn **c;
-    c = lua_touserdata(L, 1);
+    conn_handle *h;
+    h = lua_touserdata(L, 1);
 
-    /* will be zero if connection has been closed already. */
-    if ((*c)->alive)
-        handle_close(*c);
-
-    for (i = 0; i < TOTAL_STATES; i++) {
-        if ((*c)->main_callback[i] != 0)
-            luaL_unref(L, LUA_REGISTRYINDEX, (*c)->main_callback[i]);
-    }
-
-    free(*c);
+    if (h->c->id == h->id && h->c->alive)
+        handle_close(h->c);
 
     return 0;
 }
@@ -291,18 +362,84 @@ static int timer_gc(lua_State *L)
     return 0;
 }
 
+/* Arena packets go away with their arena. */
 static int packet_gc(lua_State *L)
 {
-    my_packet_fuzz **p;
-    p = lua_touserdata(L, 1);
+    packet_handle *h;
+    my_packet_fuzz *p;
+    h = lua_touserdata(L, 1);
+    p = h->p;
 
     /* This frees itself. Ensure there are no leaks with valgrind! */
-    if ((*p)->h.free_me)
-        (*p)->h.free_me(*p);
+    if (h->arena == NULL && p->h.free_me)
+        p->h.free_me(p);
 
     return 0;
 }
 
+/* Swap an arena packet for a heap copy, so it outlives the command. */
+static void _packet_pin(lua_State *L, packet_handle *h)
+{
+    my_packet_fuzz *p = h->p;
+    void *n;
+
+    if (h->arena == NULL)
+        return;
+
+    n = p->h.pin_me(p);
+    if (n == NULL)
+        luaL_error(L, "Unable to pin packet");
+
+    h->p     = n;
+    h->arena = NULL;
+    h->gen   = 0;
+    dpm_self->stats.packets_pinned++;
+}
+
+/* Lua method. Returns the packet, so 'saved = pkt:pin()' reads well. */
+static int packet_pin(lua_State *L)
+{
+    _packet_pin(L, check_packet(L, 1));
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* cmd:digest() returns the hash of the normalized query as 16 hex digits,
+ * and the normalized query. See digest.c */
+static int cmd_digest(lua_State *L)
+{
+    my_cmd_packet *p = (my_cmd_packet *)check_packet(L, 1)->p;
+    char buf[4096];
+    char *out = buf;
+    char hex[17];
+    uint64_t hash;
+    int len, outlen;
+
+    /* Big commands don't keep their argument. */
+    if (p->argument == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    len = strlen(p->argument);
+    if (DIGEST_OUT_SIZE(len) > (int)sizeof(buf)) {
+        out = (char *)malloc(DIGEST_OUT_SIZE(len));
+        if (out == NULL) {
+            perror("Could not malloc()");
+            return luaL_error(L, "Unable to digest query");
+        }
+    }
+
+    hash = digest_query(p->argument, len, out, &outlen);
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+    lua_pushstring(L, hex);
+    lua_pushlstring(L, out, outlen);
+
+    if (out != buf)
+        free(out);
+    return 2;
+}
+
 void dump_stack()
 {
     int top = lua_gettop(L);
@@ -321,6 +458,9 @@ void _obj_timer_run(const int fd, const short which, void *arg)
 {
     my_timer_obj *o = (my_timer_obj *) arg;
     int n = 1;
+    int err;
+
+    conn_reap();
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, o->callback);
     lua_rawgeti(L, LUA_REGISTRYINDEX, o->self);
@@ -328,7 +468,13 @@ void _obj_timer_run(const int fd, const short which, void *arg)
         lua_rawgeti(L, LUA_REGISTRYINDEX, o->arg);
         n++;
     }
-    if (lua_pcall(L, n, 1, 0) != 0) {
+    SAMPLER_PUSH(PHASE_TIMER);
+    SAMPLER_PUSH(PHASE_LUA);
+    err = lua_pcall(L, n, 1, 0);
+    SAMPLER_POP();
+    SAMPLER_POP();
+    SAMPLER_LUA_DONE();
+    if (err != 0) {
         /* Error running the callback. Bitch and unschedule.
          * TODO: Replace this useless fprintf with a global error handler?
          */
@@ -339,6 +485,7 @@ void _obj_timer_run(const int fd, const short which, void *arg)
         /* We might've been cancelled during the run. */
         evtimer_del(&o->evtimer);
         evtimer_set(&o->evtimer, _obj_timer_run, o);
+        event_base_set(dpm_base, &o->evtimer);
         evtimer_add(&o->evtimer, &o->interval);
         lua_settop(L, 0);
     }
@@ -383,8 +530,9 @@ static int obj_timer_schedule(lua_State *L, void *var, void *var2)
         o->arg = luaL_ref(L, LUA_REGISTRYINDEX);
     }
 
-    /* Actually schedule the event via libevent. */
+    /* Actually schedule the event via libevent, on this thread's base. */
     evtimer_set(&o->evtimer, _obj_timer_run, o);
+    event_base_set(dpm_base, &o->evtimer);
     evtimer_add(&o->evtimer, &o->interval);
 
     return 0;
@@ -435,6 +583,47 @@ static int obj_conn_package_register(lua_State *L, void *var, void *var2)
     return 0;
 }
 
+/* A listener accepting nothing per wakeup would never accept again. */
+static int obj_conn_accept_batch(lua_State *L, void *var, void *var2)
+{
+    if (lua_gettop(L) >= 2 && luaL_checkint(L, 2) < 1)
+        return luaL_error(L, "accept_batch must be at least 1");
+    return obj_int(L, var, var2);
+}
+
+/* Flow control marks, with the same rules as dpm.settings(). A negative
+ * write_low would keep the source paused for good, and one above write_high
+ * would pause and resume it on every flush. A write_high of 0 is off. */
+static int obj_conn_write_high(lua_State *L, void *var, void *var2)
+{
+    conn *c = var2;
+    int n;
+
+    if (lua_gettop(L) >= 2) {
+        n = luaL_checkint(L, 2);
+        if (n < 0)
+            return luaL_error(L, "write_high can't be negative");
+        if (n && c->write_low > n)
+            return luaL_error(L, "write_high can't be below write_low (%d)", c->write_low);
+    }
+    return obj_int(L, var, var2);
+}
+
+static int obj_conn_write_low(lua_State *L, void *var, void *var2)
+{
+    conn *c = var2;
+    int n;
+
+    if (lua_gettop(L) >= 2) {
+        n = luaL_checkint(L, 2);
+        if (n < 0)
+            return luaL_error(L, "write_low can't be negative");
+        if (c->write_high && n > c->write_high)
+            return luaL_error(L, "write_low can't be above write_high (%d)", c->write_high);
+    }
+    return obj_int(L, var, var2);
+}
+
 /* Registers a single callback into a connection or callback object. 
  * Argument should be a number + function */
 static int obj_callback_register(lua_State *L, void *var, void *var2)
@@ -599,10 +788,16 @@ static int obj_rset_field_count(lua_State *L, void *var, void *var2)
  */
 static int obj_rset_add_field(lua_State *L, void *var, void *var2)
 {
-    my_field_packet **f = luaL_checkudata(L, 2, "dpm.field");
+    packet_handle *fh   = luaL_checkudata(L, 2, "dpm.field");
+    my_field_packet **f = (my_field_packet **)&fh->p;
     my_rset_packet *p   = var2;
     my_rset_field_header *new_fields;
 
+    /* We keep a pointer to it, which has to stay good. */
+    if (!PACKET_VALID(fh))
+        return luaL_error(L, "Field packet has expired");
+    _packet_pin(L, fh);
+
     if (!(*f)->fields)
         luaL_error(L, "Must use initialized field object");
 
@@ -659,7 +854,13 @@ static int obj_rset_pack_row(lua_State *L, void *var, void *var2)
     size_t len;
 
     /* The top of the stack should be a row object to stuff data into. */
-    my_row_packet **row = luaL_checkudata(L, 2, "dpm.row");
+    packet_handle *rh   = luaL_checkudata(L, 2, "dpm.row");
+    my_row_packet **row = (my_row_packet **)&rh->p;
+
+    /* Arena rows can't hold a lua reference. */
+    if (!PACKET_VALID(rh))
+        return luaL_error(L, "Row packet has expired");
+    _packet_pin(L, rh);
 
     /* The rest should be the fields in the row. Make sure the number of args
      * left == the fields_total.
@@ -712,15 +913,25 @@ static int obj_rset_pack_row(lua_State *L, void *var, void *var2)
 /* Should we define the magic value here? Boring. 0 is array, 1 is table. */
 static int _rset_parse_data(my_rset_packet *rset, int type)
 {
-    my_row_packet **row   = luaL_checkudata(L, 2, "dpm.row");
+    packet_handle *rh     = luaL_checkudata(L, 2, "dpm.row");
+    my_row_packet **row   = (my_row_packet **)&rh->p;
     unsigned int i;
     int base = 0;
     const char *rdata, *end;
+    size_t rlen;
     uint64_t len;
 
-    lua_rawgeti(L, LUA_REGISTRYINDEX, (*row)->packed_row_lref);
-    rdata = lua_tolstring(L, -1, &len);
-    end = rdata + len;
+    if (!PACKET_VALID(rh))
+        return luaL_error(L, "Row packet has expired");
+
+    if ((*row)->data) {
+        rdata = (const char *) (*row)->data;
+        rlen  = (*row)->data_len;
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, (*row)->packed_row_lref);
+        rdata = lua_tolstring(L, -1, &rlen);
+    }
+    end = rdata + rlen;
 
     /* We can pre-allocate the table. */
     if (type == 0) {
@@ -970,12 +1181,12 @@ static int obj_uint8_t(lua_State *L, void *var, void *var2)
 
 /* Here we add specific object accessors into a metatable. Using C closures to
  * easily pull the struct back in on callback. */
-static void obj_add(lua_State *L, obj_reg *r)
+static void obj_add(lua_State *L, obj_reg *r, lua_CFunction index_func)
 {
     for (; r->name; r++) {
         lua_pushstring(L, r->name);
         lua_pushlightuserdata(L, (void *)r);
-        lua_pushcclosure(L, obj_index, 1);
+        lua_pushcclosure(L, index_func, 1);
         lua_rawset(L, -3);
     }
 }
@@ -983,19 +1194,60 @@ static void obj_add(lua_State *L, obj_reg *r)
 /* _non_ lua centric object creatorabobble. */
 int new_obj(lua_State *L, void *p, const char *type)
 {
-    void **u = (void **)lua_newuserdata(L, sizeof(void **));
-    *u = p;
+    return new_packet_obj(L, p, type, NULL);
+}
+
+/* Packets (and everything else new_obj() makes) carry the generation of the
+ * arena they were carved from. See packet_handle. */
+int new_packet_obj(lua_State *L, void *p, const char *type, dpm_arena *arena)
+{
+    packet_handle *h = (packet_handle *)lua_newuserdata(L, sizeof(packet_handle));
+    h->p     = p;
+    h->arena = arena;
+    h->gen   = arena ? arena->gen : 0;
     luaL_getmetatable(L, type);
     lua_setmetatable(L, -2);
     /* The userdata's on the stack. Call up to lua... */
     return 1;
 }
 
+/* Returns the handle for any packet, after making sure it's still good. */
+packet_handle *check_packet(lua_State *L, int idx)
+{
+    packet_handle *h;
+
+    luaL_checktype(L, idx, LUA_TUSERDATA);
+    h = (packet_handle *)lua_touserdata(L, idx);
+    if (!PACKET_VALID(h))
+        luaL_error(L, "Packet has expired; pin() packets to keep them past their command");
+    return h;
+}
+
+/* Conns carry their id along with the pointer. See conn_handle. */
+int new_conn_obj(lua_State *L, conn *c)
+{
+    conn_handle *h = (conn_handle *)lua_newuserdata(L, sizeof(conn_handle));
+    h->c  = c;
+    h->id = c->id;
+    luaL_getmetatable(L, "dpm.conn");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+/* Returns the conn behind a handle, or NULL if it's been recycled. */
+conn *check_conn(lua_State *L, int idx)
+{
+    conn_handle *h = (conn_handle *)luaL_checkudata(L, idx, "dpm.conn");
+
+    if (h->c->id != h->id)
+        return NULL;
+    return h->c;
+}
+
 /* Lua-centric automated object builder. */
 static int new_lua_obj(lua_State *L)
 {
     void *o;
-    void **u; 
     lua_pushvalue(L, lua_upvalueindex(1)); /* Registration struct. */
 
     if (lua_islightuserdata(L, -1)) {
@@ -1003,10 +1255,7 @@ static int new_lua_obj(lua_State *L)
         lua_pop(L, 1);
         o = oreg->obj_new_func();
         if (o) {
-            u = (void **)lua_newuserdata(L, sizeof(void **));
-            *u = o;
-            luaL_getmetatable(L, oreg->name);
-            lua_setmetatable(L, -2);
+            new_obj(L, o, oreg->name);
         } else {
             luaL_error(L, "Unable to create object!");
         }
@@ -1016,6 +1265,26 @@ static int new_lua_obj(lua_State *L)
     return 1;
 }
 
+/* Conn accessors check the handle is still good first. */
+static int conn_index(lua_State *L)
+{
+    if (check_conn(L, 1) == NULL)
+        return luaL_error(L, "Connection has been closed");
+    return obj_index(L);
+}
+
+/* Packet accessors refuse stale packets, and pin arena packets before any
+ * write which might free() part of them. */
+static int packet_index(lua_State *L)
+{
+    packet_handle *h = check_packet(L, 1);
+    obj_reg *f = (obj_reg *)lua_touserdata(L, lua_upvalueindex(1));
+
+    if ((f->type & LO_PIN) && lua_gettop(L) > 1)
+        _packet_pin(L, h);
+    return obj_index(L);
+}
+
 /* Pseudo index function called on every access. This guy parses out the
  * accessor struct, handles read/write protectiveness, and makes the official
  * accessor call. */
@@ -1185,7 +1454,8 @@ int register_obj_types(lua_State *L)
     for (; r->name; r++) {
         luaL_newmetatable(L, r->name);
         luaL_register(L, NULL, r->methods);
-        obj_add(L, r->accessors); /* Push it, push it real good. */
+        /* Push it, push it real good. */
+        obj_add(L, r->accessors, r->index_func ? r->index_func : obj_index);
         /* metatable.__index = metatable */
         lua_pushvalue(L, -1); /* Create a copy to fold into the metamethod */
         lua_setfield(L, -2, "__index");
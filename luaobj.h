@@ -15,6 +15,7 @@ typedef void *(*obj_new) ();
 
 #define LO_READONLY 0
 #define LO_READWRITE 1
+#define LO_PIN 2 /* Writes may free() memory: copy arena packets out first. */
 
 typedef const struct {
     const char *name; /* table index name */
@@ -30,10 +31,15 @@ typedef const struct {
     const luaL_Reg   *methods; /* array of direct methods. */
     const obj_new     obj_new_func; /* make new object function */
     const char       *obj_new_name; /* Name of function for making new packet */
+    const lua_CFunction index_func; /* accessor dispatch, if not obj_index */
 } obj_toreg;
 
 void dump_stack();
 int register_obj_types(lua_State *L);
 int new_obj(lua_State *L, void *p, const char *type);
+int new_packet_obj(lua_State *L, void *p, const char *type, dpm_arena *arena);
+packet_handle *check_packet(lua_State *L, int idx);
+int new_conn_obj(lua_State *L, conn *c);
+conn *check_conn(lua_State *L, int idx);
 
 #endif /* LUAOBJ_H */
@@ -0,0 +1,378 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Prometheus metrics. A listener handed to dpm.metrics() speaks just enough
+ * HTTP to answer GET /metrics with the text exposition format: connection
+ * counts, bytes, buffer pool use, lua memory and event loop lag for every
+ * worker, and connection counts and statement latency histograms for every
+ * backend pool.
+ *
+ * A scrape is rendered in one go by whichever worker accepted it, into a
+ * buffer allocated when dpm.metrics() was called, and written out as the
+ * socket takes it. Nothing is malloc()'ed and nothing waits on other
+ * workers; their counters are read as they are. Each worker serves
+ * METRICS_SLOTS scrapes at once and turns away any more. If the buffer
+ * fills up, the rest of the metrics are left out.
+ */
+
+#include <stdarg.h>
+
+#include "proxy.h"
+#include "luaobj.h"
+#include "pool.h"
+#include "latency.h"
+#include "metrics.h"
+
+static __thread metrics_conn *metrics_slots = NULL;
+static __thread int metrics_bufsize = 0;
+
+/* Event loop lag is how late a timer fires. */
+static __thread struct event metrics_lag_ev;
+static __thread uint64_t metrics_lag_due = 0;
+
+/* Where the body is being rendered. */
+typedef struct {
+    char *pos;
+    int   left;
+    int   full;
+} metrics_out;
+
+static void _metrics_event(const int fd, const short which, void *arg);
+
+static void _metrics_lag(const int fd, const short which, void *arg)
+{
+    struct timeval t = { 0, METRICS_LAG_MS * 1000 };
+    uint64_t now = latency_now();
+
+    if (metrics_lag_due && now > metrics_lag_due) {
+        dpm_self->stats.loop_lag_last = now - metrics_lag_due;
+        dpm_self->stats.loop_lag_sum += now - metrics_lag_due;
+    } else {
+        dpm_self->stats.loop_lag_last = 0;
+    }
+    dpm_self->stats.loop_lag_count++;
+
+    /* Only this thread may touch its lua state, so sample it here. */
+    dpm_self->stats.lua_memory = (uint64_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024;
+
+    metrics_lag_due = now + METRICS_LAG_MS * 1000000ULL;
+    evtimer_add(&metrics_lag_ev, &t);
+}
+
+/* LUA command: dpm.metrics(listener, [bufsize]). Clients of the listener
+ * are served metrics over HTTP instead of being handed to lua. */
+int metrics_listener(lua_State *L)
+{
+    conn *l = check_conn(L, 1);
+    int size = luaL_optint(L, 2, METRICS_BUF_SIZE);
+    int i;
+
+    if (l == NULL || !l->listener)
+        return luaL_error(L, "dpm.metrics() needs a listener");
+
+    if (metrics_slots == NULL) {
+        if (size < METRICS_HEAD * 32)
+            size = METRICS_HEAD * 32;
+        metrics_slots = (metrics_conn *)calloc(METRICS_SLOTS, sizeof(metrics_conn));
+        if (metrics_slots == NULL) {
+            perror("Could not calloc()");
+            return luaL_error(L, "Unable to set up metrics");
+        }
+        for (i = 0; i < METRICS_SLOTS; i++) {
+            metrics_slots[i].fd  = -1;
+            metrics_slots[i].buf = (char *)malloc(size);
+            if (metrics_slots[i].buf == NULL) {
+                perror("Could not malloc()");
+                return luaL_error(L, "Unable to set up metrics");
+            }
+        }
+        metrics_bufsize = size;
+
+        evtimer_set(&metrics_lag_ev, _metrics_lag, NULL);
+        event_base_set(dpm_base, &metrics_lag_ev);
+        _metrics_lag(0, 0, NULL);
+    }
+
+    l->metrics = 1;
+    return 0;
+}
+
+static void _metrics_wait(metrics_conn *m, short which)
+{
+    struct timeval t = { METRICS_TIMEOUT, 0 };
+
+    event_set(&m->ev, m->fd, which, _metrics_event, m);
+    event_base_set(dpm_base, &m->ev);
+    event_add(&m->ev, &t);
+}
+
+static void _metrics_close(metrics_conn *m)
+{
+    event_del(&m->ev);
+    close(m->fd);
+    m->fd = -1;
+}
+
+/* A scraper connected. */
+void metrics_accept(int fd)
+{
+    metrics_conn *m = NULL;
+    int i;
+
+    for (i = 0; i < METRICS_SLOTS; i++) {
+        if (metrics_slots[i].fd == -1) {
+            m = &metrics_slots[i];
+            break;
+        }
+    }
+    if (m == NULL) {
+        if (verbose)
+            fprintf(stderr, "Too many metrics scrapes, dropping one\n");
+        close(fd);
+        return;
+    }
+
+    m->fd     = fd;
+    m->reqlen = 0;
+    m->out    = NULL;
+    m->len    = 0;
+    m->sent   = 0;
+    _metrics_wait(m, EV_READ);
+}
+
+static void _mout(metrics_out *o, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (o->full)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(o->pos, o->left, fmt, ap);
+    va_end(ap);
+
+    /* Whatever was cut off is dropped; output stops at the last whole line. */
+    if (n < 0 || n >= o->left) {
+        o->full = 1;
+        return;
+    }
+    o->pos  += n;
+    o->left -= n;
+}
+
+static void _mfamily(metrics_out *o, const char *name, const char *type, const char *help)
+{
+    _mout(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* One sample per worker, of a dpm_thread_stats counter. */
+static void _mworkers(metrics_out *o, const char *name, const char *type,
+        const char *help, size_t offset)
+{
+    int i;
+
+    _mfamily(o, name, type, help);
+    for (i = 0; i < dpm_thread_count; i++) {
+        _mout(o, "%s{worker=\"%d\"} %llu\n", name, i,
+            (unsigned long long) *(uint64_t *)((char *)&dpm_threads[i].stats + offset));
+    }
+}
+
+/* Pool keys are host:port/user/db, but could hold anything. */
+static void _mlabel(char *dst, int size, const char *src)
+{
+    int i = 0;
+
+    for (; *src && i < size - 2; src++) {
+        if (*src == '\\' || *src == '"') {
+            dst[i++] = '\\';
+            dst[i++] = *src;
+        } else if (*src == '\n') {
+            dst[i++] = '\\';
+            dst[i++] = 'n';
+        } else {
+            dst[i++] = *src;
+        }
+    }
+    dst[i] = '\0';
+}
+
+static void _mpools(metrics_out *o)
+{
+    dpm_pool *pool;
+    char key[sizeof(pool->key) * 2];
+    uint64_t cum;
+    int i, b;
+
+    _mfamily(o, "dpm_backend_connections", "gauge", "Backend connections open, by pool.");
+    for (i = 0; i < dpm_thread_count; i++) {
+        for (pool = dpm_threads[i].pools; pool != NULL; pool = pool->next) {
+            _mlabel(key, sizeof(key), pool->key);
+            _mout(o, "dpm_backend_connections{worker=\"%d\",backend=\"%s\",state=\"idle\"} %d\n", i, key, pool->idle);
+            _mout(o, "dpm_backend_connections{worker=\"%d\",backend=\"%s\",state=\"lent\"} %d\n", i, key, pool->lent);
+            _mout(o, "dpm_backend_connections{worker=\"%d\",backend=\"%s\",state=\"connecting\"} %d\n", i, key, pool->connecting);
+            _mout(o, "dpm_backend_connections{worker=\"%d\",backend=\"%s\",state=\"other\"} %d\n", i, key,
+                pool->total - pool->idle - pool->lent - pool->connecting);
+        }
+    }
+
+    _mfamily(o, "dpm_backend_waiters", "gauge", "Checkouts and clients waiting for a backend connection.");
+    for (i = 0; i < dpm_thread_count; i++) {
+        for (pool = dpm_threads[i].pools; pool != NULL; pool = pool->next) {
+            _mlabel(key, sizeof(key), pool->key);
+            _mout(o, "dpm_backend_waiters{worker=\"%d\",backend=\"%s\"} %d\n", i, key, pool->waiting);
+        }
+    }
+
+    _mfamily(o, "dpm_backend_latency_seconds", "histogram", "Time from a statement being sent to a backend to the end of its answer.");
+    for (i = 0; i < dpm_thread_count; i++) {
+        for (pool = dpm_threads[i].pools; pool != NULL; pool = pool->next) {
+            _mlabel(key, sizeof(key), pool->key);
+            cum = 0;
+            for (b = 0; b < POOL_LAT_BUCKETS; b++) {
+                cum += pool->lat_buckets[b];
+                _mout(o, "dpm_backend_latency_seconds_bucket{worker=\"%d\",backend=\"%s\",le=\"%g\"} %llu\n",
+                    i, key, pool_lat_bounds[b] / 1e9, (unsigned long long) cum);
+            }
+            cum += pool->lat_buckets[POOL_LAT_BUCKETS];
+            _mout(o, "dpm_backend_latency_seconds_bucket{worker=\"%d\",backend=\"%s\",le=\"+Inf\"} %llu\n",
+                i, key, (unsigned long long) cum);
+            _mout(o, "dpm_backend_latency_seconds_sum{worker=\"%d\",backend=\"%s\"} %.9f\n",
+                i, key, pool->lat_sum / 1e9);
+            _mout(o, "dpm_backend_latency_seconds_count{worker=\"%d\",backend=\"%s\"} %llu\n",
+                i, key, (unsigned long long) pool->lat_count);
+        }
+    }
+}
+
+static void _metrics_render(metrics_out *o)
+{
+    dpm_thread *t;
+    int i;
+
+    _mfamily(o, "dpm_workers", "gauge", "Worker threads.");
+    _mout(o, "dpm_workers %d\n", dpm_thread_count);
+
+    _mworkers(o, "dpm_client_connections", "gauge", "Client connections open.",
+        offsetof(dpm_thread_stats, clients));
+    _mworkers(o, "dpm_connections_accepted_total", "counter", "Client connections accepted.",
+        offsetof(dpm_thread_stats, conns_accepted));
+    _mworkers(o, "dpm_connections_closed_total", "counter", "Connections of any kind closed.",
+        offsetof(dpm_thread_stats, conns_closed));
+    _mworkers(o, "dpm_bytes_read_total", "counter", "Bytes read from all sockets.",
+        offsetof(dpm_thread_stats, bytes_read));
+    _mworkers(o, "dpm_bytes_written_total", "counter", "Bytes written to all sockets.",
+        offsetof(dpm_thread_stats, bytes_written));
+    _mworkers(o, "dpm_lua_memory_bytes", "gauge", "Memory used by the worker's lua state.",
+        offsetof(dpm_thread_stats, lua_memory));
+
+    _mfamily(o, "dpm_buffer_pool_bytes", "gauge", "Network buffer memory, held by connections or idle in the pool.");
+    for (i = 0; i < dpm_thread_count; i++) {
+        t = &dpm_threads[i];
+        _mout(o, "dpm_buffer_pool_bytes{worker=\"%d\",state=\"used\"} %llu\n", i, (unsigned long long) t->pool.used_bytes);
+        _mout(o, "dpm_buffer_pool_bytes{worker=\"%d\",state=\"free\"} %llu\n", i, (unsigned long long) t->pool.free_bytes);
+    }
+    _mfamily(o, "dpm_buffer_pool_gets_total", "counter", "Network buffers handed out.");
+    for (i = 0; i < dpm_thread_count; i++)
+        _mout(o, "dpm_buffer_pool_gets_total{worker=\"%d\"} %llu\n", i, (unsigned long long) dpm_threads[i].pool.gets);
+    _mfamily(o, "dpm_buffer_pool_misses_total", "counter", "Network buffers which had to be malloc()'ed.");
+    for (i = 0; i < dpm_thread_count; i++)
+        _mout(o, "dpm_buffer_pool_misses_total{worker=\"%d\"} %llu\n", i, (unsigned long long) dpm_threads[i].pool.misses);
+
+    _mfamily(o, "dpm_event_loop_lag_last_seconds", "gauge", "How late the last lag timer fired.");
+    for (i = 0; i < dpm_thread_count; i++)
+        _mout(o, "dpm_event_loop_lag_last_seconds{worker=\"%d\"} %.9f\n", i, dpm_threads[i].stats.loop_lag_last / 1e9);
+    _mfamily(o, "dpm_event_loop_lag_seconds", "summary", "How late lag timers fired.");
+    for (i = 0; i < dpm_thread_count; i++) {
+        t = &dpm_threads[i];
+        _mout(o, "dpm_event_loop_lag_seconds_sum{worker=\"%d\"} %.9f\n", i, t->stats.loop_lag_sum / 1e9);
+        _mout(o, "dpm_event_loop_lag_seconds_count{worker=\"%d\"} %llu\n", i, (unsigned long long) t->stats.loop_lag_count);
+    }
+
+    _mpools(o);
+}
+
+/* Renders the response into the slot's buffer. The body goes first, after
+ * METRICS_HEAD bytes, then the headers are written in front of it. */
+static void _metrics_respond(metrics_conn *m)
+{
+    metrics_out o;
+    char head[METRICS_HEAD];
+    const char *status = "200 OK";
+    int hlen, blen;
+
+    o.pos  = m->buf + METRICS_HEAD;
+    o.left = metrics_bufsize - METRICS_HEAD;
+    o.full = 0;
+
+    if (strncmp(m->req, "GET /metrics", 12) == 0 && strchr(" ?", m->req[12])) {
+        _metrics_render(&o);
+        if (o.full)
+            fprintf(stderr, "Metrics buffer full, scrape truncated\n");
+    } else if (strncmp(m->req, "GET / ", 6) == 0) {
+        _mout(&o, "See /metrics\n");
+    } else {
+        status = "404 Not Found";
+        _mout(&o, "Not found\n");
+    }
+    blen = o.pos - (m->buf + METRICS_HEAD);
+
+    hlen = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n\r\n", status, blen);
+    m->out = m->buf + METRICS_HEAD - hlen;
+    memcpy(m->out, head, hlen);
+    m->len  = hlen + blen;
+    m->sent = 0;
+}
+
+static void _metrics_event(const int fd, const short which, void *arg)
+{
+    metrics_conn *m = (metrics_conn *)arg;
+    int n;
+
+    if (which & EV_TIMEOUT) {
+        _metrics_close(m);
+        return;
+    }
+
+    /* Read until the end of the headers. The body, if any, is ignored. */
+    if (m->out == NULL) {
+        n = read(m->fd, m->req + m->reqlen, METRICS_REQ_SIZE - 1 - m->reqlen);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            _metrics_close(m);
+            return;
+        }
+        if (n > 0)
+            m->reqlen += n;
+        m->req[m->reqlen] = '\0';
+
+        if (!strstr(m->req, "\r\n\r\n") && !strstr(m->req, "\n\n") &&
+            m->reqlen < METRICS_REQ_SIZE - 1) {
+            _metrics_wait(m, EV_READ);
+            return;
+        }
+        _metrics_respond(m);
+    }
+
+    n = write(m->fd, m->out + m->sent, m->len - m->sent);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            _metrics_close(m);
+            return;
+        }
+        n = 0;
+    }
+    m->sent += n;
+
+    if (m->sent == m->len) {
+        _metrics_close(m);
+        return;
+    }
+    _metrics_wait(m, EV_WRITE);
+}
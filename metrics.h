@@ -0,0 +1,35 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Prometheus metrics over HTTP. See metrics.c */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_SLOTS 4 /* Scrapes served at once, per worker. */
+#define METRICS_BUF_SIZE 262144 /* Default size of each slot's buffer. */
+#define METRICS_HEAD 128 /* Room kept in front of the body for headers. */
+#define METRICS_REQ_SIZE 2048 /* Most of a request we look at. */
+#define METRICS_TIMEOUT 10 /* Seconds a scrape may take. */
+#define METRICS_LAG_MS 100 /* Milliseconds between event loop lag samples. */
+
+/* One scrape in progress. */
+typedef struct metrics_conn {
+    int    fd; /* -1 if the slot's free. */
+    struct event ev;
+    char   req[METRICS_REQ_SIZE];
+    int    reqlen;
+    char  *buf; /* Allocated once, by dpm.metrics(). */
+    char  *out; /* Response start, somewhere in buf. */
+    int    len;
+    int    sent;
+} metrics_conn;
+
+int metrics_listener(lua_State *L);
+void metrics_accept(int fd);
+
+#endif /* METRICS_H */
@@ -0,0 +1,1063 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Backend connection pools. Connecting and authenticating to a MySQL server
+ * costs several round trips, which hurts when clients reconnect in bursts.
+ * A pool keeps authenticated backends for one DSN open, hands them to lua on
+ * checkout, and takes them back on checkin. Conns lua isn't holding are
+ * driven from here: the handshake and auth are done in C, idle conns are
+ * pinged now and then, and ones unused for too long are closed.
+ */
+
+#include "proxy.h"
+#include "luaobj.h"
+#include "pool.h"
+#include "router.h"
+#include "latency.h"
+
+#define POOL_TICK 1 /* Seconds between maintenance runs. */
+
+/* FNV-1a. The session hash of a fresh login is the offset basis. */
+#define MUX_CLEAN 14695981039346656037ULL
+#define MUX_PRIME 1099511628211ULL
+
+/* Upper bounds of the latency buckets, in ns. 100us to 10s. */
+const uint64_t pool_lat_bounds[POOL_LAT_BUCKETS] = {
+    100000ULL, 250000ULL, 500000ULL,
+    1000000ULL, 2500000ULL, 5000000ULL,
+    10000000ULL, 25000000ULL, 50000000ULL,
+    100000000ULL, 250000000ULL, 500000000ULL,
+    1000000000ULL, 2500000000ULL, 5000000000ULL,
+    10000000000ULL,
+};
+
+static void _pool_tick(const int fd, const short which, void *arg);
+static int _mux_attach(dpm_pool *pool, conn *c, conn *b);
+
+/* Calls the function on top of the lua stack with (conn, err). */
+static void _pool_callback(conn *c, const char *err)
+{
+    if (c) {
+        new_conn_obj(L, c);
+    } else {
+        lua_pushnil(L);
+    }
+    if (err) {
+        lua_pushstring(L, err);
+    } else {
+        lua_pushnil(L);
+    }
+
+    if (lua_pcall(L, 2, 0, 0) != 0) {
+        fprintf(stderr, "ERROR: running pool callback: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+/* Hand a conn (or an error, if c is NULL) to the oldest waiter. */
+static void _pool_wake(dpm_pool *pool, conn *c, const char *err)
+{
+    pool_waiter *w = pool->waiters;
+    conn *client = w->client;
+
+    pool->waiters = w->next;
+    if (pool->waiters == NULL)
+        pool->waiters_tail = NULL;
+    pool->waiting--;
+
+    /* A multiplexed client picks up its command where it left off. */
+    if (client) {
+        free(w);
+        client->session->waiting = 0;
+        if (c == NULL) {
+            if (verbose)
+                fprintf(stderr, "Closing client %llu: %s\n", (unsigned long long) client->id, err);
+            handle_close(client);
+        } else if (_mux_attach(pool, client, c) == 1) {
+            event_active(&client->ev, EV_READ, 1);
+        }
+        return;
+    }
+
+    if (c) {
+        c->pool_state = POOL_BUSY;
+        pool->checkouts++;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, w->callback);
+    luaL_unref(L, LUA_REGISTRYINDEX, w->callback);
+    free(w);
+
+    _pool_callback(c, err);
+}
+
+static void _pool_idle_remove(dpm_pool *pool, conn *c)
+{
+    conn **prev = &pool->idle_list;
+
+    while (*prev && *prev != c)
+        prev = (conn **)&(*prev)->pool_next;
+
+    if (*prev) {
+        *prev = (conn *)c->pool_next;
+        c->pool_next = NULL;
+        pool->idle--;
+    }
+}
+
+/* A conn is ready for use. Someone waiting gets it, else it's put away. */
+static void _pool_conn_ready(dpm_pool *pool, conn *c)
+{
+    if (pool->waiters) {
+        _pool_wake(pool, c, NULL);
+        return;
+    }
+
+    c->pool_state = POOL_IDLE;
+    c->pool_next  = (struct conn *)pool->idle_list;
+    pool->idle_list = c;
+    pool->idle++;
+}
+
+/* Start a new conn. It isn't usable until it's authenticated. */
+static int _pool_connect(dpm_pool *pool)
+{
+    conn *c;
+
+    if (pool->path) {
+        c = conn_connect_unix(pool->path);
+    } else {
+        c = conn_connect(pool->host, pool->port);
+    }
+
+    pool->connects++;
+    if (c == NULL) {
+        pool->connect_failures++;
+        return -1;
+    }
+
+    c->pool       = (struct dpm_pool *)pool;
+    c->pool_state = POOL_CONNECTING;
+    c->pool_used  = c->pool_seen = time(NULL);
+    c->pool_session = MUX_CLEAN;
+    pool->total++;
+    pool->connecting++;
+
+    return 0;
+}
+
+/* Answer a server's handshake with our credentials. */
+static int _pool_auth(dpm_pool *pool, conn *c, my_handshake_packet *hs)
+{
+    my_auth_packet *auth;
+    int ret;
+
+    auth = (my_auth_packet *)my_new_auth_packet();
+    if (auth == NULL)
+        return -1;
+
+    strncpy(auth->user, pool->user, USERNAME_LENGTH - 1);
+    if (pool->db) {
+        auth->databasename = strdup(pool->db);
+        if (auth->databasename == NULL) {
+            perror("Could not strdup()");
+            auth->h.free_me(auth);
+            return -1;
+        }
+    }
+    if (pool->pass)
+        my_scramble(auth->scramble_buff, hs->scramble_buff, pool->pass);
+
+    /* Needed again for COM_CHANGE_USER. */
+    memcpy(c->pool_seed, hs->scramble_buff, sizeof(c->pool_seed));
+
+    ret = conn_wire_packet(c, auth);
+    auth->h.free_me(auth);
+
+    return ret;
+}
+
+/* COM_PING an idle conn. It goes back in the pool when the OK comes. */
+static void _pool_ping(dpm_pool *pool, conn *c)
+{
+    my_cmd_packet *ping = (my_cmd_packet *)my_new_cmd_packet();
+
+    if (ping == NULL)
+        return;
+
+    free(ping->argument);
+    ping->argument = NULL;
+    ping->command  = COM_PING;
+
+    _pool_idle_remove(pool, c);
+    c->pool_state = POOL_PINGING;
+    pool->pings++;
+
+    if (conn_wire_packet(c, ping) == -1)
+        handle_close(c);
+
+    ping->h.free_me(ping);
+}
+
+/*
+ * Multiplexing. A multiplexed client borrows a backend for one statement, or
+ * for as long as it has a transaction open, then gives it back. Anything the
+ * client does to its session (default db, SET statements) is remembered, and
+ * replayed onto the next backend it gets if that one's session differs.
+ */
+
+static uint64_t _mux_hash_str(uint64_t hash, const char *str)
+{
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= MUX_PRIME;
+    }
+    /* The terminator too, so "a" "bc" and "ab" "c" differ. */
+    return hash * MUX_PRIME;
+}
+
+static void _mux_rehash(dpm_session *s)
+{
+    uint64_t hash = MUX_CLEAN;
+    int i;
+
+    if (s->db)
+        hash = _mux_hash_str(hash, s->db);
+    for (i = 0; i < s->nsets; i++)
+        hash = _mux_hash_str(hash, s->sets[i]);
+
+    s->hash = hash;
+}
+
+static void _mux_free_session(dpm_session *s)
+{
+    int i;
+
+    if (s->db)
+        free(s->db);
+    for (i = 0; i < s->nsets; i++)
+        free(s->sets[i]);
+    free(s);
+}
+
+/* Case insensitive search for word in a string which isn't terminated. */
+static int _mux_find(const char *str, int len, const char *word)
+{
+    int wlen = strlen(word);
+    int i;
+
+    for (i = 0; i + wlen <= len; i++) {
+        if (strncasecmp(str + i, word, wlen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Statements which leave behind state we can't carry to another backend.
+ * The client keeps the backend it has for good. */
+static const char *mux_pin_words[] = {
+    "TEMPORARY",
+    "GET_LOCK",
+    "LAST_INSERT_ID",
+    "FOUND_ROWS",
+    NULL,
+};
+
+static const char *mux_pin_starts[] = {
+    "LOCK",
+    "PREPARE",
+    "HANDLER",
+    NULL,
+};
+
+static int _mux_starts(const char *str, int len, const char *word)
+{
+    int wlen = strlen(word);
+
+    return len > wlen && strncasecmp(str, word, wlen) == 0 &&
+        (str[wlen] == ' ' || str[wlen] == '\t' || str[wlen] == '\n');
+}
+
+/* Note what the command at the front of the client's read buffer does to
+ * its session. */
+static void _mux_track(conn *c)
+{
+    dpm_session *s = c->session;
+    const char *arg = (const char *)c->rbuf + c->readto + 5;
+    int len = c->packetsize - 5;
+    char *stmt;
+    int i;
+
+    /* Nothing interesting is 16MB long. */
+    if (c->big_packet)
+        return;
+
+    switch (c->rbuf[c->readto + 4]) {
+    case COM_INIT_DB:
+        stmt = strndup(arg, len);
+        if (stmt == NULL)
+            break;
+        if (s->db)
+            free(s->db);
+        s->db = stmt;
+        _mux_rehash(s);
+        return;
+    case COM_QUERY:
+        break;
+    case COM_STMT_PREPARE:
+    case COM_CHANGE_USER:
+    case COM_SET_OPTION:
+        s->pinned = 1;
+        return;
+    default:
+        return;
+    }
+
+    while (len && (*arg == ' ' || *arg == '\t' || *arg == '\n' || *arg == '(')) {
+        arg++;
+        len--;
+    }
+    while (len && (arg[len - 1] == ' ' || arg[len - 1] == ';' || arg[len - 1] == '\n'))
+        len--;
+
+    for (i = 0; mux_pin_words[i]; i++) {
+        if (_mux_find(arg, len, mux_pin_words[i]))
+            s->pinned = 1;
+    }
+    for (i = 0; mux_pin_starts[i]; i++) {
+        if (_mux_starts(arg, len, mux_pin_starts[i]))
+            s->pinned = 1;
+    }
+
+    if (_mux_starts(arg, len, "USE")) {
+        arg += 4;
+        len -= 4;
+        while (len && (*arg == ' ' || *arg == '`')) {
+            arg++;
+            len--;
+        }
+        while (len && arg[len - 1] == '`')
+            len--;
+        if (len == 0 || (stmt = strndup(arg, len)) == NULL)
+            return;
+        if (s->db)
+            free(s->db);
+        s->db = stmt;
+        _mux_rehash(s);
+    } else if (_mux_starts(arg, len, "SET")) {
+        /* Only lasts for the next transaction. */
+        if (_mux_starts(arg + 4, len - 4, "TRANSACTION"))
+            return;
+        stmt = strndup(arg, len);
+        if (stmt == NULL)
+            return;
+        for (i = 0; i < s->nsets; i++) {
+            if (strcmp(s->sets[i], stmt) == 0) {
+                free(stmt);
+                return;
+            }
+        }
+        if (s->nsets == MUX_MAX_SETS) {
+            free(stmt);
+            s->pinned = 1;
+            return;
+        }
+        s->sets[s->nsets++] = stmt;
+        _mux_rehash(s);
+    }
+}
+
+static int _mux_send(conn *b, uint8_t command, const char *arg)
+{
+    my_cmd_packet *cmd = (my_cmd_packet *)my_new_cmd_packet();
+    int ret;
+
+    if (cmd == NULL)
+        return -1;
+
+    free(cmd->argument);
+    cmd->command  = command;
+    cmd->argument = strdup(arg);
+    if (cmd->argument == NULL) {
+        perror("Could not strdup()");
+        cmd->h.free_me(cmd);
+        return -1;
+    }
+
+    ret = conn_wire_packet(b, cmd);
+    cmd->h.free_me(cmd);
+
+    return ret;
+}
+
+/* Send the next command needed to bring a lent backend's session in line
+ * with its client's. Steps are: 0, reset with COM_CHANGE_USER; 1, the
+ * client's db; 2 onwards, its SET statements. Returns 1 when there's nothing
+ * left to send, 0 if a command went out, or -1. */
+static int _mux_replay(dpm_pool *pool, conn *b)
+{
+    dpm_session *s = ((conn *)b->remote)->session;
+    char scramble[21];
+    int i;
+
+    if (b->pool_step == 0) {
+        if (!b->pool_dirty) {
+            b->pool_step = 1;
+        } else {
+            pool->resets++;
+            if (pool->pass)
+                my_scramble(scramble, b->pool_seed, pool->pass);
+            return conn_change_user(b, pool->user, pool->pass ? scramble : NULL,
+                s->db ? s->db : pool->db);
+        }
+    }
+
+    if (b->pool_step == 1) {
+        if (s->db)
+            return _mux_send(b, COM_INIT_DB, s->db);
+        b->pool_step = 2;
+    }
+
+    i = b->pool_step - 2;
+    if (i < s->nsets)
+        return _mux_send(b, COM_QUERY, s->sets[i]);
+
+    b->pool_state   = POOL_LENT;
+    b->pool_session = s->hash;
+    b->pool_dirty   = s->db || s->nsets;
+    return 1;
+}
+
+/* Attach a backend to a client. Returns 1 if it's ready to use, 0 if its
+ * session is being replayed first, or -1 if it had to be closed. */
+static int _mux_attach(dpm_pool *pool, conn *c, conn *b)
+{
+    int ret;
+
+    c->remote    = (struct conn *)b;
+    c->remote_id = b->id;
+    b->remote    = (struct conn *)c;
+    b->remote_id = c->id;
+    pool->lent++;
+    pool->borrows++;
+
+    if (b->pool_session == c->session->hash) {
+        b->pool_state = POOL_LENT;
+        return 1;
+    }
+
+    pool->replays++;
+    b->pool_state = POOL_REPLAY;
+    b->pool_step  = 0;
+    if ((ret = _mux_replay(pool, b)) == -1) {
+        /* Takes the client with it. */
+        handle_close(b);
+        return -1;
+    }
+
+    return ret;
+}
+
+/* Take the backend back from its client, unless it's in the middle of a
+ * transaction or the client can't do without it. */
+static void _mux_release(dpm_pool *pool, conn *b)
+{
+    dpm_session *s = ((conn *)b->remote)->session;
+
+    if (s->in_trans || s->pinned)
+        return;
+
+    b->pool_session = s->hash;
+    b->pool_dirty   = s->db || s->nsets;
+    conn_reset(b);
+    pool->lent--;
+    b->pool_used = b->pool_seen = time(NULL);
+    _pool_conn_ready(pool, b);
+}
+
+/* Called from run_protocol() when a multiplexed client has a command to
+ * send. Returns 1 if it can go ahead, 0 if it has to wait, or -1 if the
+ * client should be closed. */
+int pool_mux_acquire(conn *c)
+{
+    dpm_pool *pool = (dpm_pool *)c->pool;
+    dpm_session *s = c->session;
+    conn *b = (conn *)c->remote;
+    conn **prev;
+    pool_waiter *w;
+    int ret;
+
+    if (s->waiting)
+        return 0;
+
+    if (b) {
+        if (b->pool_state == POOL_REPLAY)
+            return 0;
+        _mux_track(c);
+        return 1;
+    }
+
+    /* Quitting doesn't need a backend. */
+    if (c->rbuf[c->readto + 4] == COM_QUIT)
+        return 1;
+
+    if (s->router) {
+        pool = router_pick((dpm_router *)s->router, c);
+        c->pool = (struct dpm_pool *)pool;
+    }
+
+    if (pool->idle_list) {
+        /* Best is a backend which already has our session. */
+        for (prev = &pool->idle_list; *prev; prev = (conn **)&(*prev)->pool_next) {
+            if ((*prev)->pool_session == s->hash)
+                break;
+        }
+        if (*prev == NULL)
+            prev = &pool->idle_list;
+        b = *prev;
+        *prev = (conn *)b->pool_next;
+        b->pool_next = NULL;
+        pool->idle--;
+
+        if ((ret = _mux_attach(pool, c, b)) == 1)
+            _mux_track(c);
+        return ret;
+    }
+
+    if (pool->connecting <= pool->waiting && pool->total < pool->max &&
+        _pool_connect(pool) == -1)
+        return -1;
+
+    w = (pool_waiter *)malloc( sizeof(pool_waiter) );
+    if (w == NULL) {
+        perror("Could not malloc()");
+        return -1;
+    }
+    w->callback = 0;
+    w->client   = c;
+    w->next     = NULL;
+
+    if (pool->waiters_tail) {
+        pool->waiters_tail->next = w;
+    } else {
+        pool->waiters = w;
+    }
+    pool->waiters_tail = w;
+    pool->waiting++;
+    pool->waits++;
+    s->waiting = 1;
+
+    return 0;
+}
+
+/* Called from run_protocol() after a multiplexed client's packet is dealt
+ * with. If it didn't go to the backend, the backend isn't needed. */
+void pool_mux_idle(conn *c)
+{
+    conn *b = (conn *)c->remote;
+
+    if (b == NULL || b->pool_state != POOL_LENT)
+        return;
+    if (b->dpmstate != MYS_WAIT_CMD && b->dpmstate != MYS_RECV_ERR)
+        return;
+
+    _mux_release((dpm_pool *)b->pool, b);
+}
+
+/* Called from run_protocol() when a lent backend has finished a command.
+ * The OK or EOF which finished it says whether a transaction is open. */
+void pool_mux_done(conn *b, int ptype)
+{
+    conn *c = (conn *)b->remote;
+    int base = b->readto + 5; /* Past the OK or EOF marker. */
+    int status = -1;
+
+    if (c == NULL || c->session == NULL)
+        return;
+
+    if (ptype == dpm_eof) {
+        status = uint2korr(&b->rbuf[base + 2]);
+    } else if (ptype == dpm_ok) {
+        my_read_binary_field(b->rbuf, &base); /* affected_rows */
+        my_read_binary_field(b->rbuf, &base); /* insert_id */
+        status = uint2korr(&b->rbuf[base]);
+    }
+
+    /* Errors don't change anything. */
+    if (status != -1) {
+        c->session->in_trans = (status & SERVER_STATUS_IN_TRANS) != 0;
+        c->session->no_autocommit = (status & SERVER_STATUS_AUTOCOMMIT) == 0;
+        if (status & SERVER_MORE_RESULTS_EXISTS)
+            return;
+    }
+
+    _mux_release((dpm_pool *)b->pool, b);
+}
+
+/* Sets a client up to borrow backends from pool. Lua errors out if it can't
+ * be. */
+dpm_session *pool_mux_client(lua_State *L, dpm_pool *pool, conn *c)
+{
+    dpm_session *s;
+
+    if (c == NULL || c->my_type != MY_CLIENT || c->alive == 0) {
+        luaL_error(L, "Arg 1 must be a valid client");
+        return NULL;
+    }
+    if (c->session)
+        return c->session;
+    if (c->remote || c->pool) {
+        luaL_error(L, "Client already has a backend");
+        return NULL;
+    }
+
+    s = (dpm_session *)malloc( sizeof(dpm_session) );
+    if (s == NULL) {
+        perror("Could not malloc()");
+        luaL_error(L, "Unable to multiplex client");
+        return NULL;
+    }
+    memset(s, 0, sizeof(dpm_session));
+    s->hash = MUX_CLEAN;
+
+    c->pool    = (struct dpm_pool *)pool;
+    c->session = (struct dpm_session *)s;
+
+    return s;
+}
+
+/* LUA method. pool:multiplex(client) has the client borrow backends from the
+ * pool as it needs them, instead of having one of its own. */
+int pool_multiplex(lua_State *L)
+{
+    dpm_pool **p = (dpm_pool **)luaL_checkudata(L, 1, "dpm.pool");
+
+    pool_mux_client(L, *p, check_conn(L, 2));
+
+    return 0;
+}
+
+/* Called from run_protocol() for each packet a pool managed conn reads.
+ * Returns -1 if the conn should be closed. */
+int pool_conn_packet(conn *c, void *p, int ptype)
+{
+    dpm_pool *pool = (dpm_pool *)c->pool;
+    my_err_packet *err;
+    int ret;
+
+    switch (c->pool_state) {
+    case POOL_CONNECTING:
+        if (ptype == dpm_handshake && p)
+            return _pool_auth(pool, c, (my_handshake_packet *)p);
+        if (ptype == dpm_ok) {
+            pool->connecting--;
+            c->pool_used = c->pool_seen = time(NULL);
+            _pool_conn_ready(pool, c);
+            return 0;
+        }
+        break;
+    case POOL_PINGING:
+        if (ptype == dpm_ok) {
+            c->pool_seen = time(NULL);
+            _pool_conn_ready(pool, c);
+            return 0;
+        }
+        break;
+    case POOL_REPLAY:
+        /* A statement which failed for the client the first time will fail
+         * again; carry on. A failed reset leaves us nowhere. */
+        if (ptype == dpm_ok || (ptype == dpm_err && c->pool_step > 0)) {
+            if (c->pool_step == 0) {
+                c->pool_dirty = 0;
+                c->pool_step  = 2; /* The reset took care of the db. */
+            } else {
+                c->pool_step++;
+            }
+            if ((ret = _mux_replay(pool, c)) == 1)
+                event_active(&((conn *)c->remote)->ev, EV_READ, 1);
+            return ret == -1 ? -1 : 0;
+        }
+        break;
+    }
+
+    /* Auth failures and such. Anything unasked for gets the conn closed. */
+    if (ptype == dpm_err && p) {
+        err = (my_err_packet *)p;
+        snprintf(pool->errmsg, sizeof(pool->errmsg), "%s", err->message);
+    }
+    return -1;
+}
+
+/* A multiplexed client is closing. Its backend goes back to the pool if it
+ * can, otherwise it's closed too. */
+static void _mux_client_closed(dpm_pool *pool, conn *c)
+{
+    dpm_session *s = c->session;
+    conn *b = (conn *)c->remote;
+    pool_waiter **prev, *w, *tail;
+
+    if (s->waiting) {
+        for (prev = &pool->waiters; *prev; prev = &(*prev)->next) {
+            if ((*prev)->client == c)
+                break;
+        }
+        if ( (w = *prev) != NULL ) {
+            *prev = w->next;
+            if (pool->waiters_tail == w) {
+                pool->waiters_tail = NULL;
+                for (tail = pool->waiters; tail; tail = tail->next)
+                    pool->waiters_tail = tail;
+            }
+            free(w);
+            pool->waiting--;
+        }
+    }
+
+    if (b && b->pool == c->pool && b->pool_state == POOL_LENT &&
+        (b->dpmstate == MYS_WAIT_CMD || b->dpmstate == MYS_RECV_ERR)) {
+        /* A COM_CHANGE_USER rolls back and unlocks whatever it left. */
+        if (s->in_trans || s->pinned) {
+            s->in_trans = 0;
+            s->pinned   = 0;
+            b->pool_session = 0;
+            b->pool_dirty   = 1;
+        }
+        _mux_release(pool, b);
+    } else if (b) {
+        /* Mid-command. Nobody else can use it. */
+        conn_reset(b);
+        handle_close(b);
+    }
+
+    _mux_free_session(s);
+    c->session = NULL;
+    c->pool    = NULL;
+}
+
+/* A pooled conn was sent a command. Start its clock. */
+void pool_conn_sent(conn *c)
+{
+    c->pool_cmd_start = latency_now();
+}
+
+/* ... and it's answered. Only time statements sent for somebody else, not
+ * our own pings and session replays. */
+void pool_conn_done(conn *c)
+{
+    dpm_pool *pool = c->pool;
+    uint64_t ns;
+    int i;
+
+    if (c->pool_cmd_start == 0)
+        return;
+    ns = latency_now() - c->pool_cmd_start;
+    c->pool_cmd_start = 0;
+    if (c->pool_state != POOL_BUSY && c->pool_state != POOL_LENT)
+        return;
+
+    for (i = 0; i < POOL_LAT_BUCKETS && ns > pool_lat_bounds[i]; i++);
+    pool->lat_buckets[i]++;
+    pool->lat_sum += ns;
+    pool->lat_count++;
+}
+
+/* Called from handle_close() for pooled conns and multiplexed clients. */
+void pool_conn_closed(conn *c)
+{
+    dpm_pool *pool = (dpm_pool *)c->pool;
+    conn *client;
+    int state = c->pool_state;
+
+    if (c->session) {
+        _mux_client_closed(pool, c);
+        return;
+    }
+
+    switch (state) {
+    case POOL_IDLE:
+        _pool_idle_remove(pool, c);
+        break;
+    case POOL_CONNECTING:
+        pool->connecting--;
+        pool->connect_failures++;
+        break;
+    case POOL_LENT:
+    case POOL_REPLAY:
+        /* The client's session goes with it. */
+        pool->lent--;
+        client = (conn *)c->remote;
+        if (client) {
+            conn_reset(c);
+            handle_close(client);
+        }
+        break;
+    }
+
+    pool->total--;
+    c->pool       = NULL;
+    c->pool_state = POOL_NONE;
+
+    if (pool->waiting > pool->connecting) {
+        if (state == POOL_CONNECTING || pool->total >= pool->max) {
+            /* Fail a waiter the remaining connects won't cover. */
+            _pool_wake(pool, NULL, pool->errmsg[0] ? pool->errmsg
+                : "Could not connect to backend");
+            pool->errmsg[0] = '\0';
+        } else if (_pool_connect(pool) == -1) {
+            _pool_wake(pool, NULL, "Could not connect to backend");
+        }
+    }
+}
+
+/* Close conns idle for too long, ping the ones we haven't heard from, and
+ * open new ones to keep 'min' around. */
+static void _pool_tick(const int fd, const short which, void *arg)
+{
+    dpm_pool *pool = (dpm_pool *)arg;
+    struct timeval t = { POOL_TICK, 0 };
+    time_t now = time(NULL);
+    conn *c, *next;
+
+    conn_reap();
+
+    for (c = pool->idle_list; c != NULL; c = next) {
+        next = (conn *)c->pool_next;
+        if (pool->idle_timeout && pool->total > pool->min &&
+            now - c->pool_used >= pool->idle_timeout) {
+            pool->idle_closed++;
+            handle_close(c);
+        } else if (pool->ping_interval &&
+            now - c->pool_seen >= pool->ping_interval) {
+            _pool_ping(pool, c);
+        }
+    }
+
+    while (pool->total < pool->min && _pool_connect(pool) == 0);
+
+    /* Nothing else is going to flush the pings. */
+    dpm_flush_conns();
+
+    evtimer_add(&pool->evtimer, &t);
+}
+
+static char *_pool_opt_string(lua_State *L, const char *name)
+{
+    char *ret = NULL;
+
+    lua_getfield(L, 1, name);
+    if (!lua_isnil(L, -1)) {
+        ret = strdup(luaL_checkstring(L, -1));
+        if (ret == NULL)
+            luaL_error(L, "Could not strdup()");
+    }
+    lua_pop(L, 1);
+
+    return ret;
+}
+
+static int _pool_opt_int(lua_State *L, const char *name, int def)
+{
+    int ret = def;
+
+    lua_getfield(L, 1, name);
+    if (!lua_isnil(L, -1))
+        ret = (int)luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+
+    return ret;
+}
+
+/* LUA command for getting the pool for a DSN. Takes a table of host, port
+ * (or path), user, pass, db, plus min, max, idle_timeout and ping_interval.
+ * The first call for a DSN makes the pool and opens 'min' conns; later calls
+ * return the same pool and ignore the sizes.
+ */
+int new_pool(lua_State *L)
+{
+    dpm_pool *pool;
+    struct timeval t = { POOL_TICK, 0 };
+    char key[256];
+    const char *host, *path, *user, *db;
+    int port;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "host");
+    host = lua_isnil(L, -1) ? "127.0.0.1" : luaL_checkstring(L, -1);
+    lua_getfield(L, 1, "path");
+    path = lua_isnil(L, -1) ? NULL : luaL_checkstring(L, -1);
+    lua_getfield(L, 1, "user");
+    user = lua_isnil(L, -1) ? "root" : luaL_checkstring(L, -1);
+    lua_getfield(L, 1, "db");
+    db   = lua_isnil(L, -1) ? "" : luaL_checkstring(L, -1);
+    port = _pool_opt_int(L, "port", 3306);
+
+    if (path) {
+        snprintf(key, sizeof(key), "%s/%s/%s", path, user, db);
+    } else {
+        snprintf(key, sizeof(key), "%s:%d/%s/%s", host, port, user, db);
+    }
+    lua_pop(L, 4);
+
+    /* Every pool this worker has made, so the same DSN gets the same pool. */
+    for (pool = dpm_self->pools; pool != NULL; pool = pool->next) {
+        if (strcmp(pool->key, key) == 0)
+            return new_obj(L, pool, "dpm.pool");
+    }
+
+    pool = (dpm_pool *)malloc( sizeof(dpm_pool) );
+    if (pool == NULL) {
+        perror("Could not malloc()");
+        return luaL_error(L, "Unable to create pool");
+    }
+    memset(pool, 0, sizeof(dpm_pool));
+
+    strcpy(pool->key, key);
+    pool->port = port;
+    pool->host = _pool_opt_string(L, "host");
+    pool->path = _pool_opt_string(L, "path");
+    pool->user = _pool_opt_string(L, "user");
+    pool->pass = _pool_opt_string(L, "pass");
+    pool->db   = _pool_opt_string(L, "db");
+    if (pool->host == NULL)
+        pool->host = strdup("127.0.0.1");
+    if (pool->user == NULL)
+        pool->user = strdup("root");
+
+    pool->min           = _pool_opt_int(L, "min", 0);
+    pool->max           = _pool_opt_int(L, "max", 32);
+    pool->idle_timeout  = _pool_opt_int(L, "idle_timeout", 60);
+    pool->ping_interval = _pool_opt_int(L, "ping_interval", 30);
+    if (pool->max < pool->min)
+        pool->max = pool->min;
+
+    pool->next = dpm_self->pools;
+    dpm_self->pools = pool;
+
+    /* Pre-warm. */
+    while (pool->total < pool->min && _pool_connect(pool) == 0);
+
+    evtimer_set(&pool->evtimer, _pool_tick, pool);
+    event_base_set(dpm_base, &pool->evtimer);
+    evtimer_add(&pool->evtimer, &t);
+
+    return new_obj(L, pool, "dpm.pool");
+}
+
+/* LUA method. pool:checkout(callback) calls callback(conn, err) with an
+ * authenticated backend, right away if one is idle, otherwise once one is
+ * ready. On failure conn is nil and err says why. */
+int pool_checkout(lua_State *L)
+{
+    dpm_pool **p = (dpm_pool **)luaL_checkudata(L, 1, "dpm.pool");
+    dpm_pool *pool = *p;
+    pool_waiter *w;
+    conn *c;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+
+    if ( (c = pool->idle_list) != NULL ) {
+        pool->idle_list = (conn *)c->pool_next;
+        c->pool_next    = NULL;
+        pool->idle--;
+        c->pool_state   = POOL_BUSY;
+        pool->checkouts++;
+        _pool_callback(c, NULL);
+        return 0;
+    }
+
+    /* Nothing idle. Wait for a conn to be checked in, or a new one. */
+    if (pool->connecting <= pool->waiting && pool->total < pool->max &&
+        _pool_connect(pool) == -1) {
+        _pool_callback(NULL, "Could not connect to backend");
+        return 0;
+    }
+
+    w = (pool_waiter *)malloc( sizeof(pool_waiter) );
+    if (w == NULL) {
+        perror("Could not malloc()");
+        return luaL_error(L, "Unable to wait for connection");
+    }
+    w->callback = luaL_ref(L, LUA_REGISTRYINDEX);
+    w->next     = NULL;
+
+    if (pool->waiters_tail) {
+        pool->waiters_tail->next = w;
+    } else {
+        pool->waiters = w;
+    }
+    pool->waiters_tail = w;
+    pool->waiting++;
+    pool->waits++;
+
+    return 0;
+}
+
+/* LUA method. pool:checkin(conn) gives a conn back. It's disconnected from
+ * any client, loses its callbacks, and the conn object lua has for it stops
+ * working. A conn in the middle of a command is closed instead. */
+int pool_checkin(lua_State *L)
+{
+    dpm_pool **p = (dpm_pool **)luaL_checkudata(L, 1, "dpm.pool");
+    dpm_pool *pool = *p;
+    conn *c = check_conn(L, 2);
+
+    /* Closed conns have already left the pool. */
+    if (c == NULL || !c->alive)
+        return 0;
+
+    if (c->pool != (struct dpm_pool *)pool || c->pool_state != POOL_BUSY)
+        return luaL_error(L, "Connection was not checked out of this pool");
+
+    if ((c->dpmstate != MYS_WAIT_CMD && c->dpmstate != MYS_RECV_ERR) ||
+        c->big_packet || c->frame_left) {
+        handle_close(c);
+        return 0;
+    }
+
+    /* Lua may have done anything to its session. */
+    c->pool_session = 0;
+    c->pool_dirty   = 1;
+    conn_reset(c);
+    c->pool_used = c->pool_seen = time(NULL);
+    _pool_conn_ready(pool, c);
+
+    return 0;
+}
+
+static void _pool_stat(lua_State *L, const char *name, uint64_t val)
+{
+    lua_pushnumber(L, (lua_Number)val);
+    lua_setfield(L, -2, name);
+}
+
+/* LUA method. Returns a table of counts and counters. */
+int pool_stats(lua_State *L)
+{
+    dpm_pool **p = (dpm_pool **)luaL_checkudata(L, 1, "dpm.pool");
+    dpm_pool *pool = *p;
+
+    lua_newtable(L);
+    _pool_stat(L, "total", pool->total);
+    _pool_stat(L, "idle", pool->idle);
+    _pool_stat(L, "busy", pool->total - pool->idle - pool->connecting);
+    _pool_stat(L, "connecting", pool->connecting);
+    _pool_stat(L, "waiting", pool->waiting);
+    _pool_stat(L, "lent", pool->lent);
+    _pool_stat(L, "connects", pool->connects);
+    _pool_stat(L, "connect_failures", pool->connect_failures);
+    _pool_stat(L, "checkouts", pool->checkouts);
+    _pool_stat(L, "waits", pool->waits);
+    _pool_stat(L, "pings", pool->pings);
+    _pool_stat(L, "idle_closed", pool->idle_closed);
+    _pool_stat(L, "borrows", pool->borrows);
+    _pool_stat(L, "replays", pool->replays);
+    _pool_stat(L, "resets", pool->resets);
+
+    return 1;
+}
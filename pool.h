@@ -0,0 +1,118 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Pools of authenticated backend connections. */
+
+#ifndef POOL_H
+#define POOL_H
+
+enum pool_states {
+    POOL_NONE, /* Not a pooled conn. */
+    POOL_BUSY, /* Checked out; lua is driving it. */
+    POOL_LENT, /* Proxying for a multiplexed client. */
+    POOL_CONNECTING, /* Connecting and authenticating. */
+    POOL_IDLE, /* Sitting in the pool. */
+    POOL_PINGING, /* Out of the pool for a health check. */
+    POOL_REPLAY, /* Lent, but catching up with the client's session first. */
+};
+
+/* Packets for pooled conns nobody is proxying through are handled by the
+ * pool. */
+#define POOL_MANAGED(c) ((c)->pool_state > POOL_LENT)
+
+/* Statement latency histogram buckets, plus one for anything slower. */
+#define POOL_LAT_BUCKETS 16
+extern const uint64_t pool_lat_bounds[POOL_LAT_BUCKETS];
+
+/* Most SET statements remembered for one client. Past that, the client
+ * keeps its backend. */
+#define MUX_MAX_SETS 16
+
+/* What a multiplexed client has done to its session, so it can be done again
+ * on whichever backend it gets next. */
+typedef struct dpm_session {
+    char    *db; /* From COM_INIT_DB or USE. NULL is the pool's. */
+    char    *sets[MUX_MAX_SETS]; /* SET statements, oldest first. */
+    int      nsets;
+    uint64_t hash; /* Of the above; backends with the same one match. */
+    uint8_t  waiting; /* Queued for a backend. */
+    uint8_t  in_trans; /* The last statement left a transaction open. */
+    uint8_t  pinned; /* Did something which can't be replayed. */
+    uint8_t  no_autocommit; /* Every statement opens a transaction. */
+    time_t   wrote; /* When a write was last routed to the primary. */
+    struct dpm_router *router; /* Picks the pool for each borrow, if set. */
+} dpm_session;
+
+/* Lua callbacks and multiplexed clients waiting on a conn, oldest first. */
+typedef struct pool_waiter {
+    int    callback; /* lua reference to the callback function, or... */
+    conn  *client; /* ... the client. */
+    struct pool_waiter *next;
+} pool_waiter;
+
+/* One per DSN per worker thread. Pools are never freed. */
+typedef struct dpm_pool {
+    int    min; /* Conns kept open, idle or not. */
+    int    max; /* Most conns open at once. */
+    int    idle_timeout; /* Seconds before an unused conn over 'min' closes. */
+    int    ping_interval; /* Seconds between COM_PINGs of idle conns. 0 is off. */
+
+    int    total; /* Conns in any state. */
+    int    idle;
+    int    connecting;
+    int    waiting;
+    int    lent;
+
+    /* Counters for pool:stats() */
+    uint64_t connects;
+    uint64_t connect_failures;
+    uint64_t checkouts;
+    uint64_t waits; /* checkouts which had to wait for a conn */
+    uint64_t pings;
+    uint64_t idle_closed;
+    uint64_t borrows; /* backends lent to multiplexed clients */
+    uint64_t replays; /* ... which had to be brought up to date first */
+    uint64_t resets; /* ... with a COM_CHANGE_USER */
+
+    /* Statements sent through checked out or lent conns, and how long the
+     * answers took, for dpm.metrics(). */
+    uint64_t lat_buckets[POOL_LAT_BUCKETS + 1];
+    uint64_t lat_sum; /* ns */
+    uint64_t lat_count;
+
+    char   key[256]; /* host:port or path, user and db. */
+    char  *host;
+    int    port;
+    char  *path;
+    char  *user;
+    char  *pass;
+    char  *db;
+    char   errmsg[MYSQL_ERRMSG_SIZE]; /* Why the last connect failed. */
+
+    conn  *idle_list; /* Most recently used first. */
+    pool_waiter *waiters;
+    pool_waiter *waiters_tail;
+    struct event evtimer; /* Maintenance; pings, timeouts and refills. */
+    struct dpm_pool *next;
+} dpm_pool;
+
+int new_pool(lua_State *L);
+int pool_checkout(lua_State *L);
+int pool_checkin(lua_State *L);
+int pool_stats(lua_State *L);
+int pool_multiplex(lua_State *L);
+
+int pool_conn_packet(conn *c, void *p, int ptype);
+void pool_conn_closed(conn *c);
+void pool_conn_sent(conn *c);
+void pool_conn_done(conn *c);
+dpm_session *pool_mux_client(lua_State *L, dpm_pool *pool, conn *c);
+int pool_mux_acquire(conn *c);
+void pool_mux_idle(conn *c);
+void pool_mux_done(conn *c, int ptype);
+
+#endif /* POOL_H */
@@ -0,0 +1,260 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Lua callback profiler. With dpm.profile(true), run_lua_callback() times
+ * every callback it runs, and adds it to a table keyed by the callback's
+ * registry reference and the dpmstate it ran for. Each entry has a call
+ * count, total and max wall time, and a histogram in powers of two
+ * microseconds. The function's file:line is looked up with lua_getinfo()
+ * the first time it's seen.
+ *
+ * dpm.profile_dump() returns the calling worker's table; SIGUSR2 prints
+ * every worker's to stderr. Turned off, the profiler costs
+ * run_lua_callback() one branch on a global.
+ */
+
+#include "proxy.h"
+#include "latency.h"
+#include "profile.h"
+
+int dpm_profile_on = 0;
+
+static __thread profile_table *profile_self = NULL;
+static struct event profile_sig_ev;
+
+/* Per worker tables, for the signal dump. Indexed by worker number. */
+static profile_table **profile_tables = NULL;
+
+static const char *_profile_state(int state)
+{
+    if (state < 0 || state > MYS_SENT_FIELDS)
+        return "unknown";
+    return my_state_name[state];
+}
+
+/* Finds or fills the slot for a callback. The function is at idx. */
+static profile_entry *_profile_find(lua_State *L, int idx, int ref, int state)
+{
+    const void *fn = lua_topointer(L, idx);
+    profile_entry *e;
+    lua_Debug ar;
+    uint32_t h;
+    int i;
+
+    h = ((uint32_t)ref * 2654435761U) ^ ((uint32_t)state << 20) ^
+        (uint32_t)((uintptr_t)fn >> 4);
+    for (i = 0; i < PROFILE_PROBES; i++) {
+        e = &profile_self->slots[(h + i) & (PROFILE_SLOTS - 1)];
+        if (e->ref == ref && e->state == state && e->fn == fn)
+            return e;
+        if (e->ref == 0)
+            break;
+    }
+    if (i == PROFILE_PROBES)
+        return NULL;
+
+    lua_pushvalue(L, idx);
+    if (lua_getinfo(L, ">S", &ar)) {
+        snprintf(e->source, sizeof(e->source), "%s:%d", ar.short_src, ar.linedefined);
+    } else {
+        strcpy(e->source, "?");
+    }
+    e->state = state;
+    e->fn    = fn;
+    e->ref   = ref;
+
+    return e;
+}
+
+static int _profile_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+
+    return b < PROFILE_BUCKETS ? b : PROFILE_BUCKETS - 1;
+}
+
+/* lua_pcall(L, nargs, 1, 0), timed. The callback was made from ref for the
+ * given state. */
+int profile_pcall(lua_State *L, int nargs, int ref, int state)
+{
+    profile_entry *e = NULL;
+    uint64_t start, ns;
+    int ret;
+
+    if (profile_self == NULL) {
+        profile_self = (profile_table *)calloc(1, sizeof(profile_table));
+        if (profile_self == NULL) {
+            perror("Could not calloc()");
+            return lua_pcall(L, nargs, 1, 0);
+        }
+        if (profile_tables)
+            profile_tables[dpm_self->num] = profile_self;
+    }
+
+    e = _profile_find(L, -(nargs + 1), ref, state);
+
+    start = latency_now();
+    ret = lua_pcall(L, nargs, 1, 0);
+    ns = latency_now() - start;
+
+    if (e == NULL) {
+        profile_self->dropped++;
+        return ret;
+    }
+    e->count++;
+    e->total += ns;
+    if (ns > e->max)
+        e->max = ns;
+    e->buckets[_profile_bucket(ns)]++;
+
+    return ret;
+}
+
+/* Slowest total time first. */
+static int _profile_cmp(const void *a, const void *b)
+{
+    const profile_entry *x = *(const profile_entry **)a;
+    const profile_entry *y = *(const profile_entry **)b;
+
+    if (x->total == y->total)
+        return 0;
+    return x->total > y->total ? -1 : 1;
+}
+
+/* Upper bound of the bucket holding quantile q, in microseconds. */
+static uint64_t _profile_quantile(profile_entry *e, double q)
+{
+    uint64_t want = (uint64_t)(q * e->count + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (want < 1)
+        want = 1;
+    for (i = 0; i < PROFILE_BUCKETS - 1; i++) {
+        seen += e->buckets[i];
+        if (seen >= want)
+            break;
+    }
+    return 1ULL << i;
+}
+
+static void _profile_field(lua_State *L, const char *name, lua_Number val)
+{
+    lua_pushnumber(L, val);
+    lua_setfield(L, -2, name);
+}
+
+/* LUA command: dpm.profile([on]). Turns profiling on or off for every
+ * worker, and returns whether it was on. */
+int profile_lua(lua_State *L)
+{
+    int was = dpm_profile_on;
+
+    if (!lua_isnone(L, 1))
+        dpm_profile_on = lua_toboolean(L, 1);
+
+    lua_pushboolean(L, was);
+    return 1;
+}
+
+/* LUA command: dpm.profile_dump([reset]). Returns an array of this worker's
+ * callbacks, most total time first, and the number of calls which weren't
+ * recorded. Times are in microseconds. */
+int profile_dump(lua_State *L)
+{
+    profile_entry *list[PROFILE_SLOTS];
+    profile_entry *e;
+    int reset = lua_toboolean(L, 1);
+    int i, n = 0, b;
+
+    if (profile_self) {
+        for (i = 0; i < PROFILE_SLOTS; i++) {
+            if (profile_self->slots[i].count)
+                list[n++] = &profile_self->slots[i];
+        }
+    }
+    qsort(list, n, sizeof(profile_entry *), _profile_cmp);
+
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        e = list[i];
+        lua_createtable(L, 0, 10);
+        _profile_field(L, "ref", e->ref);
+        lua_pushstring(L, _profile_state(e->state));
+        lua_setfield(L, -2, "state");
+        lua_pushstring(L, e->source);
+        lua_setfield(L, -2, "source");
+        _profile_field(L, "count", e->count);
+        _profile_field(L, "total", e->total / 1000.0);
+        _profile_field(L, "max", e->max / 1000.0);
+        _profile_field(L, "mean", e->total / 1000.0 / e->count);
+        _profile_field(L, "p50", _profile_quantile(e, 0.50));
+        _profile_field(L, "p99", _profile_quantile(e, 0.99));
+
+        /* { [upper bound in us] = calls, ... } */
+        lua_newtable(L);
+        for (b = 0; b < PROFILE_BUCKETS; b++) {
+            if (e->buckets[b] == 0)
+                continue;
+            lua_pushnumber(L, (lua_Number)(1ULL << b));
+            lua_pushnumber(L, (lua_Number)e->buckets[b]);
+            lua_settable(L, -3);
+        }
+        lua_setfield(L, -2, "histogram");
+
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushnumber(L, profile_self ? (lua_Number)profile_self->dropped : 0);
+
+    if (reset && profile_self)
+        memset(profile_self, 0, sizeof(profile_table));
+
+    return 2;
+}
+
+/* SIGUSR2: print every worker's profile. Other workers' tables are read as
+ * they're being written, so the numbers may be a call or two apart. */
+static void _profile_sig(const int sig, const short which, void *arg)
+{
+    profile_table *t;
+    profile_entry *e;
+    int i, s;
+
+    fprintf(stderr, "Lua callback profile (%s):\n", dpm_profile_on ? "on" : "off");
+    for (i = 0; i < dpm_thread_count; i++) {
+        if ( (t = profile_tables[i]) == NULL)
+            continue;
+        for (s = 0; s < PROFILE_SLOTS; s++) {
+            e = &t->slots[s];
+            if (e->count == 0)
+                continue;
+            fprintf(stderr, "worker %d ref %d state \"%s\" %s: %llu calls, "
+                "%.1fus total, %.1fus max, p99 %lluus\n", i, e->ref,
+                _profile_state(e->state), e->source,
+                (unsigned long long) e->count, e->total / 1000.0,
+                e->max / 1000.0, (unsigned long long) _profile_quantile(e, 0.99));
+        }
+        if (t->dropped)
+            fprintf(stderr, "worker %d: %llu calls not recorded\n", i,
+                (unsigned long long) t->dropped);
+    }
+}
+
+/* Called by the main thread, before any other workers start. */
+void profile_init_signal(void)
+{
+    profile_tables = (profile_table **)calloc(dpm_thread_count, sizeof(profile_table *));
+    if (profile_tables == NULL) {
+        perror("Could not calloc()");
+        return;
+    }
+
+    signal_set(&profile_sig_ev, SIGUSR2, _profile_sig, NULL);
+    event_base_set(dpm_base, &profile_sig_ev);
+    signal_add(&profile_sig_ev, NULL);
+}
@@ -0,0 +1,45 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Lua callback profiler. See profile.c */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#define PROFILE_SLOTS 1024 /* Callbacks tracked per worker. Power of two. */
+#define PROFILE_PROBES 16 /* Slots looked at before giving up on a call. */
+#define PROFILE_BUCKETS 32 /* Powers of two microseconds. */
+#define PROFILE_SOURCE 80
+
+typedef struct profile_entry {
+    int      ref; /* lua registry reference. 0 is a free slot. */
+    int      state; /* dpmstate the callback ran for. */
+    const void *fn; /* Refs are reused; this tells functions apart. */
+    char     source[PROFILE_SOURCE]; /* file:line the function starts at */
+    uint64_t count;
+    uint64_t total; /* ns */
+    uint64_t max; /* ns */
+    uint64_t buckets[PROFILE_BUCKETS];
+} profile_entry;
+
+/* One per worker, made the first time it runs a callback with profiling on.
+ * Never freed or moved, so any thread can read it. */
+typedef struct profile_table {
+    profile_entry slots[PROFILE_SLOTS];
+    uint64_t dropped; /* Calls not recorded; too many callbacks. */
+} profile_table;
+
+/* Checked by run_lua_callback() before every call. */
+extern int dpm_profile_on;
+
+int profile_pcall(lua_State *L, int nargs, int ref, int state);
+void profile_init_signal(void);
+
+int profile_lua(lua_State *L);
+int profile_dump(lua_State *L);
+
+#endif /* PROFILE_H */
@@ -10,10 +10,15 @@
 #ifndef PROXY_H
 #define PROXY_H
 
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4() */
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/uio.h> /* writev iovecs */
 #include <netinet/in.h> /* sockaddr_in BSD */
 #include <sys/un.h>
 #include <sys/resource.h>
@@ -23,14 +28,17 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdint.h>
 #include <getopt.h>
 #include <assert.h>
+#include <pthread.h>
 
 /* libevent specifics */
 #include <event.h>
@@ -40,9 +48,19 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+/* Linux can move bytes from one socket to another through a pipe, without
+ * copying them through user space. */
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+#define DPM_SPLICE 1
+#endif
+
 /* Public domain MySQL defines from mysqlnd's portability.h */
 #include "portability.h"
 
+#include "scramble.h"
+#include "bufpool.h"
+#include "arena.h"
+
 #define SERVER_STATUS_IN_TRANS     1    /* Transaction has started */
 #define SERVER_STATUS_AUTOCOMMIT   2    /* Server in auto_commit mode */
 #define SERVER_MORE_RESULTS_EXISTS 8    /* Multi query - next query exists */
@@ -171,6 +189,7 @@ enum my_field_types {
 
 /* Defines which were not yanked. */
 #define MYSQL_NULL (uint64_t) ~0
+#define MAX_PACKET_LENGTH (256L*256L*256L-1) /* Longest single frame. */
 
 /* MySQL protocol states */
 enum myconn_states {
@@ -193,6 +212,8 @@ enum dpm_packet_types {
     dpm_stats,
 };
 
+#define TOTAL_PACKET_TYPES (dpm_stats + 1)
+
 /* This enum is to help transition off of the lowercase style.
  * Lets define both for now, update everything over a few commits, then remove
  * the old one.
@@ -244,23 +265,65 @@ enum dpm_listeners {
 ? c->package_callback[c->dpmstate] : c->main_callback[c->dpmstate] )
 
 /* Structs... */
+
+/* One piece of a connection's outbound data. Packets we build ourselves are
+ * appended to wbuf and referenced by offset (wbuf may be realloc'ed).
+ * Forwarded packets are referenced straight out of the sender's rbuf. */
+typedef struct {
+    unsigned char *ptr; /* NULL if the data lives in our own wbuf. */
+    int    off; /* wbuf offset, for our own data. */
+    int    len;
+} dpm_wseg;
+
 typedef struct {
     int    fd;
     uint64_t id; /* Unique id for struct. */
 
+    /* The read event stays registered for the life of the conn. The write
+     * event is one-shot, and only armed when a send() would block. */
     struct event ev;
-    short  ev_flags; /* only way to be able to read current flags? */
+    struct event wev;
+    uint8_t want_write; /* wev is armed. */
+    uint8_t read_paused; /* ev has been taken out of the event loop. */
+    struct uring_conn *uring; /* Under --io=uring; see uring.c */
+
+    /* Syscall counters, readable from lua. */
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t event_calls; /* event_add/event_del, ie: epoll_ctl() */
 
     /* Dynamic boofers */
     unsigned char   *rbuf;
     int    rbufsize;
+    int    rbuf_peak; /* Largest rbuf this conn has needed. */
     int    read; /* bytes of buffer used */
     int    readto; /* Bytes consumed */
     unsigned char   *wbuf;
     int    wbufsize;
-    int    written; /* bytes of buffer used */
     int    towrite; /* end bytelength of write buffer. */
 
+    /* Outbound segment chain, sent with one sendmsg() per flush. */
+    dpm_wseg *wsegs;
+    int    wsegsize; /* segments allocated */
+    int    wsegcount; /* segments queued */
+    int    wsegsent; /* segments fully sent */
+    int    wsegoff; /* bytes sent from wsegs[wsegsent] */
+    int    wmark; /* wbuf bytes already covered by a segment */
+    int    wpending; /* bytes queued in segments and not yet sent */
+    uint8_t wmore; /* More data is on its way; let the kernel hold a frame. */
+    uint8_t on_flush_list;
+
+    /* Passthrough of large rows to the remote via splice(). */
+    int    pipefd[2];
+    int    pipe_bytes; /* bytes sitting in the pipe */
+    int    stream_left; /* bytes of the current packet not yet read */
+
+    /* Packets of MAX_PACKET_LENGTH or more arrive as a chain of frames, and
+     * are streamed through as they arrive rather than gathered up. */
+    uint8_t big_packet; /* More frames of the current packet are coming. */
+    uint8_t big_discard; /* ... and they're going nowhere. */
+    int    frame_left; /* bytes of the current frame not yet handled */
+
     /* mysql protocol specific junk */ 
     int    mystate;  /* Connection state */
     int    dpmstate; /* Packet state */
@@ -271,12 +334,47 @@ typedef struct {
     unsigned char packet_seq; /* Packet sequence */
 
     int listener;
+    int accept_batch; /* Listeners: max accept()s per wakeup. */
+    uint8_t admin; /* Answered by DPM, not lua. See admin.c */
+    uint8_t metrics; /* Listeners: serve metrics. See metrics.c */
+
+    /* Flow control. Past write_high bytes queued for us, our remote stops
+     * being read until we're back under write_low. Clients inherit these from
+     * their listener. */
+    int write_high;
+    int write_low;
+    uint8_t throttled; /* Our reads are paused for a slow remote. */
+
+    /* Packets consumed from this conn. Rows only last for their callback,
+     * everything else until the command is finished. See arena.c */
+    dpm_arena arena;
+    dpm_arena row_arena;
 
     /* Proxy references. */
     struct conn *remote;
     uint64_t remote_id; /* Cached value for the remote conn id. */
     uint8_t alive; /* Whether or not we're alive. */
 
+    /* Backend pooling. See pool.c */
+    struct dpm_pool *pool; /* Pool we were opened for, or borrow from. */
+    struct conn *pool_next; /* Next idle conn in the pool. */
+    uint8_t pool_state;
+    time_t  pool_used; /* Last checked in, or connected. */
+    time_t  pool_seen; /* Last known to be healthy. */
+    char    pool_seed[20]; /* Scramble from the server's handshake, or the
+                              one we sent an admin client. */
+    uint64_t pool_session; /* Session hash of the last client to use it. */
+    uint64_t pool_cmd_start; /* ns, when the command now running was sent. */
+    uint8_t pool_dirty; /* Session differs from a fresh login. */
+    int     pool_step; /* Session replay progress. */
+    struct dpm_session *session; /* Multiplexed clients. */
+    struct cache_client *cache; /* Result cache, see cache.c */
+
+    /* The query being timed, see latency.c */
+    struct latency_entry *lat_entry;
+    uint64_t lat_start;
+    uint64_t lat_gen;
+
     /* Callback information. */
     int main_callback[25]; /* Each connection can be different. */
     int *package_callback; /* ... and packages may take over.   */
@@ -286,6 +384,25 @@ typedef struct {
     struct conn *nextconn;
 } conn;
 
+/* What lua holds for a conn. Conn structs are recycled as soon as they're
+ * closed, and a recycled struct gets a new id; comparing ids catches a
+ * handle which outlived its conn. */
+typedef struct {
+    conn    *c;
+    uint64_t id;
+} conn_handle;
+
+/* What lua holds for a packet. Packets consumed off the wire live in their
+ * conn's arena, and the handle goes stale when the arena is reset. Pinning
+ * copies the packet out to the heap and clears 'arena'. */
+typedef struct {
+    void      *p;
+    dpm_arena *arena; /* NULL if the packet is malloc()'ed. */
+    uint64_t   gen;
+} packet_handle;
+
+#define PACKET_VALID(h) ((h)->arena == NULL || (h)->arena->gen == (h)->gen)
+
 /* This fits into connection object. */
 typedef struct {
     int callback[25];
@@ -304,6 +421,7 @@ typedef struct {
     int ptype;
     void    (*free_me) (void *p);
     int     (*to_buf) (conn *c, void *p);
+    void   *(*pin_me) (void *p); /* Heap copy of an arena packet. */
 } my_packet_header;
 
 typedef struct {
@@ -410,6 +528,8 @@ typedef struct {
 typedef struct {
     my_packet_header h;
     int     packed_row_lref; /* Lua reference to the packed row. */
+    const unsigned char *data; /* Or, the row as it sits in rbuf. */
+    size_t  data_len;
 } my_row_packet;
 
 typedef struct {
@@ -417,9 +537,73 @@ typedef struct {
     char    data[1];
 } cbuffer_t;
 
+/* Tunables, set from the startfile with dpm.settings(). Every worker runs
+ * the same startfile, so each keeps its own copy. */
+typedef struct {
+    int accept_batch; /* Default max accept()s per listener wakeup. */
+    int max_conns; /* Max client conns per worker. 0 is unlimited. */
+    int splice_min; /* Smallest unread row remainder to splice(). 0 is off. */
+    int stream_min; /* ... to forward as it's read, instead of buffering. */
+    int write_high; /* Default flow control marks. 0 is off. */
+    int write_low;
+    int buffer_pool_max; /* Idle buffer bytes each worker keeps. */
+    int latency_digests; /* Query digests timed per worker. 0 is off. */
+} dpm_settings;
+
+/* Per worker counters. Only the owning thread writes to them; dpm.stats()
+ * adds them up across workers. */
+typedef struct {
+    uint64_t throttled_conns; /* conns with reads paused right now */
+    uint64_t throttles; /* times a conn was throttled */
+    uint64_t conn_structs; /* conn structs allocated */
+    uint64_t conn_structs_free; /* ... sitting on the freelist */
+    uint64_t packets_pinned; /* arena packets copied out by pin() */
+    uint64_t rbuf_compactions; /* partial packets moved to the front of rbuf */
+    uint64_t rbuf_shrinks; /* ... into a smaller rbuf */
+    uint64_t rbuf_grows; /* rbufs swapped for a bigger one */
+    uint64_t wbuf_grows; /* ... and wbufs */
+    uint64_t conns_accepted; /* clients accepted */
+    uint64_t conns_closed; /* conns of any kind closed */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t callbacks; /* lua callbacks run */
+    uint64_t flushes; /* flush list runs with anything on the list */
+    uint64_t flushed_conns; /* ... and the conns on them */
+    uint64_t flush_list_max; /* longest flush list so far */
+    uint64_t uring_submits; /* io_uring_submit() calls, see uring.c */
+    uint64_t uring_completions; /* ... and completions reaped */
+    uint64_t clients; /* client conns open right now */
+    uint64_t loop_lag_last; /* ns. Sampled while dpm.metrics() is on. */
+    uint64_t loop_lag_sum;
+    uint64_t loop_lag_count;
+    uint64_t lua_memory; /* bytes, sampled with the lag */
+    uint64_t packets[TOTAL_PACKET_TYPES]; /* received, by type */
+    uint64_t states[TOTAL_STATES]; /* protocol state transitions, by state */
+} dpm_thread_stats;
+
+/* Each worker thread owns an event base and a lua state. Only the owner
+ * changes anything in here; other workers only read it, for stats. */
+typedef struct {
+    pthread_t          thread_id;
+    int                num; /* Worker number. 0 is the main thread. */
+    struct event_base *base;
+    struct lua_State  *L;
+    dpm_thread_stats   stats;
+    bufpool            pool; /* rbuf/wbuf memory for this worker's conns */
+    struct latency_table *latency; /* Query latencies, see latency.c */
+    struct dpm_pool   *pools; /* Every pool this worker has made. */
+} dpm_thread;
+
 /* Icky ewwy global vars. */
 
-extern struct lua_State *L;
+extern __thread struct lua_State *L;
+extern __thread struct event_base *dpm_base;
+extern __thread dpm_thread *dpm_self;
+extern __thread dpm_settings settings;
+extern dpm_thread *dpm_threads;
+extern int dpm_thread_count;
+extern int verbose;
+extern const char *my_state_name[];
 
 /* Global forward declarations */
 void *my_new_handshake_packet();
@@ -438,6 +622,22 @@ int my_size_binary_field(uint64_t length);
 void my_write_binary_field(unsigned char *buf, int *base, uint64_t length);
 
 void handle_close(conn *c);
+void conn_reap(void);
+conn *conn_connect(const char *ip_addr, int port_num);
+conn *conn_connect_unix(const char *dpath);
+void conn_reset(conn *c);
+int conn_wire_packet(conn *c, void *pkt);
+int conn_wire_bytes(conn *c, unsigned char *data, int len);
+int conn_change_user(conn *c, const char *user, const char *scramble, const char *db);
+void dpm_flush_conns(void);
+
+typedef void (*dpm_stat_func)(void *arg, const char *name, uint64_t value);
+void dpm_stats_each(dpm_stat_func fn, void *arg);
+
+/* Entry points for the io_uring engine, see uring.c */
+void conn_received(conn *c, const unsigned char *data, int len);
+void conn_sent(conn *c);
+int conn_take_writes(conn *c, unsigned char **buf, int *size);
 
 /* Basic string buffering functions, which I can expand on later.
  */
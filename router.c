@@ -0,0 +1,262 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Read/write splitting. A routed client is multiplexed (see pool.c), but
+ * each time it needs a backend the router picks which pool it comes from:
+ * statements which only read go round the replicas, everything else goes to
+ * the primary. Once a backend is borrowed it's kept for the rest of the
+ * transaction, so transactions never straddle servers.
+ */
+
+#include "proxy.h"
+#include "luaobj.h"
+#include "pool.h"
+#include "router.h"
+
+/* Statements starting with these only read... */
+static const char *router_read_starts[] = {
+    "SELECT",
+    "SHOW",
+    "DESC",
+    "DESCRIBE",
+    "EXPLAIN",
+    NULL,
+};
+
+/* ... unless they have one of these in them. */
+static const char *router_write_words[] = {
+    "FOR UPDATE",
+    "LOCK IN SHARE MODE",
+    "INTO",
+    "GET_LOCK",
+    "LAST_INSERT_ID",
+    "FOUND_ROWS",
+    NULL,
+};
+
+/* Case insensitive search for an upper case word in a string which isn't
+ * terminated. */
+static int _router_find(const char *str, int len, const char *word)
+{
+    int wlen = strlen(word);
+    int i;
+
+    for (i = 0; i + wlen <= len; i++) {
+        if ((str[i] & ~0x20) == word[0] && strncasecmp(str + i, word, wlen) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Is the command at the front of the client's read buffer read only? */
+static int _router_is_read(conn *c)
+{
+    const char *q = (const char *)c->rbuf + c->readto + 5;
+    int len = c->packetsize - 5;
+    int wlen, i;
+
+    switch (c->rbuf[c->readto + 4]) {
+    case COM_QUERY:
+        break;
+    case COM_INIT_DB:
+    case COM_PING:
+    case COM_FIELD_LIST:
+    case COM_STATISTICS:
+        return 1;
+    default:
+        return 0;
+    }
+
+    /* 16MB of SQL is someone's INSERT. */
+    if (c->big_packet)
+        return 0;
+
+    for (;;) {
+        while (len && (*q == ' ' || *q == '\t' || *q == '\n' || *q == '\r' || *q == '('))  {
+            q++;
+            len--;
+        }
+        if (len < 2 || q[0] != '/' || q[1] != '*')
+            break;
+        /* Skip comments. */
+        for (q += 2, len -= 2; len >= 2 && (q[0] != '*' || q[1] != '/'); q++, len--);
+        if (len < 2)
+            return 0;
+        q += 2;
+        len -= 2;
+    }
+
+    for (i = 0; router_read_starts[i]; i++) {
+        wlen = strlen(router_read_starts[i]);
+        if (len > wlen && strncasecmp(q, router_read_starts[i], wlen) == 0 &&
+            (q[wlen] == ' ' || q[wlen] == '\t' || q[wlen] == '\n' || q[wlen] == '\r'))
+            break;
+    }
+    if (router_read_starts[i] == NULL)
+        return 0;
+
+    for (i = 0; router_write_words[i]; i++) {
+        if (_router_find(q, len, router_write_words[i]))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Called from pool_mux_acquire() when a routed client needs a backend. */
+dpm_pool *router_pick(dpm_router *r, conn *c)
+{
+    dpm_session *s = c->session;
+    dpm_pool *pool;
+    int i;
+
+    if (!_router_is_read(c)) {
+        r->writes++;
+        if (r->read_after_write)
+            s->wrote = time(NULL);
+        return r->primary;
+    }
+
+    /* With autocommit off even a read opens a transaction, which the
+     * writes after it need to be in. */
+    if (r->nreplicas == 0 || s->no_autocommit ||
+        (r->read_after_write && time(NULL) - s->wrote < r->read_after_write)) {
+        r->primary_reads++;
+        return r->primary;
+    }
+
+    /* Next replica round with a conn to spare, else just the next one. */
+    for (i = 0; i < r->nreplicas; i++) {
+        pool = r->replicas[(r->next + i) % r->nreplicas];
+        if (pool->idle)
+            break;
+    }
+    if (i == r->nreplicas)
+        i = 0;
+    pool = r->replicas[(r->next + i) % r->nreplicas];
+    r->next = (r->next + i + 1) % r->nreplicas;
+
+    r->reads++;
+    return pool;
+}
+
+static int _router_add(lua_State *L, dpm_router *r, int idx)
+{
+    dpm_pool **p = (dpm_pool **)luaL_checkudata(L, idx, "dpm.pool");
+    int i;
+
+    for (i = 0; i < r->nreplicas; i++) {
+        if (r->replicas[i] == *p)
+            return 0;
+    }
+    if (r->nreplicas == ROUTER_MAX_REPLICAS)
+        return luaL_error(L, "Too many replicas");
+
+    r->replicas[r->nreplicas++] = *p;
+    return 0;
+}
+
+/* LUA function. dpm.router({ primary = pool, replicas = { pool, ... },
+ * read_after_write = secs }) */
+int new_router(lua_State *L)
+{
+    dpm_router *r;
+    dpm_pool **p;
+    int i, n;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "primary");
+    p = (dpm_pool **)luaL_checkudata(L, -1, "dpm.pool");
+    lua_pop(L, 1);
+
+    /* Routers live as long as their worker, like pools. */
+    r = (dpm_router *)malloc( sizeof(dpm_router) );
+    if (r == NULL) {
+        perror("Could not malloc()");
+        return luaL_error(L, "Unable to create router");
+    }
+    memset(r, 0, sizeof(dpm_router));
+    r->primary = *p;
+
+    lua_getfield(L, 1, "read_after_write");
+    r->read_after_write = lua_isnil(L, -1) ? 0 : luaL_checkint(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "replicas");
+    if (!lua_isnil(L, -1)) {
+        luaL_checktype(L, -1, LUA_TTABLE);
+        n = lua_objlen(L, -1);
+        for (i = 1; i <= n; i++) {
+            lua_rawgeti(L, -1, i);
+            _router_add(L, r, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    return new_obj(L, r, "dpm.router");
+}
+
+/* LUA method. router:route(client) multiplexes the client, borrowing from
+ * whichever pool suits each statement. */
+int router_route(lua_State *L)
+{
+    dpm_router **r = (dpm_router **)luaL_checkudata(L, 1, "dpm.router");
+    dpm_session *s;
+
+    s = pool_mux_client(L, (*r)->primary, check_conn(L, 2));
+    s->router = (struct dpm_router *)*r;
+
+    return 0;
+}
+
+/* LUA method. router:add_replica(pool) */
+int router_add_replica(lua_State *L)
+{
+    dpm_router **r = (dpm_router **)luaL_checkudata(L, 1, "dpm.router");
+
+    return _router_add(L, *r, 2);
+}
+
+/* LUA method. router:remove_replica(pool). Clients already borrowing from it
+ * carry on until they're done. */
+int router_remove_replica(lua_State *L)
+{
+    dpm_router **r = (dpm_router **)luaL_checkudata(L, 1, "dpm.router");
+    dpm_pool **p = (dpm_pool **)luaL_checkudata(L, 2, "dpm.pool");
+    dpm_router *router = *r;
+    int i;
+
+    for (i = 0; i < router->nreplicas; i++) {
+        if (router->replicas[i] == *p) {
+            router->replicas[i] = router->replicas[--router->nreplicas];
+            router->next = 0;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* LUA method. Returns a table of counters. */
+int router_stats(lua_State *L)
+{
+    dpm_router **r = (dpm_router **)luaL_checkudata(L, 1, "dpm.router");
+
+    lua_newtable(L);
+    lua_pushnumber(L, (lua_Number)(*r)->reads);
+    lua_setfield(L, -2, "reads");
+    lua_pushnumber(L, (lua_Number)(*r)->writes);
+    lua_setfield(L, -2, "writes");
+    lua_pushnumber(L, (lua_Number)(*r)->primary_reads);
+    lua_setfield(L, -2, "primary_reads");
+    lua_pushnumber(L, (lua_Number)(*r)->nreplicas);
+    lua_setfield(L, -2, "replicas");
+
+    return 1;
+}
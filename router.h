@@ -0,0 +1,37 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Read/write splitting for multiplexed clients. */
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#define ROUTER_MAX_REPLICAS 16
+
+typedef struct dpm_router {
+    dpm_pool *primary; /* Writes, transactions, and reads with no replica. */
+    dpm_pool *replicas[ROUTER_MAX_REPLICAS];
+    int    nreplicas;
+    int    next; /* Round robin over the replicas. */
+    int    read_after_write; /* Seconds a client's reads stay on the primary
+                                after it writes, for replication lag. */
+
+    /* Counters for router:stats() */
+    uint64_t reads; /* sent to a replica */
+    uint64_t writes;
+    uint64_t primary_reads; /* reads kept on the primary */
+} dpm_router;
+
+int new_router(lua_State *L);
+int router_route(lua_State *L);
+int router_add_replica(lua_State *L);
+int router_remove_replica(lua_State *L);
+int router_stats(lua_State *L);
+
+dpm_pool *router_pick(dpm_router *r, conn *c);
+
+#endif /* ROUTER_H */
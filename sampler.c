@@ -0,0 +1,462 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Sampling profiler. dpm.sampler() gives the calling worker a timer on its
+ * own CPU clock which sends it SIGPROF, 99 times a second by default. The
+ * handler looks at which of dpm.c's phases (handle_read, run_protocol,
+ * run_lua_callback and so on) the worker is in. Outside of lua, that's the
+ * sample, counted then and there in a fixed table.
+ *
+ * Inside lua, the handler arms a count hook instead; nothing else about a
+ * lua state may be touched from a signal. The hook fires on the next VM
+ * instruction, walks the lua stack, and counts "phases;lua frames" in a
+ * hash of collapsed stacks. If the callback finishes before lua runs
+ * another instruction, the sample is counted against "(lua)".
+ *
+ * dpm.sampler_dump() returns every worker's samples in the collapsed stack
+ * format flamegraph.pl and friends read. Each sample costs a few
+ * microseconds, so 99Hz costs well under 1%. Linux only: the timers are
+ * per thread.
+ */
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "proxy.h"
+#include "sampler.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#if defined(SIGEV_THREAD_ID) && defined(SYS_gettid)
+#define SAMPLER_WORKS 1
+#endif
+
+__thread unsigned char dpm_phases[SAMPLER_DEPTH];
+__thread int dpm_phase_depth = 0;
+__thread volatile sig_atomic_t sampler_pending = 0;
+
+static __thread sampler_state *sampler_self = NULL;
+
+/* Per worker states, for the dump. Indexed by worker number. */
+static sampler_state **sampler_states = NULL;
+
+static pthread_once_t sampler_sig_once = PTHREAD_ONCE_INIT;
+
+static const char *sampler_phase_name[] = {
+    "handle_accept",
+    "handle_read",
+    "handle_write",
+    "run_protocol",
+    "dpm_flush_conns",
+    "run_lua_callback",
+    "timer",
+};
+
+/* The phases the worker is in now. */
+static uint32_t _sampler_code(void)
+{
+    uint32_t code = 0;
+    int i, depth = dpm_phase_depth;
+
+    if (depth > SAMPLER_DEPTH)
+        depth = SAMPLER_DEPTH;
+    for (i = 0; i < depth; i++)
+        code = (code << 4) | (dpm_phases[i] + 1);
+    return code;
+}
+
+/* Writes a code out as "phase;phase", returning the length. */
+static int _sampler_names(char *buf, int size, uint32_t code)
+{
+    int shift, len = 0, n;
+    int p;
+
+    buf[0] = '\0';
+    for (shift = 28; shift >= 0; shift -= 4) {
+        p = (code >> shift) & 0xf;
+        if (p == 0 || p > TOTAL_PHASES)
+            continue;
+        n = snprintf(buf + len, size - len, "%s%s", len ? ";" : "",
+            sampler_phase_name[p - 1]);
+        if (n >= size - len)
+            break;
+        len += n;
+    }
+    return len;
+}
+
+/* Signal handler context: no locks, no allocation. */
+static void _sampler_count_c(sampler_state *s, uint32_t code)
+{
+    sampler_cslot *slot;
+    uint32_t h = code * 2654435761U;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        slot = &s->cslots[(h + i) & (SAMPLER_CSLOTS - 1)];
+        if (slot->code == code) {
+            slot->count++;
+            return;
+        }
+        if (slot->code == 0) {
+            slot->code  = code;
+            slot->count = 1;
+            return;
+        }
+    }
+    s->dropped++;
+}
+
+/* Adds one to a collapsed lua stack. */
+static void _sampler_count_stack(sampler_state *s, const char *stack)
+{
+    sampler_stack **head, *e;
+    uint32_t h = 2166136261U;
+    const char *p;
+
+    for (p = stack; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619U;
+
+    pthread_mutex_lock(&s->lock);
+    head = &s->hash[h & (SAMPLER_HASH - 1)];
+    for (e = *head; e != NULL; e = e->next) {
+        if (strcmp(e->stack, stack) == 0) {
+            e->count++;
+            goto done;
+        }
+    }
+
+    if (s->stacks >= SAMPLER_STACKS ||
+        (e = (sampler_stack *)malloc(sizeof(sampler_stack))) == NULL) {
+        s->dropped++;
+        goto done;
+    }
+    if ( (e->stack = strdup(stack)) == NULL ) {
+        free(e);
+        s->dropped++;
+        goto done;
+    }
+    e->count = 1;
+    e->next  = *head;
+    *head = e;
+    s->stacks++;
+
+done:
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Appends ";frame" for one lua function. ';' would split the frame in two,
+ * so it's swapped out. */
+static int _sampler_frame(char *buf, int len, int size, lua_Debug *d)
+{
+    const char *name = d->name ? d->name : "?";
+    char *p;
+    int n;
+
+    if (*d->what == 'C') {
+        n = snprintf(buf + len, size - len, ";%s [C]", name);
+    } else if (*d->what == 'm') {
+        n = snprintf(buf + len, size - len, ";main (%s)", d->short_src);
+    } else {
+        n = snprintf(buf + len, size - len, ";%s (%s:%d)", name,
+            d->short_src, d->linedefined);
+    }
+    if (n >= size - len) {
+        buf[len] = '\0';
+        return len;
+    }
+    for (p = buf + len + 1; *p; p++) {
+        if (*p == ';')
+            *p = ':';
+    }
+    return len + n;
+}
+
+/* The count hook armed by the signal handler. Runs as lua code would, so
+ * it can look at the stack. */
+static void _sampler_hook(lua_State *Ls, lua_Debug *ar)
+{
+    sampler_state *s = sampler_self;
+    char stack[SAMPLER_STACK];
+    lua_Debug d;
+    int len, top, level;
+
+    lua_sethook(Ls, NULL, 0, 0);
+    if (s == NULL || !sampler_pending)
+        return;
+
+    len = _sampler_names(stack, sizeof(stack), s->pending_code);
+    sampler_pending = 0;
+
+    for (top = 0; lua_getstack(Ls, top, &d); top++);
+    for (level = top - 1; level >= 0; level--) {
+        if (!lua_getstack(Ls, level, &d) || !lua_getinfo(Ls, "Sn", &d))
+            continue;
+        len = _sampler_frame(stack, len, sizeof(stack), &d);
+    }
+
+    _sampler_count_stack(s, stack);
+}
+
+/* A lua call ended with a sample still waiting for the hook. */
+void sampler_unhook(void)
+{
+    sampler_state *s = sampler_self;
+    char stack[SAMPLER_STACK];
+    int len;
+
+    if (s == NULL) {
+        sampler_pending = 0;
+        return;
+    }
+    lua_sethook(s->L, NULL, 0, 0);
+    len = _sampler_names(stack, sizeof(stack) - 8, s->pending_code);
+    sampler_pending = 0;
+    strcpy(stack + len, ";(lua)");
+
+    _sampler_count_stack(s, stack);
+}
+
+static void _sampler_sig(int sig)
+{
+    sampler_state *s = sampler_self;
+    int depth = dpm_phase_depth;
+
+    if (s == NULL || s->hz == 0)
+        return;
+
+    if (depth <= 0) {
+        s->loop++;
+        return;
+    }
+
+    /* lua_sethook() is the one lua call safe in a signal handler. */
+    if (depth <= SAMPLER_DEPTH && dpm_phases[depth - 1] == PHASE_LUA &&
+        !sampler_pending) {
+        s->pending_code = _sampler_code();
+        sampler_pending = 1;
+        lua_sethook(s->L, _sampler_hook, LUA_MASKCOUNT, 1);
+        return;
+    }
+
+    _sampler_count_c(s, _sampler_code());
+}
+
+static void _sampler_install(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _sampler_sig;
+    sa.sa_flags   = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) == -1)
+        perror("sigaction(SIGPROF)");
+}
+
+#ifdef SAMPLER_WORKS
+/* (Re)arms the calling worker's timer. 0 stops it. */
+static int _sampler_arm(sampler_state *s, int hz)
+{
+    struct itimerspec its;
+    struct sigevent sev;
+
+    if (!s->have_timer) {
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo  = SIGPROF;
+        sev.sigev_notify_thread_id = syscall(SYS_gettid);
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &s->timer) == -1) {
+            perror("timer_create()");
+            return -1;
+        }
+        s->have_timer = 1;
+    }
+
+    memset(&its, 0, sizeof(its));
+    if (hz)
+        its.it_interval.tv_nsec = 1000000000 / hz;
+    its.it_value = its.it_interval;
+
+    /* Set before arming, so the first signal sees it. */
+    if (hz)
+        s->hz = hz;
+    if (timer_settime(s->timer, 0, &its, NULL) == -1) {
+        perror("timer_settime()");
+        s->hz = 0;
+        return -1;
+    }
+    s->hz = hz;
+    return 0;
+}
+#endif
+
+/* LUA command: dpm.sampler([hz]). Samples the calling worker hz times a
+ * second of CPU it uses; 0 or false stops. Every worker runs the startfile,
+ * so calling it there samples them all. Returns the rate it had. */
+int sampler_lua(lua_State *L)
+{
+#ifdef SAMPLER_WORKS
+    sampler_state *s = sampler_self;
+    int was = s ? s->hz : 0;
+    int hz;
+
+    if (lua_isboolean(L, 1)) {
+        hz = lua_toboolean(L, 1) ? SAMPLER_HZ : 0;
+    } else {
+        hz = luaL_optint(L, 1, SAMPLER_HZ);
+    }
+    if (hz < 0 || hz > 1000)
+        return luaL_error(L, "Sampling rate must be 0 to 1000");
+
+    if (s == NULL) {
+        if (hz == 0)
+            goto done;
+        s = (sampler_state *)calloc(1, sizeof(sampler_state));
+        if (s == NULL) {
+            perror("Could not calloc()");
+            return luaL_error(L, "Out of memory");
+        }
+        pthread_mutex_init(&s->lock, NULL);
+        s->L = dpm_self->L;
+        sampler_self = s;
+        if (sampler_states)
+            sampler_states[dpm_self->num] = s;
+        pthread_once(&sampler_sig_once, _sampler_install);
+    }
+
+    if (_sampler_arm(s, hz) == -1)
+        return luaL_error(L, "Could not start the sampler");
+
+done:
+    lua_pushinteger(L, was);
+    return 1;
+#else
+    return luaL_error(L, "dpm.sampler() needs per thread timers (Linux)");
+#endif
+}
+
+static void _sampler_reset(sampler_state *s)
+{
+    sampler_stack *e, *next;
+    int i;
+
+    for (i = 0; i < SAMPLER_HASH; i++) {
+        for (e = s->hash[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->stack);
+            free(e);
+        }
+        s->hash[i] = NULL;
+    }
+    memset(s->cslots, 0, sizeof(s->cslots));
+    s->stacks  = 0;
+    s->loop    = 0;
+    s->dropped = 0;
+}
+
+/* Output for sampler_dump(), gathered while a worker's lock is held. Lua
+ * can raise errors and collect garbage, so it isn't touched until after. */
+typedef struct {
+    char  *buf;
+    size_t len;
+    size_t size;
+    int    failed;
+} sampler_out;
+
+static void _sampler_out(sampler_out *o, const char *line)
+{
+    size_t len = strlen(line);
+    size_t newsize;
+    char *newbuf;
+
+    if (o->failed)
+        return;
+    if (o->len + len > o->size) {
+        newsize = o->size ? o->size * 2 : 4096;
+        while (newsize < o->len + len)
+            newsize *= 2;
+        if ( (newbuf = (char *)realloc(o->buf, newsize)) == NULL) {
+            o->failed = 1;
+            return;
+        }
+        o->buf  = newbuf;
+        o->size = newsize;
+    }
+    memcpy(o->buf + o->len, line, len);
+    o->len += len;
+}
+
+/* LUA command: dpm.sampler_dump([reset]). Returns every worker's samples as
+ * collapsed stacks, "worker0;phase;...;frame count" a line, and how many
+ * samples weren't kept. Other workers' C counts are read as they're being
+ * written, so may be a sample or two apart. */
+int sampler_dump(lua_State *L)
+{
+    sampler_state *s;
+    sampler_stack *e;
+    sampler_cslot *slot;
+    sampler_out out;
+    char names[SAMPLER_STACK];
+    char line[SAMPLER_STACK + 64];
+    int reset = lua_toboolean(L, 1);
+    uint64_t dropped = 0;
+    int i, j;
+
+    memset(&out, 0, sizeof(out));
+    for (i = 0; sampler_states && i < dpm_thread_count; i++) {
+        if ( (s = sampler_states[i]) == NULL)
+            continue;
+
+        pthread_mutex_lock(&s->lock);
+        for (j = 0; j < SAMPLER_HASH; j++) {
+            for (e = s->hash[j]; e != NULL; e = e->next) {
+                snprintf(line, sizeof(line), "worker%d;%s %llu\n", i,
+                    e->stack, (unsigned long long) e->count);
+                _sampler_out(&out, line);
+            }
+        }
+        for (j = 0; j < SAMPLER_CSLOTS; j++) {
+            slot = &s->cslots[j];
+            if (slot->code == 0 || slot->count == 0)
+                continue;
+            _sampler_names(names, sizeof(names), slot->code);
+            snprintf(line, sizeof(line), "worker%d;%s %llu\n", i, names,
+                (unsigned long long) slot->count);
+            _sampler_out(&out, line);
+        }
+        if (s->loop) {
+            snprintf(line, sizeof(line), "worker%d;event_loop %llu\n", i,
+                (unsigned long long) s->loop);
+            _sampler_out(&out, line);
+        }
+        dropped += s->dropped;
+        if (reset && !out.failed)
+            _sampler_reset(s);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (out.failed) {
+        free(out.buf);
+        return luaL_error(L, "Out of memory dumping samples");
+    }
+    lua_pushlstring(L, out.buf ? out.buf : "", out.len);
+    free(out.buf);
+    lua_pushnumber(L, (lua_Number)dropped);
+    return 2;
+}
+
+/* Called by the main thread, before any other workers start. */
+void sampler_init(void)
+{
+    sampler_states = (sampler_state **)calloc(dpm_thread_count, sizeof(sampler_state *));
+    if (sampler_states == NULL)
+        perror("Could not calloc()");
+}
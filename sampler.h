@@ -0,0 +1,83 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* SIGPROF sampling profiler. See sampler.c */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#define SAMPLER_HZ 99 /* Default rate. Off beat with anything periodic. */
+#define SAMPLER_DEPTH 7 /* C phases kept per sample; 4 bits each. */
+#define SAMPLER_CSLOTS 256 /* C only stacks per worker. Power of two. */
+#define SAMPLER_HASH 1024 /* Hash chains for lua stacks. */
+#define SAMPLER_STACKS 4096 /* Distinct lua stacks kept per worker. */
+#define SAMPLER_STACK 2048 /* Longest collapsed stack. */
+
+/* What the worker's C side is doing. dpm.c pushes these around the calls
+ * worth telling apart; the signal handler reads them. */
+enum sampler_phases {
+    PHASE_ACCEPT = 0,
+    PHASE_READ,
+    PHASE_WRITE,
+    PHASE_PROTOCOL,
+    PHASE_FLUSH,
+    PHASE_LUA,
+    PHASE_TIMER,
+    TOTAL_PHASES
+};
+
+extern __thread unsigned char dpm_phases[SAMPLER_DEPTH];
+extern __thread int dpm_phase_depth;
+extern __thread volatile sig_atomic_t sampler_pending;
+
+/* A couple of thread local stores; cheap enough to leave in always. */
+#define SAMPLER_PUSH(p) do { \
+    if (dpm_phase_depth < SAMPLER_DEPTH) \
+        dpm_phases[dpm_phase_depth] = (p); \
+    dpm_phase_depth++; \
+} while (0)
+#define SAMPLER_POP() (dpm_phase_depth--)
+
+/* After a lua call: a sample taken during it which lua never got to. */
+#define SAMPLER_LUA_DONE() do { \
+    if (sampler_pending) \
+        sampler_unhook(); \
+} while (0)
+
+typedef struct sampler_cslot {
+    uint32_t code; /* Phases, 4 bits each, outermost highest. 0 is free. */
+    uint32_t count;
+} sampler_cslot;
+
+typedef struct sampler_stack {
+    char    *stack; /* Collapsed, root first, without the worker. */
+    uint64_t count;
+    struct sampler_stack *next;
+} sampler_stack;
+
+/* One per worker, made by its first dpm.sampler(). Never freed. */
+typedef struct sampler_state {
+    pthread_mutex_t lock; /* Lua stacks; the signal handler never takes it. */
+    lua_State *L;
+    int      hz;
+    int      have_timer;
+    timer_t  timer;
+    uint32_t pending_code; /* Phases when the lua sample was asked for. */
+    uint64_t loop; /* Samples outside any phase: libevent, timers. */
+    uint64_t dropped; /* Samples not kept; too many distinct stacks. */
+    sampler_cslot cslots[SAMPLER_CSLOTS]; /* Written by the signal handler. */
+    sampler_stack *hash[SAMPLER_HASH];
+    int      stacks;
+} sampler_state;
+
+void sampler_init(void);
+void sampler_unhook(void);
+
+int sampler_lua(lua_State *L);
+int sampler_dump(lua_State *L);
+
+#endif /* SAMPLER_H */
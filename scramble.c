@@ -0,0 +1,106 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* MySQL 4.1 password scrambles, client and server side. Kept apart from
+ * dpm.c so dpm-bench can log in without lua or libevent.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sha1.h"
+#include "scramble.h"
+
+static uint8_t my_char_val(uint8_t X)
+{
+  return (unsigned int) (X >= '0' && X <= '9' ? X-'0' :
+      X >= 'A' && X <= 'Z' ? X-'A'+10 : X-'a'+10);
+}
+
+static void my_hex2octet(uint8_t *dst, const char *src, unsigned int len)
+{   
+  const char *str_end= src + len;
+  while (src < str_end) {
+      char tmp = my_char_val(*src++);
+      *dst++ = (tmp << 4) | my_char_val(*src++);
+  }
+}
+
+static void my_crypt(char *dst, const unsigned char *s1, const unsigned char *s2, uint len)
+{
+  const uint8_t *s1_end= s1 + len;
+  while (s1 < s1_end)
+    *dst++ = *s1++ ^ *s2++;
+}
+/* End. */
+
+/* Client scramble
+ * random is 20 byte random scramble from the server.
+ * pass is plaintext password supplied from client
+ * dst is a 20 byte buffer to receive the jumbled mess. */
+void my_scramble(char *dst, const char *random, const char *pass)
+{
+    SHA1_CTX context;
+    uint8_t hash1[SHA1_DIGEST_LENGTH];
+    uint8_t hash2[SHA1_DIGEST_LENGTH];
+    /* Make sure the null terminator's in the right spot. */
+    dst[SHA1_DIGEST_LENGTH] = '\0';
+
+    /* First hash the password. */
+    SHA1Init(&context);
+    SHA1Update(&context, (const uint8_t *) pass, strlen(pass));
+    SHA1Final(hash1, &context);
+
+    /* Second, hash the hash. */
+    SHA1Init(&context);
+    SHA1Update(&context, hash1, SHA1_DIGEST_LENGTH);
+    SHA1Final(hash2, &context);
+
+    /* Now we have the equivalent of SELECT PASSWORD('whatever') */
+    /* Now SHA1 the random message against hash2, then xor it against hash1 */
+    SHA1Init(&context);
+    SHA1Update(&context, (const uint8_t *) random, SHA1_DIGEST_LENGTH);
+    SHA1Update(&context, hash2, SHA1_DIGEST_LENGTH);
+    SHA1Final((uint8_t *) dst, &context);
+
+    my_crypt((char *)dst, (const unsigned char *) dst, hash1, SHA1_DIGEST_LENGTH);
+
+    /* The sha1 context has temporary data that needs to disappear. */
+    memset(&context, 0, sizeof(SHA1_CTX));
+}
+
+/* Server side check. */
+int my_check_scramble(const char *remote_scram, const char *random, const char *stored_hash)
+{
+    uint8_t pass_hash[SHA1_DIGEST_LENGTH];
+    uint8_t rand_hash[SHA1_DIGEST_LENGTH];
+    uint8_t pass_orig[SHA1_DIGEST_LENGTH];
+    uint8_t pass_check[SHA1_DIGEST_LENGTH];
+    SHA1_CTX context;
+
+    /* Parse string into bytes... */
+    my_hex2octet(pass_hash, stored_hash, strlen(stored_hash));
+
+    /* Muck up our view of the password against our original random num */
+    SHA1Init(&context);
+    SHA1Update(&context, (const uint8_t *) random, SHA1_DIGEST_LENGTH);
+    SHA1Update(&context, pass_hash, SHA1_DIGEST_LENGTH);
+    SHA1Final(rand_hash, &context);
+
+    /* Pull out the client sha1 */
+    my_crypt((char *) pass_orig, (const unsigned char *) rand_hash, (const unsigned char *) remote_scram, SHA1_DIGEST_LENGTH);
+
+    /* Update it to be more like our own */
+    SHA1Init(&context);
+    SHA1Update(&context, pass_orig, SHA1_DIGEST_LENGTH);
+    SHA1Final(pass_check, &context);
+    memset(&context, 0, sizeof(SHA1_CTX));
+
+    /* Compare */
+    return memcmp(pass_hash, pass_check, SHA1_DIGEST_LENGTH);
+}
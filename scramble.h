@@ -0,0 +1,16 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* MySQL 4.1 password scrambles. See scramble.c */
+
+#ifndef SCRAMBLE_H
+#define SCRAMBLE_H
+
+void my_scramble(char *dst, const char *random, const char *pass);
+int my_check_scramble(const char *remote_scram, const char *random, const char *stored_hash);
+
+#endif /* SCRAMBLE_H */
@@ -0,0 +1,469 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* io_uring I/O engine, chosen with --io=uring. Listeners, outbound connects
+ * and timers stay with libevent; reading and writing conns moves here.
+ *
+ * Each conn has one multishot recv posted. It draws on a ring of provided
+ * buffers shared by the whole worker, so an idle conn has no buffer at
+ * all. A completion's data is appended to the conn's rbuf, the buffer goes
+ * straight back to the ring, and run_protocol() takes it from there.
+ *
+ * handle_write() hands everything queued for a conn over as one buffer (see
+ * conn_take_writes()), which is sent with one SQE; the kernel may still be
+ * reading it long after rbufs it was forwarded from are reused. Sends queued
+ * anywhere during one pass of the event loop go to the kernel with a single
+ * io_uring_submit(): completions are reaped, and new work submitted, by one
+ * libevent callback on an eventfd the ring signals. Anything which queues
+ * work outside of that callback makes it run once more before the loop
+ * sleeps.
+ */
+
+#include "proxy.h"
+#include "uring.h"
+
+int dpm_io_uring = 0;
+
+#ifdef HAVE_LIBURING
+
+#include <sys/eventfd.h>
+#include <sys/utsname.h>
+#include <liburing.h>
+
+/* Low bits of the user_data say which operation finished. Cancels use 0
+ * and are ignored. */
+#define UOP_RECV 1
+#define UOP_SEND 2
+#define UOP_MASK 3
+#define UOP_BATCH 64
+
+typedef struct {
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    unsigned char *bufs;
+    int      efd;
+    struct event ev;
+    int      batch; /* Inside the completion loop; it submits at the end. */
+    int      kicked; /* The loop has been asked to run again. */
+    uring_conn *starved; /* Recvs which ran out of buffers. */
+} uring_worker;
+
+static __thread uring_worker *uring_self = NULL;
+
+static struct io_uring_sqe *_uring_sqe(void)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&uring_self->ring);
+
+    /* Full; push what we have and try again. */
+    if (sqe == NULL) {
+        io_uring_submit(&uring_self->ring);
+        dpm_self->stats.uring_submits++;
+        sqe = io_uring_get_sqe(&uring_self->ring);
+    }
+    return sqe;
+}
+
+/* Make sure queued work is submitted before the event loop sleeps. */
+static void _uring_kick(void)
+{
+    if (uring_self->batch || uring_self->kicked)
+        return;
+    uring_self->kicked = 1;
+    event_active(&uring_self->ev, EV_READ, 1);
+}
+
+static int _uring_arm_recv(uring_conn *uc)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uc->recv_armed || uc->paused || uc->c == NULL)
+        return 0;
+    if ( (sqe = _uring_sqe()) == NULL)
+        return -1;
+
+    io_uring_prep_recv_multishot(sqe, uc->fd, NULL, 0, 0);
+    sqe->flags    |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)uc | UOP_RECV);
+    uc->recv_armed = 1;
+    uc->ops++;
+    _uring_kick();
+    return 0;
+}
+
+static void _uring_cancel_recv(uring_conn *uc)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!uc->recv_armed || (sqe = _uring_sqe()) == NULL)
+        return;
+    io_uring_prep_cancel64(sqe, (uint64_t)(uintptr_t)uc | UOP_RECV, 0);
+    io_uring_sqe_set_data64(sqe, 0);
+    _uring_kick();
+}
+
+static int _uring_send(uring_conn *uc)
+{
+    struct io_uring_sqe *sqe;
+
+    if ( (sqe = _uring_sqe()) == NULL)
+        return -1;
+
+    io_uring_prep_send(sqe, uc->fd, uc->sbuf + uc->soff, uc->slen - uc->soff, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)uc | UOP_SEND);
+    uc->sending = 1;
+    uc->ops++;
+    uc->c->write_calls++;
+    _uring_kick();
+    return 0;
+}
+
+static void _uring_free_sbuf(uring_conn *uc)
+{
+    if (uc->sbuf)
+        bufpool_put(uc->sbuf, uc->sbufsize);
+    uc->sbuf     = NULL;
+    uc->sbufsize = 0;
+}
+
+/* A closed conn's state goes once nothing refers to it. */
+static void _uring_release(uring_conn *uc)
+{
+    if (uc->c != NULL || uc->ops || uc->starved)
+        return;
+    _uring_free_sbuf(uc);
+    free(uc);
+}
+
+static void _uring_recv_done(uring_conn *uc, int res, unsigned int flags)
+{
+    unsigned char *buf = NULL;
+    int bid = 0;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        uc->recv_armed = 0;
+        uc->ops--;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = uring_self->bufs + (size_t)bid * URING_BUF_SIZE;
+    }
+
+    if (uc->c != NULL) {
+        if (res > 0) {
+            conn_received(uc->c, buf, res);
+        } else if (res == -ENOBUFS) {
+            /* Buffers go back as soon as they're copied out; try again
+             * once this batch has returned some. */
+            if (!uc->starved) {
+                uc->starved = 1;
+                uc->next_starved = uring_self->starved;
+                uring_self->starved = uc;
+            }
+        } else if (res == 0) {
+            conn_received(uc->c, NULL, 0);
+        } else if (res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+            if (verbose)
+                fprintf(stderr, "recv on %d: %s\n", uc->fd, strerror(-res));
+            conn_received(uc->c, NULL, -1);
+        }
+    }
+
+    if (buf) {
+        io_uring_buf_ring_add(uring_self->br, buf, URING_BUF_SIZE, bid,
+            io_uring_buf_ring_mask(URING_BUFS), 0);
+        io_uring_buf_ring_advance(uring_self->br, 1);
+    }
+
+    /* Multishot recvs end now and then, and a pause may have been undone
+     * while its cancel was on the way; start another. Not after EOF. */
+    if (!uc->starved && res != 0)
+        _uring_arm_recv(uc);
+}
+
+static void _uring_send_done(uring_conn *uc, int res)
+{
+    conn *c = uc->c;
+
+    uc->ops--;
+    uc->sending = 0;
+
+    if (c == NULL)
+        return;
+
+    if (res == -EINTR || res == -EAGAIN) {
+        _uring_send(uc);
+        return;
+    }
+    if (res <= 0) {
+        if (verbose)
+            fprintf(stderr, "send on %d: %s\n", uc->fd, res ? strerror(-res) : "closed");
+        _uring_free_sbuf(uc);
+        handle_close(c);
+        return;
+    }
+
+    dpm_self->stats.bytes_written += res;
+    c->wpending -= res;
+    uc->soff    += res;
+
+    /* The rest of a short send goes before anything queued since. */
+    if (uc->soff < uc->slen) {
+        _uring_send(uc);
+        return;
+    }
+
+    _uring_free_sbuf(uc);
+    conn_sent(c);
+}
+
+static void _uring_complete(struct io_uring_cqe *cqe)
+{
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    uring_conn *uc = (uring_conn *)(uintptr_t)(data & ~(uint64_t)UOP_MASK);
+
+    if (data == 0)
+        return;
+
+    /* Handling it can close the conn; keep uc until we're done with it. */
+    uc->ops++;
+    switch (data & UOP_MASK) {
+    case UOP_RECV:
+        _uring_recv_done(uc, cqe->res, cqe->flags);
+        break;
+    case UOP_SEND:
+        _uring_send_done(uc, cqe->res);
+        break;
+    }
+    uc->ops--;
+    _uring_release(uc);
+}
+
+/* The ring signalled its eventfd, or work was queued: reap completions,
+ * then submit everything queued while handling them in one go. */
+static void _uring_event(int fd, short which, void *arg)
+{
+    struct io_uring_cqe *cqes[UOP_BATCH];
+    uring_conn *uc;
+    uint64_t n;
+    unsigned int count, i;
+
+    uring_self->kicked = 0;
+    if (read(uring_self->efd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("Reading io_uring eventfd");
+
+    conn_reap();
+    uring_self->batch++;
+    while ( (count = io_uring_peek_batch_cqe(&uring_self->ring, cqes, UOP_BATCH)) > 0 ) {
+        for (i = 0; i < count; i++)
+            _uring_complete(cqes[i]);
+        io_uring_cq_advance(&uring_self->ring, count);
+        dpm_self->stats.uring_completions += count;
+    }
+
+    while ( (uc = uring_self->starved) != NULL ) {
+        uring_self->starved = uc->next_starved;
+        uc->starved = 0;
+        _uring_arm_recv(uc);
+        _uring_release(uc);
+    }
+    uring_self->batch--;
+
+    /* Those just handled probably queued some writes. */
+    dpm_flush_conns();
+
+    if (io_uring_sq_ready(&uring_self->ring)) {
+        io_uring_submit(&uring_self->ring);
+        dpm_self->stats.uring_submits++;
+    }
+}
+
+/* Can this kernel do multishot recv from a provided buffer ring? That's
+ * 6.0 or later. Called by main() before any worker starts. */
+int uring_probe(void)
+{
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    struct utsname u;
+    int major = 0, minor = 0;
+    int ret;
+
+    if (uname(&u) == -1 || sscanf(u.release, "%d.%d", &major, &minor) != 2 ||
+        major < 6) {
+        fprintf(stderr, "io_uring engine needs Linux 6.0 or later\n");
+        return -1;
+    }
+
+    if ( (ret = io_uring_queue_init(8, &ring, 0)) < 0) {
+        fprintf(stderr, "io_uring_queue_init(): %s\n", strerror(-ret));
+        return -1;
+    }
+    br = io_uring_setup_buf_ring(&ring, 8, URING_BGID, 0, &ret);
+    if (br == NULL) {
+        fprintf(stderr, "io_uring buffer rings unsupported: %s\n", strerror(-ret));
+        io_uring_queue_exit(&ring);
+        return -1;
+    }
+    io_uring_free_buf_ring(&ring, br, 8, URING_BGID);
+    io_uring_queue_exit(&ring);
+
+    return 0;
+}
+
+/* Per worker: a ring, its buffers, and the eventfd libevent watches. */
+int uring_init(void)
+{
+    uring_worker *w;
+    int ret, i;
+
+    w = (uring_worker *)calloc(1, sizeof(uring_worker));
+    if (w == NULL) {
+        perror("Could not calloc()");
+        return -1;
+    }
+
+    if ( (ret = io_uring_queue_init(URING_ENTRIES, &w->ring, 0)) < 0) {
+        fprintf(stderr, "io_uring_queue_init(): %s\n", strerror(-ret));
+        free(w);
+        return -1;
+    }
+
+    w->br = io_uring_setup_buf_ring(&w->ring, URING_BUFS, URING_BGID, 0, &ret);
+    w->bufs = (unsigned char *)malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (w->br == NULL || w->bufs == NULL) {
+        fprintf(stderr, "Could not set up io_uring receive buffers\n");
+        return -1;
+    }
+    for (i = 0; i < URING_BUFS; i++) {
+        io_uring_buf_ring_add(w->br, w->bufs + (size_t)i * URING_BUF_SIZE,
+            URING_BUF_SIZE, i, io_uring_buf_ring_mask(URING_BUFS), i);
+    }
+    io_uring_buf_ring_advance(w->br, URING_BUFS);
+
+    if ( (w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd()");
+        return -1;
+    }
+    if (io_uring_register_eventfd(&w->ring, w->efd) < 0) {
+        fprintf(stderr, "Could not register io_uring eventfd\n");
+        return -1;
+    }
+
+    event_set(&w->ev, w->efd, EV_READ | EV_PERSIST, _uring_event, NULL);
+    event_base_set(dpm_base, &w->ev);
+    if (event_add(&w->ev, NULL) == -1) {
+        fprintf(stderr, "Could not watch io_uring eventfd\n");
+        return -1;
+    }
+
+    uring_self = w;
+    return 0;
+}
+
+/* Start reading a new conn. */
+int uring_conn_start(conn *c)
+{
+    uring_conn *uc = (uring_conn *)calloc(1, sizeof(uring_conn));
+
+    if (uc == NULL) {
+        perror("Could not calloc()");
+        return -1;
+    }
+    uc->c  = c;
+    uc->fd = c->fd;
+    c->uring = uc;
+
+    return _uring_arm_recv(uc);
+}
+
+/* handle_close(): the conn is going away, maybe with a recv or a send still
+ * in flight. Those find uc->c is NULL when they finish. */
+void uring_conn_close(conn *c)
+{
+    uring_conn *uc = c->uring;
+
+    if (uc == NULL)
+        return;
+    c->uring = NULL;
+    uc->c = NULL;
+    _uring_cancel_recv(uc);
+    _uring_release(uc);
+}
+
+void uring_pause_read(conn *c)
+{
+    if (c->uring == NULL)
+        return;
+    c->uring->paused = 1;
+    _uring_cancel_recv(c->uring);
+}
+
+void uring_resume_read(conn *c)
+{
+    if (c->uring == NULL)
+        return;
+    c->uring->paused = 0;
+    _uring_arm_recv(c->uring);
+}
+
+/* handle_write() for the io_uring engine. One send per conn in flight at a
+ * time; when it's done, conn_sent() comes back here for whatever's been
+ * queued since. Returns -1 if the conn should be closed. */
+int uring_write(conn *c)
+{
+    uring_conn *uc = c->uring;
+    int len;
+
+    if (uc == NULL || uc->sending)
+        return 0;
+
+    len = conn_take_writes(c, &uc->sbuf, &uc->sbufsize);
+    if (len <= 0)
+        return len;
+
+    uc->soff = 0;
+    uc->slen = len;
+    return _uring_send(uc);
+}
+
+#else /* HAVE_LIBURING */
+
+int uring_probe(void)
+{
+    fprintf(stderr, "DPM was built without liburing\n");
+    return -1;
+}
+
+int uring_init(void)
+{
+    return -1;
+}
+
+int uring_conn_start(conn *c)
+{
+    return -1;
+}
+
+void uring_conn_close(conn *c)
+{
+}
+
+void uring_pause_read(conn *c)
+{
+}
+
+void uring_resume_read(conn *c)
+{
+}
+
+int uring_write(conn *c)
+{
+    return -1;
+}
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,46 @@
+/*
+ *  Copyright 2008 Dormando (dormando@rydia.net).  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+*/
+
+/* Optional io_uring I/O engine. See uring.c */
+
+#ifndef URING_H
+#define URING_H
+
+#define URING_ENTRIES 1024 /* Submission queue size per worker. */
+#define URING_BUFS 256 /* Provided receive buffers per worker. Power of two. */
+#define URING_BUF_SIZE 16384
+#define URING_BGID 1 /* Buffer group id of the receive buffers. */
+
+/* Per conn state. Completions can arrive after the conn is closed and its
+ * struct recycled, so this lives on its own until the last one is in. */
+typedef struct uring_conn {
+    conn    *c; /* NULL once the conn is closed. */
+    int      fd;
+    int      ops; /* Operations in flight. */
+    uint8_t  recv_armed; /* A multishot recv is posted. */
+    uint8_t  paused; /* Reads are paused; don't re-arm. */
+    uint8_t  sending; /* A send is in flight, from sbuf. */
+    uint8_t  starved; /* On the list to re-arm after ENOBUFS. */
+    unsigned char *sbuf; /* What's being sent. Ours alone until it's done. */
+    int      sbufsize;
+    int      soff; /* bytes of sbuf sent */
+    int      slen;
+    struct uring_conn *next_starved;
+} uring_conn;
+
+/* Set by --io=uring, once uring_probe() says the kernel can do it. */
+extern int dpm_io_uring;
+
+int uring_probe(void);
+int uring_init(void);
+int uring_conn_start(conn *c);
+void uring_conn_close(conn *c);
+void uring_pause_read(conn *c);
+void uring_resume_read(conn *c);
+int uring_write(conn *c);
+
+#endif /* URING_H */